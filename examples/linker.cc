@@ -85,5 +85,33 @@ int main() {
   cout << "f2() = " << f2.call<size_t>() << endl;
   cout << endl;
 
+	// Example 4:
+	// Functions can also be added one at a time. References are patched as
+	// soon as the labels they name are defined.
+	lnkr.start();
+	lnkr.add(f2);
+	cout << "Pending references: " << lnkr.pending() << endl;
+	lnkr.add(f1);
+	cout << "Pending references: " << lnkr.pending() << endl;
+  cout << "f2() = " << f2.call<size_t>() << endl;
+  cout << endl;
+
+	// Example 5:
+	// Given a resolver, calls to labels which aren't defined go through stubs
+	// which ask the resolver to define them the first time they are taken.
+	lnkr.start();
+	lnkr.set_resolver([&lnkr, &f1](uint64_t id) {
+		if (id != Label{"f1"}) {
+			return false;
+		}
+		cout << "Resolving f1" << endl;
+		lnkr.add(f1);
+		return true;
+	});
+	lnkr.add(f2);
+	cout << "Pending references: " << lnkr.pending() << endl;
+  cout << "f2() = " << f2.call<size_t>() << endl;
+  cout << "f2() = " << f2.call<size_t>() << endl;
+
   return 0;
 }
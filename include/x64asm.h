@@ -19,16 +19,24 @@ limitations under the License.
 
 #include "src/assembler.h"
 #include "src/code.h"
+#include "src/code_arena.h"
+#include "src/code_cache.h"
 #include "src/constants.h"
+#include "src/decoder.h"
+#include "src/elf_loader.h"
+#include "src/elf_reader.h"
+#include "src/elf_writer.h"
 #include "src/env_bits.h"
 #include "src/env_reg.h"
 #include "src/flag.h"
 #include "src/flag_set.h"
 #include "src/function.h"
 #include "src/hint.h"
+#include "src/image.h"
 #include "src/imm.h"
 #include "src/instruction.h"
 #include "src/label.h"
+#include "src/length_decoder.h"
 #include "src/linker.h"
 #include "src/m.h"
 #include "src/mm.h"
@@ -1211,6 +1211,7 @@ assm_src_defn i = "void Assembler::" ++
                   (assm_arg_list i) ++
                   ") {\n" ++
                   assm_debug_begin i ++
+                  "  if (!grow(max_length_)) {\n    return;\n  }\n\n" ++
                   body i ++ 
                   assm_debug_end i ++ 
                   "}"
@@ -1244,6 +1245,136 @@ assm_case i = "case " ++ (opcode_enum i) ++ ":\n" ++
 assm_cases :: [Instr] -> String
 assm_cases is = intercalate "\n" $ map assm_case is
 
+-- Assembler encoding table
+--------------------------------------------------------------------------------
+
+-- Converts an "argN" string to an operand index
+arg_index :: String -> String
+arg_index ('a':'r':'g':n) = n
+arg_index _ = "-1"
+
+-- Explicit MOD/RM args as a pair of (rm, r) operand indices
+enc_rm_args :: Instr -> (String, String)
+enc_rm_args i = case splitOn "," (rm_args i) of
+  [rm,r] -> (arg_index rm, arg_index r)
+  [rm]   -> (arg_index rm, "-1")
+  _      -> ("-1", "-1")
+
+-- Encoding flag bits
+enc_flags :: Instr -> String
+enc_flags i = "0" ++ (concat (map (("|Encoding::"++).fst) (filter snd fs)))
+  where ps = opcode_prefix i
+        os = operands i
+        vex = is_vex_encoded i
+        rm = fst (enc_rm_args i)
+        fs = [("FWAIT",   not vex && "9B" `elem` ps),
+              ("PREF_66", not vex && ("PREF.66+" `elem` ps || "66" `elem` ps)),
+              ("PREF_F2", not vex && "F2" `elem` ps),
+              ("PREF_F3", not vex && "F3" `elem` ps),
+              ("VEX",     vex),
+              ("VEX_L",   vex && vex_l i == "0x1"),
+              ("VEX_W",   vex && vex_w i == "0x1"),
+              ("MEM",     rm /= "-1" && mem_op (os !! (read rm))),
+              ("HINT",    "hint" `elem` os),
+              ("REX_O",   op_en i == "O" || op_en i == "OI"),
+              ("II",      op_en i == "II"),
+              ("IS4",     "/is4" `elem` opcode_suffix i),
+              ("LABEL",   "label" `elem` os)]
+
+-- Implied rex bits
+enc_rex :: Instr -> String
+enc_rex i
+  | "REX.W+" `elem` (opcode_prefix i) = "0x48"
+  | "REX.R+" `elem` (opcode_prefix i) = "0x44"
+  | "REX+"   `elem` (opcode_prefix i) = "0x40"
+  | otherwise = "0x00"
+
+-- Opcode bytes (VEX instructions have exactly one)
+enc_opcode :: Instr -> [String]
+enc_opcode i
+  | is_vex_encoded i = [(opcode_terms i)!!1]
+  | otherwise = opcode_bytes i
+
+-- Operand index which is added to the last opcode byte
+enc_opcode_reg :: Instr -> String
+enc_opcode_reg i = case findIndex (=='O') (op_en i) of
+  (Just idx) -> if is_vex_encoded i then "-1" else show idx
+  Nothing -> "-1"
+
+-- Operand index which may contribute segment and address size prefixes
+enc_mem :: Instr -> String
+enc_mem i = case findIndex mem_op (operands i) of
+  (Just idx) -> show idx
+  Nothing -> "-1"
+
+-- Mod r/m digit
+enc_digit :: Instr -> String
+enc_digit i = case find is_digit (opcode_suffix i) of
+  (Just ('/':d:[])) -> [d]
+  _ -> "-1"
+
+-- Operand index of a displacement or immediate
+enc_imm :: Instr -> String
+enc_imm i = case disp_imm_index i of
+  (Just idx) -> show idx
+  Nothing -> "-1"
+
+-- Number of displacement or immediate bytes
+enc_imm_size :: Instr -> String
+enc_imm_size i
+  | op_en i == "II" = "3"
+  | otherwise = case disp_imm_index i of
+                     (Just idx) -> size ((operands i) !! idx)
+                     Nothing -> "0"
+  where size "imm8"  = "1"
+        size "imm16" = "2"
+        size "imm32" = "4"
+        size "rel8"  = "1"
+        size "rel32" = "4"
+        size "label" = "4"
+        size _       = "8"
+
+-- VEX mmmmm bits
+enc_vex_mmmmm :: Instr -> String
+enc_vex_mmmmm i
+  | is_vex_encoded i = vex_mmmmm i
+  | otherwise = "0x00"
+
+-- VEX pp bits
+enc_vex_pp :: Instr -> String
+enc_vex_pp i
+  | is_vex_encoded i = vex_pp i
+  | otherwise = "0x0"
+
+-- VEX vvvv operand index
+enc_vex_vvvv :: Instr -> String
+enc_vex_vvvv i = case findIndex (=='V') (op_en i) of
+  (Just idx) -> show idx
+  Nothing -> "-1"
+
+-- Converts an instruction to an encoding table row
+encoding_row :: Instr -> String
+encoding_row i = "{" ++ intercalate "," row ++ "}"
+  where bs = map (("0x"++).low) (enc_opcode i)
+        row = [enc_flags i,
+               enc_rex i,
+               show (length bs),
+               "{" ++ intercalate "," (take 3 (bs ++ repeat "0x00")) ++ "}",
+               enc_opcode_reg i,
+               enc_mem i,
+               fst (enc_rm_args i),
+               snd (enc_rm_args i),
+               enc_digit i,
+               enc_imm i,
+               enc_imm_size i,
+               enc_vex_mmmmm i,
+               enc_vex_pp i,
+               enc_vex_vvvv i]
+
+-- Converts all instructions to encoding table
+encoding_table :: [Instr] -> String
+encoding_table is = to_table is encoding_row
+
 -- Instruction ordering
 --------------------------------------------------------------------------------
 
@@ -1325,6 +1456,7 @@ write_code :: [Instr] -> IO ()
 write_code is = do writeFile "assembler.decl"    $ assm_header_decls is
                    writeFile "assembler.defn"    $ assm_src_defns is
                    writeFile "assembler.switch"  $ assm_cases is
+                   writeFile "encoding.table"    $ encoding_table is
                    writeFile "arity.table"       $ arity_table is
                    writeFile "properties.table"  $ properties_table is
                    writeFile "type.table"        $ type_table is
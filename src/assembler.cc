@@ -16,22 +16,292 @@ limitations under the License.
 
 #include "src/assembler.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <thread>
 
 #include "src/constants.h"
+#include "src/encoding_table.h"
+#include "src/parallel.h"
 
 using namespace std;
 
+namespace {
+
+/** The largest power accepted by alignment directives; Instruction::check()
+    enforces the same limit.
+*/
+constexpr size_t max_power = 15;
+
+/** Returns the number of bytes required to pad pos to a multiple of
+    2^power, or zero if more than a non-zero max_skip bytes are required or
+    power is out of range.
+*/
+size_t align_pad(size_t pos, size_t power, size_t max_skip) {
+  if (power > max_power) {
+    return 0;
+  }
+  const auto pad = (0 - pos) & (((size_t)1 << power) - 1);
+  return (max_skip != 0 && pad > max_skip) ? 0 : pad;
+}
+
+/** Returns the number of bytes required to move span bytes starting at pos
+    to the next 32-byte boundary, or zero if they neither cross nor end on
+    one.
+*/
+size_t boundary_pad(size_t pos, size_t span) {
+  return (pos >> 5) != ((pos + span) >> 5) ? 32 - (pos & 31) : 0;
+}
+
+/** Writes n bytes of padding using the fewest possible multi-byte nops.
+    See Table 4-12: Intel Manual Vol 2B 4-167.
+*/
+void write_nops(unsigned char* buf, size_t n) {
+  static const uint8_t nops[9][9] {
+    {0x90},
+    {0x66, 0x90},
+    {0x0f, 0x1f, 0x00},
+    {0x0f, 0x1f, 0x40, 0x00},
+    {0x0f, 0x1f, 0x44, 0x00, 0x00},
+    {0x66, 0x0f, 0x1f, 0x44, 0x00, 0x00},
+    {0x0f, 0x1f, 0x80, 0x00, 0x00, 0x00, 0x00},
+    {0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00},
+    {0x66, 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00}
+  };
+  while (n > 0) {
+    const auto len = min(n, (size_t)9);
+    memcpy(buf, nops[len-1], len);
+    buf += len;
+    n -= len;
+  }
+}
+
+} // namespace
+
 namespace x64asm {
 
+namespace {
+
+/** A buffer for a single instruction. Instructions are at most 15 bytes
+    long, so writes require no capacity checks.
+*/
+struct Stage {
+  /** Encoded bytes; padded to allow a single 16-byte copy. */
+  uint8_t bytes[16];
+  /** Number of encoded bytes. */
+  size_t size;
+  /** Offset of a label displacement, or -1 if there is none. */
+  int rel;
+
+  void emit_byte(uint64_t b) {
+    bytes[size++] = b;
+  }
+  void emit_word(uint64_t w) {
+    memcpy(bytes + size, &w, 2);
+    size += 2;
+  }
+  void emit_long(uint64_t l) {
+    memcpy(bytes + size, &l, 4);
+    size += 4;
+  }
+  void emit_quad(uint64_t q) {
+    memcpy(bytes + size, &q, 8);
+    size += 8;
+  }
+};
+
+} // namespace
+
 // void Assembler::adcb(Al arg0, Imm8 arg1) { } ...
 #include "src/assembler.defn"
 
+const Encoding* const Assembler::encodings_ = encoding_table;
+
 void Assembler::assemble(const Instruction& instr) {
+  if (instr.get_opcode() == LABEL_DEFN) {
+    bind(instr.get_operand<Label>(0));
+  } else if (instr.get_opcode() == P2ALIGN) {
+    p2align(instr.get_operand<Imm8>(0).val_, instr.get_operand<Imm8>(1).val_);
+  } else if (!cache_.empty()) {
+    assemble_cached(instr);
+  } else {
+    assemble_engine(instr);
+  }
+}
+
+void Assembler::p2align(size_t power, size_t max_skip) {
+  if (power > max_power) {
+    return;
+  }
+  const auto pos = fxn_->size();
+  const auto pad = align_pad(pos, power, max_skip);
+
+  if (!grow(pad)) {
+    return;
+  }
+  write_nops(fxn_->head_, pad);
+  fxn_->head_ += pad;
+
+  aligns_.push_back(Align {pos, pad, power, max_skip, 0});
+}
+
+bool Assembler::is_fusible(const Instruction& instr) {
+  // See Section 3.4.2.2: Intel Optimization Reference Manual
+  const auto& e = encodings_[instr.get_opcode()];
+  if ((e.flags & Encoding::VEX) || e.opc_len != 1) {
+    return false;
+  }
+  const auto o = e.opc[0];
+  switch (o) {
+    // add, and, sub, and cmp with an immediate
+    case 0x80:
+    case 0x81:
+    case 0x83:
+      return e.digit == 0 || e.digit == 4 || e.digit == 5 || e.digit == 7;
+    // test with an immediate
+    case 0xf6:
+    case 0xf7:
+      return e.digit == 0;
+    // inc and dec
+    case 0xfe:
+    case 0xff:
+      return e.digit == 0 || e.digit == 1;
+    // test with a register or an accumulator immediate
+    case 0x84:
+    case 0x85:
+    case 0xa8:
+    case 0xa9:
+      return true;
+    // add, and, sub, and cmp with a register or an accumulator immediate
+    default:
+      return o <= 0x05 || (o >= 0x20 && o <= 0x25) ||
+             (o >= 0x28 && o <= 0x2d) || (o >= 0x38 && o <= 0x3d);
+  }
+}
+
+size_t Assembler::branch_span(const Code& code, size_t index) const {
+  const auto& instr = code[index];
+  const auto fused = [&code](size_t i) {
+    return i + 1 < code.size() && is_fusible(code[i]) && code[i+1].is_jcc();
+  };
+
+  if (fused(index)) {
+    return length(instr) + length(code[index+1]);
+  } else if (index > 0 && fused(index-1)) {
+    return 0;
+  } else if (instr.is_any_jump() || instr.is_call() || instr.is_ret()) {
+    return length(instr);
+  }
+  return 0;
+}
+
+void Assembler::pad_branch(const Code& code, size_t index) {
+  const auto span = branch_span(code, index);
+  if (span == 0) {
+    return;
+  }
+
+  const auto pos = fxn_->size();
+  const auto pad = boundary_pad(pos, span);
+
+  if (!grow(pad)) {
+    return;
+  }
+  write_nops(fxn_->head_, pad);
+  fxn_->head_ += pad;
+  jcc_padding_ += pad;
+
+  aligns_.push_back(Align {pos, pad, 0, 0, span});
+}
+
+bool Assembler::grow_buffer(size_t n) {
+  const auto size = fxn_->size();
+  if (fxn_->good() &&
+      (fxn_->reserve(max(2 * fxn_->capacity(), size + n)) ||
+       fxn_->reserve(size + n))) {
+    return true;
+  }
+  // What has been emitted is incomplete, so nothing is left to patch
+  fxn_->unmap();
+  fxn_->label_rels_.clear();
+  aligns_.clear();
+  return false;
+}
+
+void Assembler::set_cache_size(size_t entries) {
+  size_t size = entries == 0 ? 0 : 1;
+  while (size < entries) {
+    size <<= 1;
+  }
+
+  CacheEntry empty;
+  empty.key.fill(0);
+  empty.len = 0;
+  empty.rel = -1;
+  cache_.assign(size, empty);
+}
+
+void Assembler::assemble_cached(const Instruction& instr) {
+  // Key on the opcode and every operand bit; unused operands are zero
+  array<uint64_t, 9> key;
+  key.fill(0);
+  key[0] = instr.get_opcode();
+  const auto words = 1 + 2 * instr.arity();
+  for (size_t i = 1; i < words; i += 2) {
+    const auto& o = instr.get_operand<Operand>(i/2);
+    key[i] = o.val_;
+    key[i+1] = o.val2_;
+  }
+
+  // Multiply-xorshift mixing of every word (see MurmurHash3's fmix64)
+  uint64_t h = 0x9e3779b97f4a7c15ull;
+  for (size_t i = 0; i < words; ++i) {
+    h ^= key[i];
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+  }
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
+
+  // Keys with equal opcodes have equal arity, so trailing words match
+  auto& e = cache_[h & (cache_.size() - 1)];
+  if (e.len != 0 && equal(key.begin(), key.begin() + words, e.key.begin())) {
+    ++cache_hits_;
+    const auto pos = fxn_->size();
+    if (fxn_->remaining() >= 16) {
+      memcpy(fxn_->head_, e.bytes, 16);
+    } else if (grow(e.len)) {
+      memcpy(fxn_->head_, e.bytes, e.len);
+    } else {
+      return;
+    }
+    fxn_->head_ += e.len;
+    if (e.rel != -1) {
+      const auto label = instr.get_operand<Label>(encodings_[key[0]].imm);
+      fxn_->label_rels_.push_back(make_pair(pos + e.rel,
+                                            local_label(label.val_)));
+    }
+    return;
+  }
+
+  ++cache_misses_;
+  const auto pos = fxn_->size();
+  const auto rels = fxn_->label_rels_.size();
+  assemble_engine(instr);
+  if (!fxn_->good()) {
+    return;
+  }
+
+  e.key = key;
+  e.len = fxn_->size() - pos;
+  memcpy(e.bytes, fxn_->buffer_ + pos, e.len);
+  e.rel = fxn_->label_rels_.size() == rels ? -1 :
+          fxn_->label_rels_.back().first - pos;
+}
+
+void Assembler::assemble_switch(const Instruction& instr) {
   switch (instr.get_opcode()) {
-    case LABEL_DEFN:
-      bind(instr.get_operand<Label>(0));
-      break;
       // 4000-way switch
       #include "src/assembler.switch"
 
@@ -40,16 +310,826 @@ void Assembler::assemble(const Instruction& instr) {
   }
 }
 
-template <typename T>
-void Assembler::mod_rm_sib(const M<T>& rm, const Operand& r) {
+void Assembler::assemble_table(const Instruction& instr) {
+  #ifdef DEBUG_ASSEMBLER
+    size_t debug_i = fxn_->size();
+  #endif
+
+  if (!grow(max_length_)) {
+    return;
+  }
+  const auto& e = encodings_[instr.get_opcode()];
+  const auto mem = (e.flags & Encoding::MEM) != 0;
+  const auto& r = e.digit != -1 ? r64s[e.digit] :
+                  instr.get_operand<Operand>(e.r == -1 ? 0 : e.r);
+
+  // Prefix ordering matches the generated methods (gcc prefers this)
+  if (e.flags & Encoding::FWAIT) {
+    pref_fwait(0x9b);
+  }
+  if (e.flags & Encoding::HINT) {
+    pref_group2(instr.get_operand<Hint>(1));
+  } else if (e.mem != -1) {
+    pref_group2(instr.get_operand<M8>(e.mem));
+  }
+
+  if (e.flags & Encoding::VEX) {
+    if (e.mem != -1) {
+      pref_group4(instr.get_operand<M8>(e.mem));
+    }
+
+    const uint8_t l = (e.flags & Encoding::VEX_L) ? 0x1 : 0x0;
+    const uint8_t w = (e.flags & Encoding::VEX_W) ? 0x1 : 0x0;
+    const auto& vvvv = e.vvvv != -1 ? instr.get_operand<Operand>(e.vvvv) :
+                       (const Operand&)xmm0;
+    if (e.rm == -1) {
+      vex(e.vex_mmmmm, l, e.vex_pp, w, vvvv);
+    } else if (mem) {
+      vex(e.vex_mmmmm, l, e.vex_pp, w, vvvv, instr.get_operand<M8>(e.rm), r);
+    } else {
+      vex(e.vex_mmmmm, l, e.vex_pp, w, vvvv, instr.get_operand<Operand>(e.rm), r);
+    }
+    opcode(e.opc[0]);
+  } else {
+    if (e.mem != -1) {
+      pref_group4(instr.get_operand<M8>(e.mem));
+    }
+    if (e.flags & Encoding::PREF_66) {
+      pref_group3();
+    }
+    if (e.flags & Encoding::PREF_F2) {
+      pref_group1(0xf2);
+    } else if (e.flags & Encoding::PREF_F3) {
+      pref_group1(0xf3);
+    }
+
+    if (e.flags & Encoding::REX_O) {
+      rex(instr.get_operand<Operand>(0), e.rex);
+    } else if (e.rm == -1) {
+      if (e.rex) {
+        rex(e.rex);
+      }
+    } else if (mem) {
+      if (e.r != -1) {
+        rex(instr.get_operand<M8>(e.rm), r, e.rex);
+      } else {
+        rex(instr.get_operand<M8>(e.rm), e.rex);
+      }
+    } else {
+      if (e.r != -1) {
+        rex(instr.get_operand<Operand>(e.rm), r, e.rex);
+      } else {
+        rex(instr.get_operand<Operand>(e.rm), e.rex);
+      }
+    }
+
+    if (e.opc_len > 0) {
+      const auto last = e.opc_len - 1;
+      for (auto i = 0; i < last; ++i) {
+        opcode(e.opc[i]);
+      }
+      const auto delta = e.opc_reg == -1 ? 0 :
+                         instr.get_operand<Operand>(e.opc_reg).val_ & 0x7;
+      opcode(e.opc[last] + delta);
+    }
+  }
+
+  // Mod R/M and SIB bytes
+  if (e.rm != -1) {
+    if (mem) {
+      mod_rm_sib(instr.get_operand<M8>(e.rm), r);
+    } else {
+      mod_rm_sib(instr.get_operand<Operand>(e.rm), r);
+    }
+  }
+
+  // Displacement or immediate bytes
+  if (e.flags & Encoding::II) {
+    disp_imm(instr.get_operand<Imm8>(0), instr.get_operand<Imm16>(1));
+  } else if (e.imm != -1) {
+    const auto val = instr.get_operand<Operand>(e.imm).val_;
+    switch (e.imm_size) {
+      case 1:
+        fxn_->emit_byte(val);
+        break;
+      case 2:
+        fxn_->emit_word(val);
+        break;
+      case 4:
+        if (e.flags & Encoding::LABEL) {
+          disp_imm(instr.get_operand<Label>(e.imm));
+        } else {
+          fxn_->emit_long(val);
+        }
+        break;
+      default:
+        fxn_->emit_quad(val);
+        break;
+    }
+  }
+
+  // VEX register encoded as an immediate
+  if (e.flags & Encoding::IS4) {
+    disp_imm(instr.get_operand<Xmm>(3));
+  }
+
+  #ifdef DEBUG_ASSEMBLER
+    debug(instr, debug_i);
+  #endif
+}
+
+void Assembler::assemble_bulk(const Instruction& instr) {
+  #ifdef DEBUG_ASSEMBLER
+    size_t debug_i = fxn_->size();
+  #endif
+
+  static const uint8_t segs[6] {0x26, 0x2e, 0x36, 0x3e, 0x64, 0x65};
+
+  const auto& e = encodings_[instr.get_opcode()];
+  const auto mem = (e.flags & Encoding::MEM) != 0;
+  const auto& r = e.digit != -1 ? r64s[e.digit] :
+                  instr.get_operand<Operand>(e.r == -1 ? 0 : e.r);
+
+  Stage s;
+  s.size = 0;
+  s.rel = -1;
+
+  // Prefix ordering matches assemble_table()
+  if (e.flags & Encoding::FWAIT) {
+    s.emit_byte(0x9b);
+  }
+  if (e.flags & Encoding::HINT) {
+    s.emit_byte(instr.get_operand<Hint>(1).val_ == 0 ? 0x3e : 0x2e);
+  } else if (e.mem != -1 && instr.get_operand<M8>(e.mem).contains_seg()) {
+    s.emit_byte(segs[instr.get_operand<M8>(e.mem).get_seg().val_]);
+  }
+  if (e.mem != -1 && instr.get_operand<M8>(e.mem).addr_or()) {
+    s.emit_byte(0x67);
+  }
+
+  if (e.flags & Encoding::VEX) {
+    // See Figure 2-9: Intel Manual Vol 2A 2-14
+    const uint8_t l = (e.flags & Encoding::VEX_L) ? 0x1 : 0x0;
+    const uint8_t w = (e.flags & Encoding::VEX_W) ? 0x1 : 0x0;
+    const auto vvvv = e.vvvv != -1 ? instr.get_operand<Operand>(e.vvvv).val_ :
+                      xmm0.val_;
+    uint8_t r_bit = 0x80;
+    uint8_t x_bit = 0x40;
+    uint8_t b_bit = 0x20;
+    if (e.rm != -1) {
+      r_bit = (~r.val_ << 4) & 0x80;
+      if (mem) {
+        const auto& rm = instr.get_operand<M8>(e.rm);
+        if (rm.contains_index()) {
+          x_bit = (~rm.get_index().val_ << 3) & 0x40;
+        }
+        if (rm.contains_base()) {
+          b_bit = (~rm.get_base().val_ << 2) & 0x20;
+        }
+      } else {
+        b_bit = (~instr.get_operand<Operand>(e.rm).val_ << 2) & 0x20;
+      }
+    }
+
+    if (x_bit == 0x40 && b_bit == 0x20 && e.vex_mmmmm == 0x01 && w == 0) {
+      s.emit_byte(0xc5);
+      s.emit_byte(r_bit | ((~vvvv << 3) & 0x78) | (l << 2) | e.vex_pp);
+    } else {
+      s.emit_byte(0xc4);
+      s.emit_byte(r_bit | x_bit | b_bit | e.vex_mmmmm);
+      s.emit_byte((w << 7) | ((~vvvv << 3) & 0x78) | (l << 2) | e.vex_pp);
+    }
+    s.emit_byte(e.opc[0]);
+  } else {
+    if (e.flags & Encoding::PREF_66) {
+      s.emit_byte(0x66);
+    }
+    if (e.flags & Encoding::PREF_F2) {
+      s.emit_byte(0xf2);
+    } else if (e.flags & Encoding::PREF_F3) {
+      s.emit_byte(0xf3);
+    }
+
+    // See Figures 2.4 through 2.7: Intel Manual Vol 2A 2-8
+    if (e.flags & Encoding::REX_O) {
+      const uint8_t val = e.rex | (instr.get_operand<Operand>(0).val_ >> 3);
+      if (val) {
+        s.emit_byte(val | 0x40);
+      }
+    } else if (e.rm == -1) {
+      if (e.rex) {
+        s.emit_byte(e.rex);
+      }
+    } else {
+      uint8_t val = e.rex | (e.r != -1 ? ((r.val_ >> 1) & 0x4) : 0);
+      if (mem) {
+        const auto& rm = instr.get_operand<M8>(e.rm);
+        if (rm.contains_base()) {
+          val |= (rm.get_base().val_ >> 3);
+        }
+        if (rm.contains_index()) {
+          val |= ((rm.get_index().val_ >> 2) & 0x2);
+        }
+      } else {
+        val |= (instr.get_operand<Operand>(e.rm).val_ >> 3);
+      }
+      if (val) {
+        s.emit_byte(val | 0x40);
+      }
+    }
+
+    if (e.opc_len > 0) {
+      const auto last = e.opc_len - 1;
+      for (auto i = 0; i < last; ++i) {
+        s.emit_byte(e.opc[i]);
+      }
+      const auto delta = e.opc_reg == -1 ? 0 :
+                         instr.get_operand<Operand>(e.opc_reg).val_ & 0x7;
+      s.emit_byte(e.opc[last] + delta);
+    }
+  }
+
+  // Mod R/M and SIB bytes
+  if (e.rm != -1) {
+    if (mem) {
+      emit_mod_rm_sib(s, instr.get_operand<M8>(e.rm), r);
+    } else {
+      const auto& rm = instr.get_operand<Operand>(e.rm);
+      s.emit_byte(0xc0 | ((r.val_ << 3) & 0x38) | (rm.val_ & 0x7));
+    }
+  }
+
+  // Displacement or immediate bytes
+  if (e.flags & Encoding::II) {
+    s.emit_word(instr.get_operand<Imm16>(1).val_);
+    s.emit_byte(instr.get_operand<Imm8>(0).val_);
+  } else if (e.imm != -1) {
+    const auto val = instr.get_operand<Operand>(e.imm).val_;
+    switch (e.imm_size) {
+      case 1:
+        s.emit_byte(val);
+        break;
+      case 2:
+        s.emit_word(val);
+        break;
+      case 4:
+        if (e.flags & Encoding::LABEL) {
+          s.rel = s.size;
+          s.emit_long(0);
+        } else {
+          s.emit_long(val);
+        }
+        break;
+      default:
+        s.emit_quad(val);
+        break;
+    }
+  }
+
+  // VEX register encoded as an immediate
+  if (e.flags & Encoding::IS4) {
+    s.emit_byte(instr.get_operand<Xmm>(3).val_ << 4);
+  }
+
+  // A single capacity check; when there's room, one 16-byte store is cheaper
+  // than an exact copy even though it writes past the end of the instruction
+  const auto pos = fxn_->size();
+  if (fxn_->remaining() >= 16) {
+    memcpy(fxn_->head_, s.bytes, 16);
+  } else if (grow(s.size)) {
+    memcpy(fxn_->head_, s.bytes, s.size);
+  } else {
+    return;
+  }
+  fxn_->head_ += s.size;
+  if (s.rel != -1) {
+    const auto label = instr.get_operand<Label>(e.imm);
+    fxn_->label_rels_.push_back(make_pair(pos + s.rel,
+                                          local_label(label.val_)));
+  }
+
+  #ifdef DEBUG_ASSEMBLER
+    debug(instr, debug_i);
+  #endif
+}
+
+vector<Assembler::Handle> Assembler::assemble_all(Function& arena,
+    const vector<Code>& codes, size_t threads) {
+  if (threads == 0) {
+    threads = max(1u, thread::hardware_concurrency());
+  }
+  threads = max((size_t)1, min(threads, codes.size()));
+
+  // Each thread assembles into a private buffer and copies into the arena
+  vector<Assembler> assms(threads, *this);
+  vector<Function> scratch(threads);
+  vector<vector<uint64_t>> ids(codes.size());
+  vector<vector<size_t>> defs(codes.size());
+  vector<vector<pair<size_t, size_t>>> rels(codes.size());
+  atomic<bool> failed(false);
+  const auto assemble_code = [&](size_t t, size_t i) -> const Function& {
+    auto& fxn = scratch[t];
+    fxn.clear();
+    assms[t].assemble(fxn, codes[i]);
+    if (!fxn.good()) {
+      failed = true;
+    }
+    ids[i] = fxn.label_ids_;
+    defs[i] = fxn.label_defs_;
+    rels[i] = fxn.label_rels_;
+    return fxn;
+  };
+
+  // Exact lengths determine where each code is placed in the arena. Codes
+  // which contain alignment directives are placed at their largest alignment.
+  // Jcc erratum padding requires 32-byte alignment. Relaxation only shrinks
+  // code, so length() is just an upper bound for a relaxing assembler; it
+  // assembles each code up front instead, and places it by its actual size.
+  vector<Handle> res(codes.size());
+  vector<size_t> powers(codes.size(), jcc_erratum_ ? 5 : 0);
+  vector<vector<unsigned char>> relaxed(relaxation_ ? codes.size() : 0);
+  parallel_for(codes.size(), threads, [&](size_t t, size_t i) {
+    if (relaxation_) {
+      const auto& fxn = assemble_code(t, i);
+      relaxed[i].assign(fxn.buffer_, fxn.buffer_ + fxn.size());
+      res[i].size = fxn.size();
+    } else {
+      res[i].size = length(codes[i]);
+    }
+    for (const auto& instr : codes[i]) {
+      if (!instr.is_p2align()) {
+        continue;
+      }
+      const auto power = (size_t)instr.get_operand<Imm8>(0).val_;
+      if (power <= max_power) {
+        powers[i] = max(powers[i], power);
+      }
+    }
+  });
+  size_t total = 0;
+  for (size_t i = 0, ie = codes.size(); i < ie; ++i) {
+    res[i].offset = total + align_pad(total, powers[i], 0);
+    total = res[i].offset + res[i].size;
+  }
+
+  arena.clear();
+  if (failed || !arena.reserve(total)) {
+    return vector<Handle>();
+  }
+  size_t end = 0;
+  for (auto& h : res) {
+    h.entrypoint = (unsigned char*)arena.data() + h.offset;
+    write_nops(arena.buffer_ + end, h.offset - end);
+    end = h.offset + h.size;
+  }
+
+  parallel_for(codes.size(), threads, [&](size_t t, size_t i) {
+    if (relaxation_) {
+      memcpy(arena.buffer_ + res[i].offset, relaxed[i].data(), res[i].size);
+      return;
+    }
+    const auto& fxn = assemble_code(t, i);
+    if (fxn.good()) {
+      assert(fxn.size() == res[i].size);
+      memcpy(arena.buffer_ + res[i].offset, fxn.buffer_, fxn.size());
+    }
+  });
+  if (failed) {
+    arena.clear();
+    return vector<Handle>();
+  }
+
+  // Each thread's assembler started with a copy of our padding counter
+  const auto padding = jcc_padding_;
+  for (const auto& a : assms) {
+    jcc_padding_ += a.jcc_padding_ - padding;
+  }
+
+  // Label tables are merged in order so that results are deterministic
+  fxn_ = &arena;
+  load_labels();
+  vector<size_t> local;
+  for (size_t i = 0, ie = codes.size(); i < ie; ++i) {
+    local.clear();
+    for (size_t j = 0, je = ids[i].size(); j < je; ++j) {
+      local.push_back(local_label(ids[i][j]));
+      if (defs[i][j] != Function::undef_label()) {
+        arena.label_defs_[local[j]] = defs[i][j] + res[i].offset;
+      }
+    }
+    for (const auto& r : rels[i]) {
+      arena.label_rels_.push_back(make_pair(r.first + res[i].offset,
+                                            local[r.second]));
+    }
+  }
+  arena.head_ = arena.buffer_ + total;
+
+  return res;
+}
+
+void Assembler::finish_relaxed() {
+  if (!fxn_->good()) {
+    return;
+  }
+
+  /** A jump to a label which may be relaxed, or a padding site. */
+  struct Site {
+    size_t opc;    // Position of the first opcode or padding byte
+    size_t end;    // End of the instruction (rel32 ends it)
+    size_t shrink; // Bytes saved by the rel8 form
+    size_t target; // Position of the label definition
+    bool relaxed;
+    Align* align;  // Padding site, or null for jumps
+    size_t pad;    // Padding required by a padding site
+  };
+
+  // Identify relaxable jumps by their opcodes: E9 cd (jmp) or 0F 8x cd (jcc)
+  auto buf = fxn_->buffer_;
+  vector<Site> sites;
+  for (const auto& r : fxn_->label_rels_) {
+    const auto pos = r.first;
+    const auto def = fxn_->label_defs_[r.second];
+    if (def == Function::undef_label()) {
+      continue;
+    } else if (pos >= 1 && buf[pos-1] == 0xe9) {
+      sites.push_back(Site {pos-1, pos+4, 3, def, true, nullptr, 0});
+    } else if (pos >= 2 && buf[pos-2] == 0x0f && (buf[pos-1] & 0xf0) == 0x80) {
+      sites.push_back(Site {pos-2, pos+4, 4, def, true, nullptr, 0});
+    }
+  }
+  // A label bound where an alignment directive emitted no padding is taken
+  // to follow it, which is the common case of an aligned loop header. Empty
+  // padding sites at the same position keep the order they were emitted in.
+  for (auto& a : aligns_) {
+    sites.push_back(Site {a.pos, a.pos + a.len, 0, 0, false, &a, a.len});
+  }
+  stable_sort(sites.begin(), sites.end(), [](const Site& s1, const Site& s2) {
+    return s1.opc < s2.opc || (s1.opc == s2.opc && s1.end < s2.end);
+  });
+
+  // The bytes guarded by jcc erratum padding shrink with any relaxed jumps
+  const auto span = [&sites](size_t i) {
+    const auto& s = sites[i];
+    auto res = s.align->span;
+    for (auto j = i + 1, je = sites.size();
+         j < je && sites[j].opc < s.end + s.align->span; ++j) {
+      if (sites[j].align == nullptr && sites[j].relaxed) {
+        res -= sites[j].shrink;
+      }
+    }
+    return res;
+  };
+
+  // Maps an old position to a new one given the current choice of forms.
+  // saved[i] is the number of bytes saved by sites[0..i); alignment
+  // directives may require more padding than before, so this can be negative.
+  vector<int64_t> saved(sites.size() + 1, 0);
+  const auto relocate = [&sites, &saved](size_t pos) {
+    const auto itr = upper_bound(sites.begin(), sites.end(), pos,
+        [](size_t p, const Site& s) { return p < s.end; });
+    return (size_t)((int64_t)pos - saved[itr - sites.begin()]);
+  };
+  const auto layout = [&sites, &saved, &span] {
+    for (size_t i = 0, ie = sites.size(); i < ie; ++i) {
+      auto& s = sites[i];
+      if (s.align != nullptr) {
+        const auto pos = (size_t)((int64_t)s.opc - saved[i]);
+        s.pad = s.align->span == 0 ?
+                align_pad(pos, s.align->power, s.align->max_skip) :
+                boundary_pad(pos, span(i));
+        saved[i+1] = saved[i] + (int64_t)(s.end - s.opc) - (int64_t)s.pad;
+      } else {
+        saved[i+1] = saved[i] + (s.relaxed ? s.shrink : 0);
+      }
+    }
+  };
+
+  // The end of a jump always precedes an alignment directive at the same
+  // position, so it can't be found using relocate()
+  const auto end = [&sites, &saved](size_t i) {
+    return (int64_t)sites[i].end - saved[i+1];
+  };
+
+  // Demote jumps whose displacements don't fit until nothing changes
+  for (auto changed = true; changed; ) {
+    changed = false;
+    layout();
+    for (size_t i = 0, ie = sites.size(); i < ie; ++i) {
+      auto& s = sites[i];
+      if (s.relaxed) {
+        const auto disp = (int64_t)relocate(s.target) - end(i);
+        if (disp < -128 || disp > 127) {
+          s.relaxed = false;
+          changed = true;
+        }
+      }
+    }
+  }
+
+  // Compaction runs front to back, which is safe in place unless some
+  // padding has moved forward. If the function can't grow to hold it,
+  // nothing has changed yet, and the function is finished as it is.
+  const auto size = fxn_->size();
+  const auto new_size = relocate(size);
+  vector<unsigned char> copy;
+  const unsigned char* src = buf;
+  if (any_of(saved.begin(), saved.end(), [](int64_t s) { return s < 0; })) {
+    if (!fxn_->reserve(new_size)) {
+      finish();
+      return;
+    }
+    buf = fxn_->buffer_;
+    copy.assign(buf, buf + size);
+    src = copy.data();
+  }
+
+  // Compact the buffer, rewriting relaxed jumps and padding as we go
+  size_t in = 0;
+  size_t out = 0;
+  for (size_t i = 0, ie = sites.size(); i < ie; ++i) {
+    const auto& s = sites[i];
+    if (s.align == nullptr && !s.relaxed) {
+      continue;
+    }
+    memmove(buf + out, src + in, s.opc - in);
+    out += s.opc - in;
+
+    if (s.align != nullptr) {
+      write_nops(buf + out, s.pad);
+      if (s.align->span != 0) {
+        jcc_padding_ = jcc_padding_ + s.pad - s.align->len;
+      }
+      s.align->pos = out;
+      s.align->len = s.pad;
+      out += s.pad;
+    } else {
+      const auto disp = (int64_t)relocate(s.target) - end(i);
+      buf[out++] = s.shrink == 3 ? 0xeb : (0x70 | (src[s.opc+1] & 0x0f));
+      buf[out++] = disp;
+    }
+    in = s.end;
+  }
+  memmove(buf + out, src + in, size - in);
+  fxn_->head_ = buf + new_size;
+
+  // Relaxed jumps are resolved; everything else moves
+  vector<pair<size_t, size_t>> rels;
+  for (const auto& r : fxn_->label_rels_) {
+    const auto itr = lower_bound(sites.begin(), sites.end(), r.first,
+        [](const Site& s, size_t p) { return s.end <= p; });
+    if (itr == sites.end() || !itr->relaxed || r.first < itr->opc) {
+      rels.push_back(make_pair(relocate(r.first), r.second));
+    }
+  }
+  fxn_->label_rels_ = rels;
+  for (auto& d : fxn_->label_defs_) {
+    if (d != Function::undef_label()) {
+      d = relocate(d);
+    }
+  }
+  fxn_->label_refs_.clear();
+  fxn_->instr_offs_.clear();
+
+  finish();
+}
+
+bool Assembler::reassemble(Function& fxn, const Code& code, size_t index) {
+  auto& offs = fxn.instr_offs_;
+  const auto& instr = code[index];
+
+  // Instructions other than label definitions and alignment directives are
+  // never empty, so empty slots identify those which may not be patched.
+  auto full = !incremental_ || jcc_erratum_ ||
+              offs.size() != code.size() + 1 ||
+              instr.is_label_defn() || instr.is_p2align() ||
+              offs[index] == offs[index+1];
+
+  // Shifting the tail would break the alignment of the code that follows
+  if (!full && length(instr) > offs[index+1] - offs[index]) {
+    full = any_of(code.begin() + index + 1, code.end(),
+        [](const Instruction& i) { return i.is_p2align(); });
+  }
+
+  if (full) {
+    assemble(fxn, code);
+    return fxn.good();
+  }
+
+  const auto begin = offs[index];
+  const auto end = offs[index+1];
+  const auto len = length(instr);
+  const auto delta = len > end - begin ? len - (end - begin) : 0;
+
+  // Make room for the shifted tail and for the new instruction up front, so
+  // that the function is unchanged if it can't grow. Growing later would
+  // copy only what precedes the slot once the write pointer is moved back.
+  if (!fxn.reserve(max(fxn.size() + delta, begin + max_length_))) {
+    return false;
+  }
+
+  // Forget references made by the previous instruction
+  const auto in_slot = [begin, end](const pair<size_t, size_t>& r) {
+    return r.first >= begin && r.first < end;
+  };
+  fxn.label_refs_.erase(remove_if(fxn.label_refs_.begin(),
+        fxn.label_refs_.end(), in_slot), fxn.label_refs_.end());
+  fxn.label_rels_.erase(remove_if(fxn.label_rels_.begin(),
+        fxn.label_rels_.end(), in_slot), fxn.label_rels_.end());
+
+  // Shift the tail if the new instruction doesn't fit in its slot
+  if (delta > 0) {
+    memmove(fxn.buffer_ + end + delta, fxn.buffer_ + end, fxn.size() - end);
+    fxn.head_ += delta;
+
+    for (auto i = index + 1, ie = offs.size(); i < ie; ++i) {
+      offs[i] += delta;
+    }
+    for (auto& d : fxn.label_defs_) {
+      if (d != Function::undef_label() && d > begin) {
+        d += delta;
+      }
+    }
+    for (auto& r : fxn.label_rels_) {
+      if (r.first > begin) {
+        r.first += delta;
+      }
+    }
+    // Only references whose site and target lie on different sides of the
+    // change need their displacements updated
+    for (auto& r : fxn.label_refs_) {
+      if (r.first > begin) {
+        r.first += delta;
+      }
+      const auto def = fxn.label_defs_[r.second];
+      if (def != Function::undef_label() &&
+          (r.first > begin) != (def > begin)) {
+        fxn.emit_long(def - r.first - 4, r.first);
+      }
+    }
+  }
+
+  // Emit the new instruction and pad the remainder of its slot
+  fxn_ = &fxn;
+  load_labels();
+  const auto size = fxn.size();
+  const auto rels = fxn.label_rels_.size();
+  fxn.head_ = fxn.buffer_ + begin;
+  // The cache and bulk engines may store up to 16 bytes past the end of an
+  // instruction, which would clobber the instructions that follow its slot
+  uint8_t tail[16];
+  const auto slot_end = offs[index+1];
+  const auto tail_len = min((size_t)16, fxn.capacity() - slot_end);
+  memcpy(tail, fxn.buffer_ + slot_end, tail_len);
+  assemble(instr);
+  write_nops(fxn.head_, slot_end - fxn.size());
+  memcpy(fxn.buffer_ + slot_end, tail, tail_len);
+  fxn.head_ = fxn.buffer_ + size;
+
+  // Resolve the new instruction's label references
+  for (auto i = rels; i < fxn.label_rels_.size(); ) {
+    const auto r = fxn.label_rels_[i];
+    fxn.label_refs_.push_back(r);
+
+    const auto def = fxn.label_defs_[r.second];
+    if (def == Function::undef_label()) {
+      ++i;
+    } else {
+      fxn.emit_long(def - r.first - 4, r.first);
+      fxn.label_rels_.erase(fxn.label_rels_.begin() + i);
+    }
+  }
+  return true;
+}
+
+size_t Assembler::length(const Instruction& instr) const {
+  if (instr.get_opcode() == LABEL_DEFN) {
+    return 0;
+  } else if (instr.get_opcode() == P2ALIGN) {
+    const auto power = (size_t)instr.get_operand<Imm8>(0).val_;
+    if (power > max_power) {
+      return 0;
+    }
+    const auto pad = ((size_t)1 << power) - 1;
+    const auto max_skip = (size_t)instr.get_operand<Imm8>(1).val_;
+    return max_skip == 0 ? pad : min(pad, max_skip);
+  }
+
+  const auto& e = encodings_[instr.get_opcode()];
+  const auto mem = (e.flags & Encoding::MEM) != 0;
+  size_t res = e.opc_len;
+
+  // Prefix bytes
+  if (e.flags & Encoding::FWAIT) {
+    res++;
+  }
+  if (e.flags & Encoding::HINT) {
+    res++;
+  } else if (e.mem != -1 && instr.get_operand<M8>(e.mem).contains_seg()) {
+    res++;
+  }
+  if (e.mem != -1 && instr.get_operand<M8>(e.mem).addr_or()) {
+    res++;
+  }
+  if (e.flags & Encoding::PREF_66) {
+    res++;
+  }
+  if (e.flags & (Encoding::PREF_F2 | Encoding::PREF_F3)) {
+    res++;
+  }
+
+  // Extended register bits for the rex or vex prefix; mirrors rex() and vex()
+  uint8_t rex = e.rex;
+  if (e.flags & Encoding::REX_O) {
+    rex |= instr.get_operand<Operand>(0).val_ >> 3;
+  } else if (e.rm != -1) {
+    if (mem) {
+      const auto& m = instr.get_operand<M8>(e.rm);
+      if (m.contains_base()) {
+        rex |= m.get_base().val_ >> 3;
+      }
+      if (m.contains_index()) {
+        rex |= (m.get_index().val_ >> 2) & 0x2;
+      }
+    } else {
+      rex |= instr.get_operand<Operand>(e.rm).val_ >> 3;
+    }
+    if (e.r != -1) {
+      rex |= (instr.get_operand<Operand>(e.r).val_ >> 1) & 0x4;
+    }
+  }
+
+  if (e.flags & Encoding::VEX) {
+    const auto two_byte = (rex & 0x3) == 0 && e.vex_mmmmm == 0x01 &&
+                          (e.flags & Encoding::VEX_W) == 0;
+    res += two_byte ? 2 : 3;
+  } else if (rex != 0) {
+    res++;
+  }
+
+  // Mod R/M, SIB, and displacement bytes; mirrors mod_rm_sib()
+  if (e.rm != -1) {
+    res++;
+    if (mem) {
+      const auto& m = instr.get_operand<M8>(e.rm);
+      if (m.rip_offset()) {
+        res += 4;
+      } else if (!m.contains_base()) {
+        res += 5;
+      } else {
+        const auto bbb = m.get_base().val_ & 0x7;
+        const auto disp = (int32_t)m.get_disp().val_;
+        if (disp < -128 || disp >= 128) {
+          res += 4;
+        } else if (disp != 0 || bbb == 0x5) {
+          res += 1;
+        }
+        if (m.contains_index() || bbb == 0x4) {
+          res++;
+        }
+      }
+    }
+  }
+
+  // Displacement or immediate bytes
+  if (e.flags & Encoding::II) {
+    res += 3;
+  } else if (e.imm != -1) {
+    res += e.imm_size;
+  }
+  if (e.flags & Encoding::IS4) {
+    res++;
+  }
+
+  return res;
+}
+
+size_t Assembler::length(const Code& code) const {
+  size_t res = 0;
+  for (size_t i = 0, ie = code.size(); i < ie; ++i) {
+    const auto& instr = code[i];
+    if (jcc_erratum_) {
+      res += boundary_pad(res, branch_span(code, i));
+    }
+    if (instr.is_p2align()) {
+      res += align_pad(res, instr.get_operand<Imm8>(0).val_,
+                       instr.get_operand<Imm8>(1).val_);
+    } else {
+      res += length(instr);
+    }
+  }
+  return res;
+}
+
+template <typename S, typename T>
+void Assembler::emit_mod_rm_sib(S& s, const M<T>& rm, const Operand& r) {
   // Every path we take needs these bits for the mod/rm byte
   const auto rrr = (r.val_ << 3) & 0x38;
 
   // First special case check for RIP+disp32
   if (rm.rip_offset()) {
     const auto mod_byte = 0x00 | rrr | 0x5;
-    fxn_->emit_byte(mod_byte);
-    disp_imm(rm.get_disp());
+    s.emit_byte(mod_byte);
+    s.emit_long(rm.get_disp().val_);
     return;
   }
 
@@ -60,9 +1140,9 @@ void Assembler::mod_rm_sib(const M<T>& rm, const Operand& r) {
       (((int)rm.get_scale() << 6) & 0xc0) | ((rm.get_index().val_ << 3) & 0x38) | 0x5 :
       0x00 | 0x20 | 0x5;
 
-    fxn_->emit_byte(mod_byte);
-    fxn_->emit_byte(sib_byte);
-    disp_imm(rm.get_disp());
+    s.emit_byte(mod_byte);
+    s.emit_byte(sib_byte);
+    s.emit_long(rm.get_disp().val_);
 
     return;
   }
@@ -86,31 +1166,36 @@ void Assembler::mod_rm_sib(const M<T>& rm, const Operand& r) {
     const auto sib_byte = (((int)rm.get_scale() << 6) & 0xc0) |
                           ((rm.get_index().val_ << 3) & 0x38) | bbb;
 
-    fxn_->emit_byte(mod_byte);
-    fxn_->emit_byte(sib_byte);
+    s.emit_byte(mod_byte);
+    s.emit_byte(sib_byte);
   }
   // Is base sitting in the eip/rip+disp32 row?
   else if (bbb == 0x4) {
     const auto mod_byte = mod | rrr | 0x4;
     const auto sib_byte = (((int)rm.get_scale() << 6) & 0xc0) | 0x20 | bbb;
 
-    fxn_->emit_byte(mod_byte);
-    fxn_->emit_byte(sib_byte);
+    s.emit_byte(mod_byte);
+    s.emit_byte(sib_byte);
   }
   // No sib byte
   else {
     const auto mod_byte = mod | rrr | bbb;
-    fxn_->emit_byte(mod_byte);
+    s.emit_byte(mod_byte);
   }
 
   // This logic parallels the logic for the mod bit
   if (mod == 0x40) {
-    disp_imm(Imm8(disp));
+    s.emit_byte(disp);
   } else if (mod == 0x80) {
-    disp_imm(Imm32(disp));
+    s.emit_long(disp);
   }
 }
 
+template <typename T>
+void Assembler::mod_rm_sib(const M<T>& rm, const Operand& r) {
+  emit_mod_rm_sib(*fxn_, rm, r);
+}
+
 void Assembler::debug(const Instruction& instr, size_t idx) const {
 	const auto fmt = cerr.flags();
 
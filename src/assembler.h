@@ -17,11 +17,15 @@ limitations under the License.
 #ifndef X64ASM_SRC_ASSEMBLER_H
 #define X64ASM_SRC_ASSEMBLER_H
 
+#include <algorithm>
+#include <array>
 #include <iostream>
 #include <type_traits>
+#include <vector>
 
 #include "src/function.h"
 #include "src/code.h"
+#include "src/encoding.h"
 #include "src/hint.h"
 #include "src/imm.h"
 #include "src/instruction.h"
@@ -44,65 +48,264 @@ namespace x64asm {
 */
 class Assembler {
   public:
+    /** Strategies for encoding an instruction. SWITCH dispatches to the
+        generated per-opcode methods. TABLE interprets a compact per-opcode
+        encoding table, which trades a few branches for a much smaller
+        instruction cache footprint. BULK interprets the same table, but
+        encodes each instruction into a 16-byte local buffer and copies it
+        out with a single unaligned store. This requires only one capacity
+        check per instruction rather than one per emitted byte group.
+    */
+    enum class Engine {
+      SWITCH = 0,
+      TABLE,
+      BULK
+    };
+
+    /** Creates a non-incremental assembler which uses the switch engine
+        and no encoding cache.
+    */
+    Assembler() : fxn_(nullptr), engine_(Engine::SWITCH), incremental_(false),
+      relaxation_(false), jcc_erratum_(false), jcc_padding_(0),
+      label_epoch_(0), label_count_(0), cache_hits_(0), cache_misses_(0) { }
+
+    /** Sets the strategy used by assemble(const Instruction&). */
+    void set_engine(Engine e) {
+      engine_ = e;
+    }
+
+    /** Returns the strategy used by assemble(const Instruction&). */
+    Engine get_engine() const {
+      return engine_;
+    }
+
+    /** Toggles incremental mode. In incremental mode, assemble(Function&,
+        const Code&) records the offset of every instruction and every label
+        reference, which allows reassemble() to patch a function in place.
+    */
+    void set_incremental(bool incremental) {
+      incremental_ = incremental;
+    }
+
+    /** Returns true if this assembler is in incremental mode. */
+    bool is_incremental() const {
+      return incremental_;
+    }
+
+    /** Toggles branch relaxation. When enabled, assemble(Function&, const
+        Code&) finishes functions using finish_relaxed().
+    */
+    void set_relaxation(bool relaxation) {
+      relaxation_ = relaxation;
+    }
+
+    /** Returns true if branch relaxation is enabled. */
+    bool get_relaxation() const {
+      return relaxation_;
+    }
+
+    /** Toggles jcc erratum mitigation. When enabled, assemble(Function&,
+        const Code&) pads with nops so that no jump, call, or return, and no
+        cmp/test/add/sub/and/inc/dec which may macro-fuse with a following
+        jcc together with that jcc, crosses or ends on a 32-byte boundary.
+        Positions are relative to the start of the function, whose buffer is
+        page aligned. See the Intel white paper "Mitigations for Jump
+        Conditional Code Erratum".
+    */
+    void set_jcc_erratum(bool jcc_erratum) {
+      jcc_erratum_ = jcc_erratum;
+    }
+
+    /** Returns true if jcc erratum mitigation is enabled. */
+    bool get_jcc_erratum() const {
+      return jcc_erratum_;
+    }
+
+    /** Returns the number of padding bytes emitted by jcc erratum
+        mitigation.
+    */
+    size_t get_jcc_padding() const {
+      return jcc_padding_;
+    }
+
+    /** Resets the jcc erratum padding counter. */
+    void reset_jcc_padding() {
+      jcc_padding_ = 0;
+    }
+
+    /** Enables a direct-mapped cache of instruction encodings. The number of
+        entries is rounded up to a power of two; zero disables the cache.
+        Entries are keyed on the full opcode and operand bits, so a hit
+        replaces encoding by a single copy.
+    */
+    void set_cache_size(size_t entries);
+
+    /** Returns the number of entries in the encoding cache. */
+    size_t get_cache_size() const {
+      return cache_.size();
+    }
+
+    /** Returns the number of encoding cache hits. */
+    size_t get_cache_hits() const {
+      return cache_hits_;
+    }
+
+    /** Returns the number of encoding cache misses. */
+    size_t get_cache_misses() const {
+      return cache_misses_;
+    }
+
+    /** Resets encoding cache hit and miss counters. */
+    void reset_cache_stats() {
+      cache_hits_ = 0;
+      cache_misses_ = 0;
+    }
+
+    /** Returns the exact number of bytes that assembling an instruction
+        would emit. No bytes are written. The padding emitted by an alignment
+        directive depends on its position, so an upper bound is returned.
+    */
+    size_t length(const Instruction& instr) const;
+
+    /** Returns the exact number of bytes that assembling a code would emit
+        without relaxation. No bytes are written. Relaxation only shrinks
+        code, so for an assembler which relaxes jumps this is an upper bound.
+    */
+    size_t length(const Code& code) const;
+
     /** Resize's a function's internal buffer to guarantee sufficient
-        space for assembling an instruction.
+        space for assembling an instruction. Functions grow as needed during
+        assembly, so this is only an optimization.
     */
     void reserve(Function& fxn, const Instruction& instr) {
-      fxn.reserve(fxn.size() + 15);
+      fxn.reserve(fxn.size() + length(instr));
     }
 
     /** Resize's a function's internal buffer to guarantee sufficient
-        space for assembling a code.
+        space for assembling a code. Functions grow as needed during
+        assembly, so this is only an optimization.
     */
     void reserve(Function& fxn, const Code& code) {
-      fxn.reserve(fxn.size() + 15 * code.size());
+      fxn.reserve(fxn.size() + length(code));
     }
 
     /** Convenience method; compiles a code into a newly allocated function. */
     Function assemble(const Code& code) {
       Function fxn;
-      reserve(fxn, code);
       assemble(fxn, code);
       return fxn;
     }
 
-    /** Compiles a code into a preallocated function. */
+    /** Compiles a code into a function, growing it as needed. If it can't
+        grow, it is left without a buffer and good() is false.
+    */
     void assemble(Function& fxn, const Code& code) {
       start(fxn);
-      for (const auto & instr : code) {
-        assemble(instr);
+      for (size_t i = 0, ie = code.size(); i < ie; ++i) {
+        if (jcc_erratum_) {
+          pad_branch(code, i);
+        }
+        if (incremental_) {
+          fxn_->instr_offs_.push_back(fxn_->size());
+        }
+        assemble(code[i]);
+      }
+      if (incremental_) {
+        fxn_->instr_offs_.push_back(fxn_->size());
+        fxn_->label_refs_ = fxn_->label_rels_;
+      }
+      if (relaxation_) {
+        finish_relaxed();
+      } else {
+        finish();
       }
-      finish();
     }
 
+    /** Recompiles a function after the instruction at index in code has
+        changed; code must otherwise match the code that was last assembled
+        into fxn in incremental mode. If the new encoding fits in the old
+        instruction's slot it is written in place and padded with nops.
+        Otherwise the remainder of the function is shifted. In either case
+        only the label references which span the change are re-patched.
+        Falls back on assemble(fxn, code) if label definitions would move,
+        if offsets were not recorded, or if jcc erratum mitigation is enabled.
+        Returns false if the function can't grow; a function patched in
+        place is then left unchanged, and one assembled again is left
+        without a buffer.
+    */
+    bool reassemble(Function& fxn, const Code& code, size_t index);
+
+    /** The location of a code within a function filled by assemble_all(). */
+    struct Handle {
+      /** Address of the first byte of this code. */
+      void* entrypoint;
+      /** Offset of the first byte of this code. */
+      size_t offset;
+      /** Number of bytes occupied by this code. */
+      size_t size;
+    };
+
+    /** Compiles a batch of codes into one contiguous function, in order.
+        Work is split among threads (one per core if threads is 0) which
+        steal work from each other once their own share is exhausted. Label
+        references are resolved within each code; label definitions and
+        unresolved references are merged into the arena for use by the
+        linker. Returns one handle per code, or no handles, leaving the
+        arena empty, if memory runs out.
+    */
+    std::vector<Handle> assemble_all(Function& arena,
+                                     const std::vector<Code>& codes,
+                                     size_t threads = 0);
+
     /** Begin compiling a function. Clears the function's internal buffer.
         and erases previously stored label definitions.
     */
     void start(Function& fxn) {
       fxn_ = &fxn;
       fxn_->clear();
+      aligns_.clear();
+      // Release a table left behind by a much larger function; probing it
+      // would scatter accesses over more memory than the labels need
+      if (label_map_.size() > 4096 && 16 * label_count_ < label_map_.size()) {
+        std::vector<LabelSlot>().swap(label_map_);
+      }
+      load_labels();
     }
 
     /** Finishes compiling a function. Replaces relative placeholders by
         actual values, and deletes references after doing so.
     */
     void finish() {
-			std::vector<std::pair<size_t, uint64_t>> unresolved;
+      auto& rels = fxn_->label_rels_;
+      size_t unresolved = 0;
 
-      for (const auto & l : fxn_->label_rels_) {
+      for (const auto & l : rels) {
         const auto pos = l.first;
-        const auto itr = fxn_->label_defs_.find(l.second);
+        const auto def = fxn_->label_defs_[l.second];
 
-        if (itr == fxn_->label_defs_.end()) {
-					unresolved.push_back(l);
+        if (def == Function::undef_label()) {
+          rels[unresolved++] = l;
         } else {
-          fxn_->emit_long(itr->second-pos-4, pos);
+          fxn_->emit_long(def-pos-4, pos);
         }
       }
 
-			fxn_->label_rels_ = unresolved;
+      rels.resize(unresolved);
     }
 
+    /** Finishes compiling a function, replacing jumps to labels defined in
+        this function by their 8-bit displacement forms wherever they fit.
+        Jumps start in their short form and are only ever demoted, so the
+        iteration reaches a fixed point. Code is compacted, the padding
+        emitted by alignment directives and jcc erratum mitigation is
+        recomputed, and label definitions and references are updated
+        accordingly. Because instruction offsets change, the function can no
+        longer be patched by reassemble() without first being assembled
+        again. If alignment needs more room than the function can grow to,
+        it is finished by finish() instead.
+    */
+    void finish_relaxed();
+
     /** Assembles an instruction. This method will print a hex dump to
         standard error when x64asm is compiled in debug mode.
     */
@@ -110,15 +313,206 @@ class Assembler {
 
     /** Bind a label definition to the current assembler position. */
     void bind(Label label) {
-      fxn_->label_defs_[label.val_] = fxn_->size();
+      fxn_->label_defs_[local_label(label.val_)] = fxn_->size();
     }
 
+    /** Pads the current assembler position to a multiple of 2^power bytes
+        using the fewest possible multi-byte nops; positions are relative to
+        the start of the function. If max_skip is non-zero and more than
+        max_skip bytes would be required, no padding is emitted. Equivalent
+        to the gas directive .p2align power,,max_skip. Powers above 15 are
+        rejected, as by Instruction::check(), and emit nothing.
+    */
+    void p2align(size_t power, size_t max_skip = 0);
+
     // void adc(const Al& arg0, const Imm8& arg1); ...
 		#include "src/assembler.decl"
 
   private:
     /** Pointer to the function being compiled. */
     Function* fxn_;
+    /** Strategy used by assemble(const Instruction&). */
+    Engine engine_;
+    /** Record offsets for reassemble()? */
+    bool incremental_;
+    /** Finish functions using finish_relaxed()? */
+    bool relaxation_;
+    /** Pad branches away from 32-byte boundaries? */
+    bool jcc_erratum_;
+    /** Number of bytes emitted by jcc erratum padding. */
+    size_t jcc_padding_;
+
+    /** An alignment directive or jcc erratum padding emitted since the last
+        call to start().
+    */
+    struct Align {
+      /** Position of the first padding byte. */
+      size_t pos;
+      /** Number of padding bytes. */
+      size_t len;
+      /** Alignment is to 2^power bytes. */
+      size_t power;
+      /** Maximum number of padding bytes; zero for no limit. */
+      size_t max_skip;
+      /** Number of bytes guarded by jcc erratum padding, or zero for
+          alignment directives.
+      */
+      size_t span;
+    };
+
+    /** Padding sites; finish_relaxed() recomputes their padding. */
+    std::vector<Align> aligns_;
+
+    /** An entry in label_map_. */
+    struct LabelSlot {
+      /** Global label id. */
+      uint64_t id;
+      /** The entry is empty unless this matches label_epoch_. */
+      uint32_t epoch;
+      /** Local label number. */
+      uint32_t local;
+    };
+
+    /** Open-addressed map from global label ids to the local label numbers
+        of the current function; size is zero or a power of two, and at most
+        half full. Label ids are never reused, so the table is sized by the
+        labels of a function rather than indexed by id. Starting a new epoch
+        empties it without clearing.
+    */
+    std::vector<LabelSlot> label_map_;
+    /** Epoch of the current function's entries in label_map_. */
+    uint32_t label_epoch_;
+    /** Number of labels in the current function. */
+    size_t label_count_;
+
+    /** Returns the slot which holds id, or the empty slot where it belongs.
+        Ids are hashed to themselves: labels which are created together have
+        consecutive ids, so they occupy consecutive slots.
+    */
+    LabelSlot& label_slot(uint64_t id) {
+      const auto mask = label_map_.size() - 1;
+      for (auto i = id; ; ++i) {
+        auto& slot = label_map_[i & mask];
+        if (slot.epoch != label_epoch_ || slot.id == id) {
+          return slot;
+        }
+      }
+    }
+
+    /** Returns the local label number of a label in the current function,
+        numbering it on first use.
+    */
+    size_t local_label(uint64_t id) {
+      auto& ids = fxn_->label_ids_;
+      if (2 * (ids.size() + 1) > label_map_.size()) {
+        label_map_.assign(std::max((size_t)64, 2 * label_map_.size()),
+                          LabelSlot {0, 0, 0});
+        label_epoch_ = 0;
+        load_labels();
+      }
+      auto& slot = label_slot(id);
+      if (slot.epoch != label_epoch_) {
+        slot = LabelSlot {id, label_epoch_, (uint32_t)ids.size()};
+        ids.push_back(id);
+        fxn_->label_defs_.push_back(Function::undef_label());
+        label_count_ = ids.size();
+      }
+      return slot.local;
+    }
+
+    /** Starts a new epoch and enters the current function's labels. */
+    void load_labels() {
+      if (++label_epoch_ == 0) {
+        std::fill(label_map_.begin(), label_map_.end(), LabelSlot {0, 0, 0});
+        label_epoch_ = 1;
+      }
+      const auto& ids = fxn_->label_ids_;
+      label_count_ = ids.size();
+      if (2 * ids.size() > label_map_.size()) {
+        label_map_.assign(std::max((size_t)64, 2 * label_map_.size()),
+                          LabelSlot {0, 0, 0});
+        return load_labels();
+      }
+      for (size_t i = 0, ie = ids.size(); i < ie; ++i) {
+        label_slot(ids[i]) = LabelSlot {ids[i], label_epoch_, (uint32_t)i};
+      }
+    }
+
+    /** An encoding cache entry. */
+    struct CacheEntry {
+      /** Opcode followed by the underlying values of each operand. */
+      std::array<uint64_t, 9> key;
+      /** Encoded bytes; padded to allow a single 16-byte copy. */
+      uint8_t bytes[16];
+      /** Number of encoded bytes; zero for empty entries. */
+      uint8_t len;
+      /** Offset of a label displacement, or -1 if there is none. */
+      int8_t rel;
+    };
+
+    /** Direct-mapped encoding cache; size is a power of two. */
+    std::vector<CacheEntry> cache_;
+    /** Number of encoding cache hits. */
+    size_t cache_hits_;
+    /** Number of encoding cache misses. */
+    size_t cache_misses_;
+
+    /** The length of the longest x86 instruction. */
+    static constexpr size_t max_length_ = 15;
+
+    /** Guarantees that n more bytes fit in the current function. Functions
+        grow geometrically, so callers needn't reserve space up front.
+        Returns false if the function can't grow; it is then left without a
+        buffer, so that good() is false, and nothing more is emitted.
+    */
+    bool grow(size_t n) {
+      return fxn_->remaining() >= n || grow_buffer(n);
+    }
+    /** Grows the current function by at least n bytes; if doubling fails,
+        only the bytes needed are asked for. Releases the buffer and returns
+        false if even that fails.
+    */
+    bool grow_buffer(size_t n);
+
+    /** Returns true if an instruction may macro-fuse with a following jcc. */
+    static bool is_fusible(const Instruction& instr);
+
+    /** Returns the number of bytes which jcc erratum mitigation must keep
+        within a 32-byte block starting at the instruction at index in code,
+        or zero if it needs no padding.
+    */
+    size_t branch_span(const Code& code, size_t index) const;
+
+    /** Emits jcc erratum padding ahead of the instruction at index in code. */
+    void pad_branch(const Code& code, size_t index);
+
+    /** Assembles an instruction using the encoding cache. */
+    void assemble_cached(const Instruction& instr);
+
+    /** Assembles an instruction using the current engine. */
+    void assemble_engine(const Instruction& instr) {
+      if (engine_ == Engine::BULK) {
+        assemble_bulk(instr);
+      } else if (engine_ == Engine::TABLE) {
+        assemble_table(instr);
+      } else {
+        assemble_switch(instr);
+      }
+    }
+
+    /** Per-opcode encodings; see src/encoding_table.h. */
+    static const Encoding* const encodings_;
+
+    /** Assembles an instruction by dispatching to a generated method. */
+    void assemble_switch(const Instruction& instr);
+
+    /** Assembles an instruction by interpreting its encoding table row. */
+    void assemble_table(const Instruction& instr);
+
+    /** Assembles an instruction by interpreting its encoding table row into
+        a local buffer.
+    */
+    void assemble_bulk(const Instruction& instr);
 
     /** Emits an fwait prefix byte. */
     void pref_fwait(uint8_t c) {
@@ -218,7 +612,7 @@ class Assembler {
 				bytes.
     */
     void disp_imm(Label l) {
-      fxn_->label_rels_.push_back(std::make_pair(fxn_->size(), l.val_));
+      fxn_->label_rels_.push_back(std::make_pair(fxn_->size(), local_label(l.val_)));
       fxn_->emit_long(0);
     }
 
@@ -297,6 +691,10 @@ class Assembler {
     template <typename T>
     void mod_rm_sib(const M<T>& rm, const Operand& r);
 
+    /** Emits a mod/rm sib byte pair to a Function or a local buffer. */
+    template <typename S, typename T>
+    static void emit_mod_rm_sib(S& s, const M<T>& rm, const Operand& r);
+
     /** Emits a mod/rm sib byte pair. */
     void mod_rm_sib(const Operand& rm, const Operand& r) {
       auto mod = 0xc0 | ((r.val_ << 3) & 0x38) | (rm.val_ & 0x7);
@@ -298,6 +298,7 @@ Imm64 offset(const Operand* o) {
 %token <operand> YMM
 
 %token <opcode> OPCODE
+%token <instr> P2ALIGN
 
 %type <operand> moffs
 %type <operand> m
@@ -340,6 +341,11 @@ instr : LABEL COLON ENDL blank {
   $$ = new Instruction{Opcode::LABEL_DEFN, {*$1}};
 	delete $1;
 }
+| P2ALIGN ENDL blank {
+	$$ = $1;
+	if ( !$$->check() )
+		yyerror(is, code, "Unable to parse alignment!");
+}
 | OPCODE typed_operands ENDL blank {
 	$$ = to_instr(*$1, *$2);
 
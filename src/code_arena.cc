@@ -0,0 +1,302 @@
+/*
+Copyright 2013 eric schkufza
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "src/code_arena.h"
+
+#include <fstream>
+#include <string>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#ifdef __APPLE__
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+using namespace std;
+using namespace x64asm;
+
+namespace {
+
+/** The size of a huge page. */
+constexpr size_t huge_page_size = 2 << 20;
+
+/** Returns the system page size. */
+size_t page_size() {
+  static const size_t size = sysconf(_SC_PAGESIZE);
+  return size;
+}
+
+/** Rounds a size up to a multiple of a power of two. */
+size_t round_to(size_t size, size_t align) {
+  return (size + align - 1) & ~(align - 1);
+}
+
+/** Returns log2 of the smallest power of two which is at least size. */
+size_t log2_ceil(size_t size) {
+  return size <= 1 ? 0 : 64 - __builtin_clzll(size - 1);
+}
+
+/** Returns log2 of the largest power of two which is at most size. */
+size_t log2_floor(size_t size) {
+  return 63 - __builtin_clzll(size);
+}
+
+/** Returns an anonymous memory file, or -1 if the system has none. If
+    hugetlb is set, the file is backed by huge pages; mapping it fails unless
+    the system has reserved enough of them.
+*/
+int memory_file(bool hugetlb) {
+#if defined(__linux__) && defined(SYS_memfd_create)
+  const unsigned flags = 1 /* MFD_CLOEXEC */ | (hugetlb ? 4 /* MFD_HUGETLB */ : 0);
+  return syscall(SYS_memfd_create, "x64asm", flags);
+#else
+  (void) hugetlb;
+  return -1;
+#endif
+}
+
+/** Returns true if every byte of a range lies within rel32 reach of near. */
+bool in_reach(const void* p, size_t size, const void* near) {
+  const auto n = (uint64_t)near;
+  const auto lo = (uint64_t)p;
+  const auto hi = lo + size;
+  const auto reach = ((uint64_t)1 << 31) - 1;
+  return (lo > n ? lo - n : n - lo) < reach && (hi > n ? hi - n : n - hi) < reach;
+}
+
+/** Maps memory within rel32 reach of near, if near is set and such a range
+    can be found; otherwise anywhere. The kernel honors an address hint if
+    the range there is free, so a few hints on either side of near are
+    tried. Counts calls to mmap in calls.
+*/
+void* map_near(size_t size, int prot, int flags, int fd, size_t offset,
+               const void* near, size_t& calls) {
+  if (near != nullptr) {
+    const auto base = (uint64_t)near & ~(page_size() - 1);
+    const uint64_t step = 64 << 20;
+    for (size_t i = 0; i < 16; ++i) {
+      const auto dist = (i / 2 + 1) * step;
+      if (i % 2 == 0 && base < dist + size) {
+        continue;
+      }
+      const auto hint = i % 2 == 0 ? base - dist - size : base + dist;
+      ++calls;
+      const auto p = mmap((void*)hint, size, prot, flags, fd, offset);
+      if (p == MAP_FAILED) {
+        continue;
+      } else if (in_reach(p, size, near)) {
+        return p;
+      }
+      munmap(p, size);
+    }
+  }
+  ++calls;
+  return mmap(nullptr, size, prot, flags, fd, offset);
+}
+
+/** Returns true if the kernel will back memory files with transparent huge
+    pages when asked to by madvise().
+*/
+bool shmem_thp() {
+  ifstream ifs("/sys/kernel/mm/transparent_hugepage/shmem_enabled");
+  string s;
+  getline(ifs, s);
+  return s.find("[always]") != string::npos ||
+         s.find("[within_size]") != string::npos ||
+         s.find("[advise]") != string::npos ||
+         s.find("[force]") != string::npos;
+}
+
+} // namespace
+
+namespace x64asm {
+
+CodeArena::CodeArena(size_t region_size, bool huge_pages, const void* near) :
+  huge_(huge_pages), near_(near), fd_size_(0), tail_({nullptr, nullptr, 0}),
+  free_(64),
+  mmap_calls_(0), mapped_bytes_(0), used_bytes_(0) {
+  region_size_ = round_to(region_size == 0 ? 1 : region_size, granule());
+
+  // Huge pages come first. A file of ordinary pages is only worth keeping if
+  // it may use transparent huge pages; otherwise anonymous memory can.
+  hugetlb_ = huge_ && (fd_ = memory_file(true)) != -1;
+  if (!hugetlb_) {
+    fd_ = !huge_ || shmem_thp() ? memory_file(false) : -1;
+  }
+}
+
+CodeArena::~CodeArena() {
+  for (const auto& r : regions_) {
+    munmap(r.rw, r.size);
+    if (r.rx != r.rw) {
+      munmap(r.rx, r.size);
+    }
+  }
+  if (fd_ != -1) {
+    close(fd_);
+  }
+}
+
+CodeArena::Buffer CodeArena::allocate(size_t size) {
+  const auto k = max(log2_ceil(size), min_class_);
+  const auto n = (size_t)1 << k;
+
+  lock_guard<mutex> lock(mutex_);
+  Buffer buf {nullptr, nullptr, 0};
+
+  auto& list = free_[k];
+  if (!list.empty()) {
+    buf = list.back();
+    list.pop_back();
+  } else {
+    if (tail_.size < n && !grow(max(n, region_size_))) {
+      return buf;
+    }
+    buf = {tail_.rw, tail_.rx, n};
+    tail_.rw += n;
+    tail_.rx += n;
+    tail_.size -= n;
+  }
+
+  used_bytes_ += n;
+  return buf;
+}
+
+void CodeArena::release(const Buffer& buf) {
+  if (buf.rw == nullptr) {
+    return;
+  }
+  lock_guard<mutex> lock(mutex_);
+  free_[log2_floor(buf.size)].push_back(buf);
+  used_bytes_ -= buf.size;
+}
+
+size_t CodeArena::granule() const {
+  return huge_ ? huge_page_size : page_size();
+}
+
+bool CodeArena::grow(size_t size) {
+  size = round_to(size, granule());
+  Region r {nullptr, nullptr, size};
+
+  // If the first region can't be mapped, fall back on the next best kind of
+  // memory; later failures mean that memory has run out
+  while (!map_region(r)) {
+    if (!regions_.empty() || fd_ == -1) {
+      return false;
+    }
+    close(fd_);
+    fd_ = hugetlb_ && shmem_thp() ? memory_file(false) : -1;
+    fd_size_ = 0;
+    hugetlb_ = false;
+  }
+
+  // Whatever is left of the old tail is split into the largest buffers that
+  // fit. Every size is a multiple of the smallest class, so nothing is lost.
+  while (tail_.size > 0) {
+    const auto k = log2_floor(tail_.size);
+    const auto n = (size_t)1 << k;
+    free_[k].push_back({tail_.rw, tail_.rx, n});
+    tail_.rw += n;
+    tail_.rx += n;
+    tail_.size -= n;
+  }
+
+  // Later regions are placed near the first so that all of its code can
+  // reach itself with rel32 displacements
+  if (near_ == nullptr) {
+    near_ = r.rx;
+  }
+  regions_.push_back(r);
+  tail_ = r;
+  mapped_bytes_ += size;
+  return true;
+}
+
+bool CodeArena::map_region(Region& r) {
+  // Both views map the same new range at the end of the memory file
+  if (fd_ != -1) {
+    if (ftruncate(fd_, fd_size_ + r.size) != 0) {
+      return false;
+    }
+    const auto rw = map_view(r.size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                             fd_size_);
+    if (rw == nullptr) {
+      return false;
+    }
+    const auto rx = map_view(r.size, PROT_READ | PROT_EXEC, MAP_SHARED,
+                             fd_size_);
+    if (rx == nullptr) {
+      munmap(rw, r.size);
+      return false;
+    }
+    r.rw = rw;
+    r.rx = rx;
+    fd_size_ += r.size;
+  } else {
+    const auto rwx = map_view(r.size, PROT_READ | PROT_WRITE | PROT_EXEC,
+                              MAP_PRIVATE | MAP_ANONYMOUS, 0);
+    if (rwx == nullptr) {
+      return false;
+    }
+    r.rw = r.rx = rwx;
+  }
+  return true;
+}
+
+unsigned char* CodeArena::map_view(size_t size, int prot, int flags,
+                                   size_t offset) {
+  // Only the placement of executable views matters
+  const auto fd = (flags & MAP_ANONYMOUS) ? -1 : fd_;
+  const auto near = (prot & PROT_EXEC) ? near_ : nullptr;
+  if (!huge_) {
+    const auto p = map_near(size, prot, flags, fd, offset, near, mmap_calls_);
+    return p == MAP_FAILED ? nullptr : (unsigned char*)p;
+  }
+
+  // Transparent huge pages are only used for aligned ranges, so reserve
+  // enough address space to place the view on a huge page boundary
+  const auto res = map_near(size + huge_page_size, PROT_NONE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0,
+                            near, mmap_calls_);
+  if (res == MAP_FAILED) {
+    return nullptr;
+  }
+  const auto begin = (unsigned char*)res;
+  const auto aligned = (unsigned char*)round_to((size_t)begin, huge_page_size);
+  if (aligned != begin) {
+    munmap(begin, aligned - begin);
+  }
+  munmap(aligned + size, begin + huge_page_size - aligned);
+
+  ++mmap_calls_;
+  const auto p = mmap(aligned, size, prot, flags | MAP_FIXED, fd, offset);
+  if (p == MAP_FAILED) {
+    munmap(aligned, size);
+    return nullptr;
+  }
+  if (!hugetlb_) {
+    madvise(p, size, MADV_HUGEPAGE);
+  }
+  return (unsigned char*)p;
+}
+
+} // namespace x64asm
@@ -0,0 +1,163 @@
+/*
+Copyright 2013 eric schkufza
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef X64ASM_SRC_CODE_ARENA_H
+#define X64ASM_SRC_CODE_ARENA_H
+
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+namespace x64asm {
+
+/** An allocator for the buffers of many functions. Buffers are carved out of
+    large regions of an anonymous memory file which is mapped twice: once
+    read-write, where code is written, and once read-execute, where it runs.
+    No page is ever writable and executable through the same mapping. Buffer
+    sizes are rounded up to a power of two no smaller than 64 bytes, and
+    freed buffers are kept on one free list per size, so allocation and
+    release take constant time. Where memory files are unavailable, regions
+    fall back on a single read-write-execute mapping.
+
+    An arena may also back its regions with 2 MB pages, which keeps large
+    amounts of code from thrashing the instruction TLB. It prefers a memory
+    file of reserved huge pages, then a memory file which may use transparent
+    huge pages, and then anonymous memory which may use transparent huge
+    pages. Only the last gives up on separate views, so dual_mapped() should
+    be checked if that matters more.
+*/
+class CodeArena {
+  public:
+    /** Two views of the same buffer. */
+    struct Buffer {
+      /** The read-write view; null if allocation failed. */
+      unsigned char* rw;
+      /** The read-execute view. */
+      unsigned char* rx;
+      /** Size in bytes. */
+      size_t size;
+    };
+
+    /** Creates an empty arena which maps memory in regions of at least
+        region_size bytes, optionally backed by huge pages. Code is placed
+        within rel32 reach of near where possible, so that related code can
+        be linked with direct calls; by default, near the first region.
+    */
+    explicit CodeArena(size_t region_size = 16 << 20, bool huge_pages = false,
+                       const void* near = nullptr);
+    /** Unmaps every region; buffers must not be used afterwards. */
+    ~CodeArena();
+
+    CodeArena(const CodeArena&) = delete;
+    CodeArena& operator=(const CodeArena&) = delete;
+
+    /** Allocates a buffer of at least size bytes. */
+    Buffer allocate(size_t size);
+    /** Returns a buffer to the arena. */
+    void release(const Buffer& buf);
+
+    /** Returns true if code is never writable and executable through the
+        same mapping.
+    */
+    bool dual_mapped() const {
+      return fd_ != -1;
+    }
+    /** Returns true if regions are backed by huge pages, or the kernel has
+        been asked to back them with transparent huge pages.
+    */
+    bool huge_pages() const {
+      return huge_;
+    }
+    /** Returns the address which code is placed near; null if none was
+        given and no region has been mapped yet.
+    */
+    const void* near() const {
+      return near_;
+    }
+    /** Returns the number of calls to mmap made by this arena. */
+    size_t mmap_calls() const {
+      return mmap_calls_;
+    }
+    /** Returns the number of bytes of memory mapped by this arena, counting
+        both views of a region once.
+    */
+    size_t mapped_bytes() const {
+      return mapped_bytes_;
+    }
+    /** Returns the number of bytes in buffers which haven't been released. */
+    size_t used_bytes() const {
+      return used_bytes_;
+    }
+
+  private:
+    /** log2 of the smallest buffer size. */
+    static constexpr size_t min_class_ = 6;
+
+    /** A pair of views of a range of the memory file. */
+    struct Region {
+      unsigned char* rw;
+      unsigned char* rx;
+      size_t size;
+    };
+
+    /** Minimum region size. */
+    size_t region_size_;
+    /** Use huge pages? */
+    bool huge_;
+    /** Is the memory file backed by reserved huge pages? */
+    bool hugetlb_;
+    /** Code is placed within rel32 reach of this address, if set. */
+    const void* near_;
+    /** The memory file, or -1 if regions are single mappings. */
+    int fd_;
+    /** Size of the memory file. */
+    size_t fd_size_;
+    /** Every region mapped so far. */
+    std::vector<Region> regions_;
+    /** The unallocated tail of the newest region. */
+    Region tail_;
+    /** Released buffers, indexed by log2 of their size. */
+    std::vector<std::vector<Buffer>> free_;
+
+    /** Guards everything above. */
+    std::mutex mutex_;
+
+    /** Number of calls to mmap. */
+    size_t mmap_calls_;
+    /** Number of bytes mapped. */
+    size_t mapped_bytes_;
+    /** Number of bytes in use. */
+    size_t used_bytes_;
+
+    /** Maps a region of at least size bytes and makes it the tail; whatever
+        remains of the old tail is moved onto the free lists. Returns false
+        if memory couldn't be mapped.
+    */
+    bool grow(size_t size);
+    /** Maps both views of a region of r.size bytes. */
+    bool map_region(Region& r);
+    /** Maps a view of the memory file, or anonymous memory; returns null on
+        failure. Views of huge pages are aligned to 2 MB.
+    */
+    unsigned char* map_view(size_t size, int prot, int flags, size_t offset);
+    /** Returns the granularity of region sizes. */
+    size_t granule() const;
+};
+
+} // namespace x64asm
+
+#endif
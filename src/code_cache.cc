@@ -0,0 +1,167 @@
+/*
+Copyright 2013 eric schkufza
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "src/code_cache.h"
+
+using namespace std;
+using namespace x64asm;
+
+namespace {
+
+/** Returns a word with its bits mixed (see MurmurHash3's fmix64). */
+uint64_t fmix(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
+  return h;
+}
+
+/** Folds a word into both lanes of a 128-bit hash. The lanes use different
+    multipliers and rotations, so a collision in one is unlikely to be a
+    collision in the other.
+*/
+void mix(uint64_t& lo, uint64_t& hi, uint64_t w) {
+  lo ^= w;
+  lo *= 0x87c37b91114253d5ull;
+  lo = (lo << 31) | (lo >> 33);
+  hi ^= w;
+  hi *= 0x4cf5ad432745937full;
+  hi = (hi << 27) | (hi >> 37);
+  hi += lo;
+}
+
+} // namespace
+
+namespace x64asm {
+
+CodeCache::CodeCache(size_t budget, size_t shards, CodeArena* arena) :
+  budget_(budget), arena_(arena), hits_(0), misses_(0), evictions_(0) {
+  size_t n = 1;
+  while (n < shards) {
+    n <<= 1;
+  }
+  for (size_t i = 0; i < n; ++i) {
+    shards_.emplace_back(new Shard());
+  }
+}
+
+CodeCache::Key CodeCache::key(const Code& code, const Assembler& assm) {
+  uint64_t lo = 0x9e3779b97f4a7c15ull;
+  uint64_t hi = 0x6a09e667f3bcc909ull;
+
+  mix(lo, hi, (assm.get_relaxation() ? 1 : 0) | (assm.get_jcc_erratum() ? 2 : 0));
+  for (const auto& instr : code) {
+    // Opcodes determine arity, so instruction boundaries are unambiguous
+    mix(lo, hi, instr.get_opcode());
+    for (size_t i = 0, ie = instr.arity(); i < ie; ++i) {
+      const auto& o = instr.get_operand<Operand>(i);
+      mix(lo, hi, o.val_);
+      mix(lo, hi, o.val2_);
+    }
+  }
+  mix(lo, hi, code.size());
+
+  lo = fmix(lo);
+  hi = fmix(hi + lo);
+  return Key {lo + hi, hi};
+}
+
+shared_ptr<const Function> CodeCache::get(const Code& code, Assembler& assm) {
+  const auto k = key(code, assm);
+  if (auto fxn = find(k)) {
+    return fxn;
+  }
+
+  // Assembly happens outside of any lock; if another thread caches the same
+  // code in the meantime, its function wins
+  auto fxn = arena_ != nullptr ? make_shared<Function>(*arena_) :
+             make_shared<Function>();
+  assm.assemble(*fxn, code);
+  return insert(k, move(fxn));
+}
+
+shared_ptr<const Function> CodeCache::find(const Key& key) {
+  auto& s = shard(key);
+  lock_guard<mutex> lock(s.mutex);
+
+  const auto itr = s.index.find(key);
+  if (itr == s.index.end()) {
+    ++misses_;
+    return nullptr;
+  }
+  ++hits_;
+  s.lru.splice(s.lru.begin(), s.lru, itr->second);
+  return itr->second->fxn;
+}
+
+shared_ptr<const Function> CodeCache::insert(const Key& key,
+                                             shared_ptr<const Function> fxn) {
+  auto& s = shard(key);
+  lock_guard<mutex> lock(s.mutex);
+
+  const auto itr = s.index.find(key);
+  if (itr != s.index.end()) {
+    s.lru.splice(s.lru.begin(), s.lru, itr->second);
+    return itr->second->fxn;
+  }
+
+  const auto bytes = fxn->capacity();
+  s.lru.push_front(Entry {key, fxn, bytes});
+  s.index[key] = s.lru.begin();
+  s.bytes += bytes;
+
+  // The newest entry is never evicted, even if it alone exceeds the budget
+  const auto budget = budget_ / shards_.size();
+  while (s.bytes > budget && s.lru.size() > 1) {
+    const auto& e = s.lru.back();
+    s.bytes -= e.bytes;
+    s.index.erase(e.key);
+    s.lru.pop_back();
+    ++evictions_;
+  }
+  return fxn;
+}
+
+void CodeCache::clear() {
+  for (auto& s : shards_) {
+    lock_guard<mutex> lock(s->mutex);
+    s->lru.clear();
+    s->index.clear();
+    s->bytes = 0;
+  }
+}
+
+size_t CodeCache::bytes() const {
+  size_t total = 0;
+  for (const auto& s : shards_) {
+    lock_guard<mutex> lock(s->mutex);
+    total += s->bytes;
+  }
+  return total;
+}
+
+size_t CodeCache::size() const {
+  size_t total = 0;
+  for (const auto& s : shards_) {
+    lock_guard<mutex> lock(s->mutex);
+    total += s->lru.size();
+  }
+  return total;
+}
+
+} // namespace x64asm
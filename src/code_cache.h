@@ -0,0 +1,159 @@
+/*
+Copyright 2013 eric schkufza
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef X64ASM_SRC_CODE_CACHE_H
+#define X64ASM_SRC_CODE_CACHE_H
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+
+#include "src/assembler.h"
+#include "src/code.h"
+#include "src/code_arena.h"
+#include "src/function.h"
+
+namespace x64asm {
+
+/** A bounded cache of assembled functions, keyed on the contents of the
+    code they were assembled from. Cached functions are shared and must not
+    be modified; they remain valid for as long as a caller holds them, even
+    after they have been evicted. The cache is split into shards, each with
+    its own lock and least-recently-used list, so that lookups from many
+    threads rarely contend.
+*/
+class CodeCache {
+  public:
+    /** A 128-bit hash of the opcodes and operand bits of a code. */
+    struct Key {
+      uint64_t lo;
+      uint64_t hi;
+
+      bool operator==(const Key& rhs) const {
+        return lo == rhs.lo && hi == rhs.hi;
+      }
+    };
+
+    /** Creates an empty cache which holds at most budget bytes of function
+        buffers. The number of shards is rounded up to a power of two. If an
+        arena is given, functions are allocated from it; it must outlive
+        every function returned by this cache.
+    */
+    explicit CodeCache(size_t budget, size_t shards = 16,
+                       CodeArena* arena = nullptr);
+
+    CodeCache(const CodeCache&) = delete;
+    CodeCache& operator=(const CodeCache&) = delete;
+
+    /** Returns the key of a code. Assembler options which change the bytes
+        that a code assembles to are part of the key.
+    */
+    static Key key(const Code& code, const Assembler& assm);
+
+    /** Returns the function for a code. On a miss, the code is assembled by
+        assm and cached; assm is only used by the calling thread.
+    */
+    std::shared_ptr<const Function> get(const Code& code, Assembler& assm);
+    /** Returns the function for a key, or null. */
+    std::shared_ptr<const Function> find(const Key& key);
+    /** Caches a function under a key and returns it. If another function is
+        already cached under this key, that function is returned instead.
+    */
+    std::shared_ptr<const Function> insert(const Key& key,
+                                           std::shared_ptr<const Function> fxn);
+    /** Evicts every function. */
+    void clear();
+
+    /** Returns the maximum number of bytes held by this cache. */
+    size_t budget() const {
+      return budget_;
+    }
+    /** Returns the number of bytes held by this cache. */
+    size_t bytes() const;
+    /** Returns the number of functions held by this cache. */
+    size_t size() const;
+
+    /** Returns the number of lookups which found a function. */
+    size_t hits() const {
+      return hits_;
+    }
+    /** Returns the number of lookups which didn't find a function. */
+    size_t misses() const {
+      return misses_;
+    }
+    /** Returns the fraction of lookups which found a function. */
+    double hit_rate() const {
+      const auto total = hits() + misses();
+      return total == 0 ? 0.0 : (double)hits() / total;
+    }
+    /** Returns the number of functions evicted to stay within budget. */
+    size_t evictions() const {
+      return evictions_;
+    }
+
+  private:
+    /** A cached function. */
+    struct Entry {
+      Key key;
+      std::shared_ptr<const Function> fxn;
+      size_t bytes;
+    };
+
+    /** Hashes a key for an unordered_map; keys are already well mixed. */
+    struct KeyHash {
+      size_t operator()(const Key& k) const {
+        return k.hi;
+      }
+    };
+
+    /** A lock, a recency list, and an index into the list. */
+    struct Shard {
+      std::mutex mutex;
+      /** Entries in order from most to least recently used. */
+      std::list<Entry> lru;
+      std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> index;
+      /** Number of bytes held by this shard. */
+      size_t bytes = 0;
+    };
+
+    /** Maximum number of bytes held by the cache. */
+    size_t budget_;
+    /** Shards; a key belongs to shards_[key.lo % shards_.size()]. */
+    std::vector<std::unique_ptr<Shard>> shards_;
+    /** Where functions are allocated, or null. */
+    CodeArena* arena_;
+
+    /** Number of successful lookups. */
+    std::atomic<size_t> hits_;
+    /** Number of failed lookups. */
+    std::atomic<size_t> misses_;
+    /** Number of evictions. */
+    std::atomic<size_t> evictions_;
+
+    /** Returns the shard which holds a key. */
+    Shard& shard(const Key& key) const {
+      return *shards_[key.lo & (shards_.size() - 1)];
+    }
+};
+
+} // namespace x64asm
+
+#endif
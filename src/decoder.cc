@@ -0,0 +1,397 @@
+/*
+Copyright 2013 eric schkufza
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "src/decoder.h"
+
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+#include "src/constants.h"
+#include "src/encoding_table.h"
+
+using namespace std;
+
+namespace {
+
+/** Marks index keys for vex encoded opcodes. */
+constexpr uint32_t vex_key = 0x80000000;
+
+/** Index key for a non-vex opcode; n bytes read from p. */
+uint32_t key(const uint8_t* p, size_t n) {
+  uint32_t k = n << 24;
+  for (size_t i = 0; i < n; ++i) {
+    k |= (uint32_t)p[i] << (8 * (n - 1 - i));
+  }
+  return k;
+}
+
+/** Maps opcode bytes to the opcodes which may be encoded by them. */
+typedef unordered_map<uint32_t, vector<x64asm::Opcode>> Index;
+
+/** Builds the opcode index from the encoding table. Label forms are omitted;
+    their encodings are identical to the corresponding rel32 forms.
+*/
+Index make_index() {
+  using namespace x64asm;
+
+  Index index;
+  for (size_t i = 0; i < X64ASM_NUM_OPCODES; ++i) {
+    const auto& e = encoding_table[i];
+    if (e.opc_len == 0 || (e.flags & Encoding::LABEL)) {
+      continue;
+    }
+    if (e.flags & Encoding::VEX) {
+      index[vex_key | (e.vex_mmmmm << 8) | e.opc[0]].push_back((Opcode)i);
+      continue;
+    }
+    uint8_t bytes[3];
+    memcpy(bytes, e.opc, 3);
+    const auto last = e.opc_len - 1;
+    for (size_t r = 0, re = e.opc_reg == -1 ? 1 : 8; r < re; ++r) {
+      bytes[last] = e.opc[last] + r;
+      index[key(bytes, e.opc_len)].push_back((Opcode)i);
+    }
+  }
+  return index;
+}
+
+/** Returns the opcode index; built on first use. */
+const Index& get_index() {
+  static const Index index = make_index();
+  return index;
+}
+
+/** Sign extends the n byte little endian value at p. */
+uint64_t read_imm(const uint8_t* p, size_t n) {
+  uint64_t val = 0;
+  for (size_t i = 0; i < n; ++i) {
+    val |= (uint64_t)p[i] << (8 * i);
+  }
+  if (n < 8 && (p[n - 1] & 0x80)) {
+    val |= ~0ull << (8 * n);
+  }
+  return val;
+}
+
+/** Base register of an implicit string operand; rsi, rdi, or rbx for xlat. */
+uint64_t string_base(uint8_t opc, size_t i) {
+  switch (opc) {
+    case 0xa4: // movs
+    case 0xa5:
+      return i == 0 ? 7 : 6;
+    case 0xa6: // cmps
+    case 0xa7:
+      return i == 0 ? 6 : 7;
+    case 0xac: // lods
+    case 0xad:
+    case 0x6e: // outs
+    case 0x6f:
+      return 6;
+    case 0xd7: // xlat
+      return 3;
+    default:
+      return 7;
+  }
+}
+
+} // namespace
+
+namespace x64asm {
+
+struct Decoder::Header {
+  /** Segment register selected by a group 2 prefix; null if absent. */
+  uint8_t seg;
+  /** True if a 67 prefix was read. */
+  bool addr_or;
+  /** Rex r, x, and b bits (or their vex equivalents) as register bit 3. */
+  uint8_t r;
+  uint8_t x;
+  uint8_t b;
+  /** True if a vex prefix was read. */
+  bool vex;
+  /** Vex mmmmm and (uninverted) vvvv fields. */
+  uint8_t mmmmm;
+  uint8_t vvvv;
+  /** First opcode byte. */
+  const uint8_t* opc;
+};
+
+bool Decoder::read_header(Header& h, const uint8_t* begin, const uint8_t* end,
+                          bool prefixes) const {
+  h.seg = 7;
+  h.addr_or = false;
+  h.r = h.x = h.b = 0;
+  h.vex = false;
+  h.mmmmm = 0;
+  h.vvvv = 0;
+
+  auto p = begin;
+  for (; prefixes && p < end; ++p) {
+    switch (*p) {
+      case 0x26: h.seg = 0; continue;
+      case 0x2e: h.seg = 1; continue;
+      case 0x36: h.seg = 2; continue;
+      case 0x3e: h.seg = 3; continue;
+      case 0x64: h.seg = 4; continue;
+      case 0x65: h.seg = 5; continue;
+      case 0x67: h.addr_or = true; continue;
+      case 0x66:
+      case 0x9b:
+      case 0xf2:
+      case 0xf3:
+        continue;
+      default:
+        break;
+    }
+    break;
+  }
+  if (p == end) {
+    return false;
+  }
+
+  // Rex prefix; See Figure 2.4: Intel Manual Vol 2A 2-8.
+  if ((*p & 0xf0) == 0x40) {
+    h.r = (*p << 1) & 0x8;
+    h.x = (*p << 2) & 0x8;
+    h.b = (*p << 3) & 0x8;
+    ++p;
+  }
+  // Vex prefix; See Figure 2-9: Intel Manual Vol 2A 2-14.
+  else if (*p == 0xc5 && end - p >= 3) {
+    h.vex = true;
+    h.r = (~p[1] >> 4) & 0x8;
+    h.mmmmm = 0x01;
+    h.vvvv = (~p[1] >> 3) & 0xf;
+    p += 2;
+  } else if (*p == 0xc4 && end - p >= 4) {
+    h.vex = true;
+    h.r = (~p[1] >> 4) & 0x8;
+    h.x = (~p[1] >> 3) & 0x8;
+    h.b = (~p[1] >> 2) & 0x8;
+    h.mmmmm = p[1] & 0x1f;
+    h.vvvv = (~p[2] >> 3) & 0xf;
+    p += 3;
+  }
+
+  h.opc = p;
+  return p < end;
+}
+
+size_t Decoder::try_opcode(Instruction& instr, Opcode opc, const Header& h,
+                           const uint8_t* begin, const uint8_t* end) {
+  const auto& e = encoding_table[opc];
+  auto p = h.opc + ((e.flags & Encoding::VEX) ? 1 : e.opc_len);
+
+  // Mod R/M, SIB, and displacement bytes
+  uint64_t rm = 0;
+  uint64_t r = 0;
+  if (e.rm != -1) {
+    if (p == end) {
+      return 0;
+    }
+    const auto mod = *p >> 6;
+    const auto bbb = *p & 0x7;
+    r = ((*p >> 3) & 0x7) | h.r;
+    ++p;
+
+    if ((mod == 0x3) == ((e.flags & Encoding::MEM) != 0)) {
+      return 0;
+    }
+    if (e.digit != -1 && (r & 0x7) != (uint64_t)e.digit) {
+      return 0;
+    }
+
+    if (mod == 0x3) {
+      rm = bbb | h.b;
+    } else {
+      uint64_t base = 0x10;
+      uint64_t index = 0x10;
+      uint64_t scale = 0;
+      uint64_t rip = 0;
+      size_t disp = mod == 0x1 ? 1 : mod == 0x2 ? 4 : 0;
+
+      if (bbb == 0x4) {
+        if (p == end) {
+          return 0;
+        }
+        scale = *p >> 6;
+        if ((((*p >> 3) & 0x7) | h.x) != 0x4) {
+          index = ((*p >> 3) & 0x7) | h.x;
+        }
+        if (mod == 0x0 && (*p & 0x7) == 0x5) {
+          disp = 4;
+        } else {
+          base = (*p & 0x7) | h.b;
+        }
+        ++p;
+      } else if (mod == 0x0 && bbb == 0x5) {
+        rip = 1;
+        disp = 4;
+      } else {
+        base = bbb | h.b;
+      }
+
+      if ((size_t)(end - p) < disp) {
+        return 0;
+      }
+      rm = (disp == 0 ? 0 : read_imm(p, disp) & 0xffffffff) |
+           (base << 32) | (index << 40) | (scale << 48) |
+           ((uint64_t)h.seg << 56) | ((uint64_t)h.addr_or << 60) |
+           (rip << 61);
+      p += disp;
+    }
+  }
+
+  // Immediate bytes
+  const auto imm = p;
+  const size_t imm_size = e.imm_size + ((e.flags & Encoding::IS4) ? 1 : 0);
+  if ((size_t)(end - imm) < imm_size) {
+    return 0;
+  }
+
+  Instruction candidate(opc);
+  Operand ops[4];
+  for (size_t i = 0, ie = candidate.arity(); i < ie; ++i) {
+    auto& o = ops[i];
+    if ((int)i == e.rm) {
+      o.val_ = rm;
+    } else if ((int)i == e.r) {
+      o.val_ = r;
+    } else if ((int)i == e.opc_reg) {
+      o.val_ = (h.opc[e.opc_len - 1] - e.opc[e.opc_len - 1]) | h.b;
+    } else if ((int)i == e.vvvv) {
+      o.val_ = h.vvvv;
+    } else if ((e.flags & Encoding::II) && i < 2) {
+      o.val_ = i == 0 ? read_imm(imm + 2, 1) : read_imm(imm, 2);
+    } else if ((int)i == e.imm) {
+      o.val_ = read_imm(imm, e.imm_size);
+      switch (candidate.type(i)) {
+        case Type::MOFFS_8:
+        case Type::MOFFS_16:
+        case Type::MOFFS_32:
+        case Type::MOFFS_64:
+          o.val2_ = 7;
+          break;
+        default:
+          break;
+      }
+    } else if ((e.flags & Encoding::IS4) && i == 3) {
+      o.val_ = imm[e.imm_size] >> 4;
+    } else if ((e.flags & Encoding::HINT) && i == 1) {
+      o.val_ = h.seg == 1 ? 1 : 0;
+    } else if (candidate.type(i) >= Type::M_8 &&
+               candidate.type(i) <= Type::FAR_PTR_16_64) {
+      // Implicit string operands; only the first one emits prefixes
+      const uint64_t seg = (int)i == e.mem ? h.seg : 7;
+      o.val_ = (string_base(h.opc[e.opc_len - 1], i) << 32) | (0x10ull << 40) |
+               (seg << 56) | ((uint64_t)h.addr_or << 60);
+    } else {
+      switch (candidate.type(i)) {
+        case Type::ZERO:       o = zero; break;
+        case Type::ONE:        o = one; break;
+        case Type::THREE:      o = three; break;
+        case Type::PREF_66:    o = pref_66; break;
+        case Type::PREF_REX_W: o = pref_rex_w; break;
+        case Type::FAR:        o = far; break;
+        case Type::AL:         o = al; break;
+        case Type::CL:         o = cl; break;
+        case Type::AX:         o = ax; break;
+        case Type::DX:         o = dx; break;
+        case Type::EAX:        o = eax; break;
+        case Type::RAX:        o = rax; break;
+        case Type::FS:         o = fs; break;
+        case Type::GS:         o = gs; break;
+        case Type::ST_0:       o = st0; break;
+        case Type::XMM_0:      o = xmm0; break;
+        default:
+          return 0;
+      }
+    }
+  }
+  candidate = Instruction(opc, ops, ops + candidate.arity());
+  if (!candidate.check()) {
+    return 0;
+  }
+
+  // Accept only exact round trips
+  assm_.start(scratch_);
+  assm_.assemble(candidate);
+  assm_.finish();
+
+  const auto n = scratch_.size();
+  if ((size_t)(end - begin) < n || memcmp(scratch_.data(), begin, n) != 0) {
+    return 0;
+  }
+
+  instr = candidate;
+  return n;
+}
+
+size_t Decoder::try_header(Instruction& instr, const uint8_t* begin,
+                           const uint8_t* end, bool prefixes) {
+  Header h;
+  if (!read_header(h, begin, end, prefixes)) {
+    return 0;
+  }
+
+  const auto& index = get_index();
+  const auto avail = (size_t)(end - h.opc);
+  for (size_t len = h.vex ? 1 : 3; len > 0; --len) {
+    if (len > avail) {
+      continue;
+    }
+    const auto k = h.vex ? vex_key | (h.mmmmm << 8) | *h.opc : key(h.opc, len);
+    const auto itr = index.find(k);
+    if (itr == index.end()) {
+      continue;
+    }
+    for (const auto opc : itr->second) {
+      if (const auto n = try_opcode(instr, opc, h, begin, end)) {
+        return n;
+      }
+    }
+  }
+  return 0;
+}
+
+size_t Decoder::decode(Instruction& instr, const uint8_t* begin,
+                       const uint8_t* end) {
+  if (begin >= end) {
+    return 0;
+  }
+  // Retry without reading prefixes; catches instructions such as fwait and
+  // pause whose first byte doubles as a prefix.
+  if (const auto n = try_header(instr, begin, end, true)) {
+    return n;
+  }
+  return try_header(instr, begin, end, false);
+}
+
+bool Decoder::decode(Code& code, const uint8_t* begin, const uint8_t* end) {
+  Instruction instr(NOP);
+  while (begin < end) {
+    const auto n = decode(instr, begin, end);
+    if (n == 0) {
+      return false;
+    }
+    code.push_back(instr);
+    begin += n;
+  }
+  return true;
+}
+
+} // namespace x64asm
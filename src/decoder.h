@@ -0,0 +1,86 @@
+/*
+Copyright 2013 eric schkufza
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef X64ASM_SRC_DECODER_H
+#define X64ASM_SRC_DECODER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "src/assembler.h"
+#include "src/code.h"
+#include "src/function.h"
+#include "src/instruction.h"
+
+namespace x64asm {
+
+/** A machine code decoder; the inverse of Assembler. Candidate opcodes are
+    looked up in an index built from the generated encoding table, and each
+    candidate's operands are read off the mod r/m, sib, displacement and
+    immediate bytes it implies. A candidate is accepted only if it is
+    well-formed and assembles back to exactly the bytes that were read, so
+    every decoded instruction round-trips through the Assembler. Bytes which
+    the Assembler would never emit (for instance, redundant prefixes) are
+    rejected. Branch targets decode as relative displacements since label
+    names are not recoverable.
+*/
+class Decoder {
+  public:
+    /** Decodes the instruction at the start of [begin, end). Returns the
+        number of bytes consumed, or zero if no instruction was recognized.
+    */
+    size_t decode(Instruction& instr, const uint8_t* begin, const uint8_t* end);
+
+    /** Decodes [begin, end) into a code. Returns false if some bytes could
+        not be decoded; code then holds the instructions which precede them.
+    */
+    bool decode(Code& code, const uint8_t* begin, const uint8_t* end);
+
+    /** Decodes the contents of a function. */
+    bool decode(Code& code, const Function& fxn) {
+      const auto begin = (const uint8_t*)fxn.data();
+      return decode(code, begin, begin + fxn.size());
+    }
+
+  private:
+    /** Used to check candidates by reassembling them. */
+    Assembler assm_;
+    /** Scratch space for reassembled candidates. */
+    Function scratch_;
+
+    /** Prefixes, rex and vex fields, and opcode bytes at the start of an
+        instruction.
+    */
+    struct Header;
+
+    /** Reads prefixes and opcode bytes; returns false on a truncated input. */
+    bool read_header(Header& h, const uint8_t* begin, const uint8_t* end,
+                     bool prefixes) const;
+
+    /** Decodes a candidate opcode. Returns the number of bytes consumed, or
+        zero if the candidate doesn't reproduce the input.
+    */
+    size_t try_opcode(Instruction& instr, Opcode opc, const Header& h,
+                      const uint8_t* begin, const uint8_t* end);
+
+    /** Tries every candidate opcode for the header read from begin. */
+    size_t try_header(Instruction& instr, const uint8_t* begin,
+                      const uint8_t* end, bool prefixes);
+};
+
+} // namespace x64asm
+
+#endif
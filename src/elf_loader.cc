@@ -0,0 +1,386 @@
+/*
+Copyright 2013 eric schkufza
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "src/elf_loader.h"
+
+#include <algorithm>
+#include <cstring>
+#include <unordered_map>
+
+#include <elf.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "src/label.h"
+
+using namespace std;
+using namespace x64asm;
+
+namespace {
+
+/** Rounds an address up to a multiple of a power of two. */
+uint64_t align(uint64_t addr, uint64_t a) {
+  return (addr + a - 1) & ~(a - 1);
+}
+
+/** Returns true if [offset, offset+size) lies within a file of length len. */
+bool in_bounds(uint64_t offset, uint64_t size, uint64_t len) {
+  return offset <= len && size <= len - offset;
+}
+
+/** Returns the null-terminated string at offset idx of a string table, or
+    the empty string if it doesn't lie within the table.
+*/
+string read_str(const uint8_t* base, const Elf64_Shdr& tab, uint32_t idx) {
+  if (idx >= tab.sh_size) {
+    return "";
+  }
+  const auto s = (const char*)base + tab.sh_offset + idx;
+  const auto n = tab.sh_size - idx;
+  return (memchr(s, '\0', n) == nullptr) ? string(s, n) : string(s);
+}
+
+/** Returns true if a value fits in a sign-extended 32-bit field. */
+bool fits_int32(int64_t val) {
+  return val >= INT32_MIN && val <= INT32_MAX;
+}
+
+/** Rewrites a load through the GOT whose rel32 is at p as a direct
+    reference to the symbol, as a linker would. Returns false if the
+    instruction has no direct form.
+*/
+bool relax(uint8_t* p) {
+  if (p[-2] == 0x8b && (p[-1] & 0xc7) == 0x05) {
+    // mov reg, [rip+disp] becomes lea reg, [rip+disp]
+    p[-2] = 0x8d;
+  } else if (p[-2] == 0xff && p[-1] == 0x15) {
+    // call [rip+disp] becomes addr32 call rel32
+    p[-2] = 0x67;
+    p[-1] = 0xe8;
+  } else if (p[-2] == 0xff && p[-1] == 0x25) {
+    // jmp [rip+disp] becomes nop; jmp rel32
+    p[-2] = 0x90;
+    p[-1] = 0xe9;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+} // namespace
+
+namespace x64asm {
+
+bool ElfLoader::load(const string& file, Function& fxn) {
+  symbols_.clear();
+  error_.clear();
+
+  const auto fd = ::open(file.c_str(), O_RDONLY);
+  if (fd == -1) {
+    return fail("unable to open " + file);
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_size <= 0) {
+    ::close(fd);
+    return fail("unable to read " + file);
+  }
+  const auto addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (addr == MAP_FAILED) {
+    return fail("unable to read " + file);
+  }
+
+  const auto ok = load((const uint8_t*)addr, st.st_size, fxn);
+  munmap(addr, st.st_size);
+  if (!ok) {
+    symbols_.clear();
+  }
+  return ok;
+}
+
+const ElfLoader::Symbol* ElfLoader::find_symbol(const string& name) const {
+  for (const auto& s : symbols_) {
+    if (s.name == name) {
+      return &s;
+    }
+  }
+  return nullptr;
+}
+
+bool ElfLoader::load(const uint8_t* base, size_t size, Function& fxn) {
+  if (size < sizeof(Elf64_Ehdr)) {
+    return fail("not an ELF file");
+  }
+  const auto& eh = *(const Elf64_Ehdr*)base;
+  if (memcmp(eh.e_ident, ELFMAG, SELFMAG) != 0 ||
+      eh.e_ident[EI_CLASS] != ELFCLASS64 ||
+      eh.e_ident[EI_DATA] != ELFDATA2LSB || eh.e_machine != EM_X86_64) {
+    return fail("not a 64-bit x86 ELF file");
+  } else if (eh.e_type != ET_REL) {
+    return fail("not a relocatable object");
+  }
+  if (eh.e_shentsize != sizeof(Elf64_Shdr) ||
+      !in_bounds(eh.e_shoff, sizeof(Elf64_Shdr), size)) {
+    return fail("malformed section table");
+  }
+
+  // Section counts and the string table index may overflow into the first
+  // section header.
+  const auto shdrs = (const Elf64_Shdr*)(base + eh.e_shoff);
+  const uint64_t shnum = eh.e_shnum == 0 ? shdrs[0].sh_size : eh.e_shnum;
+  const uint64_t shstrndx = eh.e_shstrndx == SHN_XINDEX ?
+                            shdrs[0].sh_link : eh.e_shstrndx;
+  if (shnum > (size - eh.e_shoff) / sizeof(Elf64_Shdr) || shstrndx >= shnum) {
+    return fail("malformed section table");
+  }
+  const Elf64_Shdr* symtab = nullptr;
+  for (size_t i = 0; i < shnum; ++i) {
+    const auto& sh = shdrs[i];
+    if (sh.sh_type != SHT_NOBITS &&
+        !in_bounds(sh.sh_offset, sh.sh_size, size)) {
+      return fail("malformed section table");
+    } else if (sh.sh_addralign > 4096 ||
+               (sh.sh_addralign & (sh.sh_addralign - 1)) != 0) {
+      return fail("unsupported section alignment");
+    } else if (sh.sh_type == SHT_SYMTAB) {
+      symtab = &sh;
+    }
+  }
+  if (symtab == nullptr || symtab->sh_entsize != sizeof(Elf64_Sym) ||
+      symtab->sh_link >= shnum) {
+    return fail("missing or malformed symbol table");
+  }
+  const auto& strtab = shdrs[symtab->sh_link];
+  const auto syms = (const Elf64_Sym*)(base + symtab->sh_offset);
+  const auto nsyms = symtab->sh_size / sizeof(Elf64_Sym);
+
+  // Allocated sections which are never written are loaded. Unwind tables
+  // are left out; the code they describe can't be unwound by the system.
+  vector<bool> loaded(shnum, false);
+  for (size_t i = 0; i < shnum; ++i) {
+    const auto& sh = shdrs[i];
+    loaded[i] = (sh.sh_flags & SHF_ALLOC) != 0 &&
+                (sh.sh_flags & (SHF_WRITE | SHF_TLS)) == 0 &&
+                (sh.sh_type == SHT_PROGBITS || sh.sh_type == SHT_NOBITS) &&
+                read_str(base, shdrs[shstrndx], sh.sh_name) != ".eh_frame";
+  }
+
+  // Every symbol loaded through the GOT gets a slot, whether or not the load
+  // can be relaxed
+  unordered_map<uint64_t, size_t> got;
+  for (size_t i = 0; i < shnum; ++i) {
+    const auto& sh = shdrs[i];
+    if (sh.sh_type == SHT_REL && sh.sh_info < shnum && loaded[sh.sh_info]) {
+      return fail("REL relocations aren't supported");
+    } else if (sh.sh_type != SHT_RELA || sh.sh_info >= shnum ||
+               !loaded[sh.sh_info]) {
+      continue;
+    }
+    if (sh.sh_entsize != sizeof(Elf64_Rela) ||
+        sh.sh_link != (uint64_t)(symtab - shdrs)) {
+      return fail("malformed relocation table");
+    }
+    const auto relas = (const Elf64_Rela*)(base + sh.sh_offset);
+    for (size_t j = 0, je = sh.sh_size / sizeof(Elf64_Rela); j < je; ++j) {
+      const auto type = ELF64_R_TYPE(relas[j].r_info);
+      if (type == R_X86_64_GOTPCREL || type == R_X86_64_GOTPCRELX ||
+          type == R_X86_64_REX_GOTPCRELX) {
+        got.insert(make_pair(ELF64_R_SYM(relas[j].r_info), got.size()));
+      }
+    }
+  }
+
+  // Sections keep their alignment relative to the address of the function,
+  // and the GOT follows them
+  uint64_t total = got.size() * 8 + 8;
+  for (size_t i = 0; i < shnum; ++i) {
+    if (loaded[i]) {
+      total += shdrs[i].sh_size + shdrs[i].sh_addralign;
+    }
+  }
+  fxn.clear();
+  if (!fxn.reserve(total)) {
+    return fail("unable to allocate memory");
+  }
+  const auto start = (uint64_t)fxn.data();
+  vector<uint64_t> place(shnum, 0);
+  uint64_t end = 0;
+  for (size_t i = 0; i < shnum; ++i) {
+    if (loaded[i]) {
+      const auto a = max(shdrs[i].sh_addralign, (uint64_t)1);
+      place[i] = align(start + end, a) - start;
+      end = place[i] + shdrs[i].sh_size;
+    }
+  }
+  const auto got_pos = align(start + end, 8) - start;
+  end = got_pos + got.size() * 8;
+
+  const auto buf = fxn.buffer_;
+  memset(buf, 0xcc, end);
+  for (size_t i = 0; i < shnum; ++i) {
+    if (!loaded[i]) {
+      continue;
+    } else if (shdrs[i].sh_type == SHT_NOBITS) {
+      memset(buf + place[i], 0, shdrs[i].sh_size);
+    } else {
+      memcpy(buf + place[i], base + shdrs[i].sh_offset, shdrs[i].sh_size);
+    }
+  }
+  fxn.head_ = buf + end;
+
+  // Global symbols define labels, and undefined symbols are referenced by
+  // labels; both are numbered the way the assembler numbers labels
+  unordered_map<uint64_t, size_t> locals;
+  const auto label = [&fxn, &locals](const string& name) {
+    const uint64_t id = Label(name);
+    const auto itr = locals.find(id);
+    if (itr != locals.end()) {
+      return itr->second;
+    }
+    const auto idx = fxn.label_ids_.size();
+    fxn.label_ids_.push_back(id);
+    fxn.label_defs_.push_back(Function::undef_label());
+    locals.insert(make_pair(id, idx));
+    return idx;
+  };
+  for (size_t i = 1; i < nsyms; ++i) {
+    const auto& sym = syms[i];
+    const auto type = ELF64_ST_TYPE(sym.st_info);
+    const auto bind = ELF64_ST_BIND(sym.st_info);
+    if (type == STT_SECTION || type == STT_FILE || sym.st_shndx >= shnum ||
+        !loaded[sym.st_shndx]) {
+      continue;
+    }
+    const Symbol s {read_str(base, strtab, sym.st_name),
+                    place[sym.st_shndx] + sym.st_value, sym.st_size,
+                    bind != STB_LOCAL};
+    if (s.global && !s.name.empty()) {
+      fxn.label_defs_[label(s.name)] = s.offset;
+    }
+    symbols_.push_back(s);
+  }
+
+  // Applies relocations
+  for (size_t i = 0; i < shnum; ++i) {
+    const auto& sh = shdrs[i];
+    if (sh.sh_type != SHT_RELA || sh.sh_info >= shnum || !loaded[sh.sh_info]) {
+      continue;
+    }
+    const auto& target = shdrs[sh.sh_info];
+    const auto relas = (const Elf64_Rela*)(base + sh.sh_offset);
+    for (size_t j = 0, je = sh.sh_size / sizeof(Elf64_Rela); j < je; ++j) {
+      const auto& r = relas[j];
+      auto type = ELF64_R_TYPE(r.r_info);
+      const auto idx = ELF64_R_SYM(r.r_info);
+      const auto width = type == R_X86_64_64 || type == R_X86_64_PC64 ? 8 : 4;
+      if (type == R_X86_64_NONE) {
+        continue;
+      } else if (idx >= nsyms || target.sh_type == SHT_NOBITS ||
+                 !in_bounds(r.r_offset, width, target.sh_size)) {
+        return fail("malformed relocation");
+      }
+
+      // Section symbols are named after their sections
+      const auto& sym = syms[idx];
+      const auto name = ELF64_ST_TYPE(sym.st_info) == STT_SECTION &&
+                        sym.st_shndx < shnum ?
+                        read_str(base, shdrs[shstrndx],
+                                 shdrs[sym.st_shndx].sh_name) :
+                        read_str(base, strtab, sym.st_name);
+      const auto pos = place[sh.sh_info] + r.r_offset;
+      const auto p = start + pos;
+      const auto a = r.r_addend;
+
+      // The address of the symbol, unless it is undefined
+      const auto undef = sym.st_shndx == SHN_UNDEF;
+      uint64_t s = 0;
+      if (sym.st_shndx == SHN_ABS) {
+        s = sym.st_value;
+      } else if (!undef && (sym.st_shndx >= shnum || !loaded[sym.st_shndx])) {
+        return fail("reference to " + name + ", which isn't loaded");
+      } else if (!undef) {
+        s = start + place[sym.st_shndx] + sym.st_value;
+      }
+
+      // Loads through the GOT become direct where possible; the rest use a
+      // slot which holds the address of the symbol
+      if (type == R_X86_64_GOTPCREL || type == R_X86_64_GOTPCRELX ||
+          type == R_X86_64_REX_GOTPCRELX) {
+        if (type != R_X86_64_GOTPCREL && a == -4 && r.r_offset >= 2 &&
+            relax(buf + pos)) {
+          type = R_X86_64_PC32;
+        } else if (undef) {
+          return fail("unsupported load of " + name + " through the GOT");
+        } else {
+          const auto slot = got_pos + got[idx] * 8;
+          memcpy(buf + slot, &s, 8);
+          s = start + slot;
+          type = R_X86_64_PC32;
+        }
+      }
+
+      // Undefined symbols are left to the linker, which only patches rel32
+      // displacements at the end of an instruction
+      if (undef) {
+        if ((type != R_X86_64_PC32 && type != R_X86_64_PLT32) || a != -4) {
+          return fail("unsupported reference to " + name);
+        }
+        fxn.label_rels_.push_back(make_pair(pos, label(name)));
+        continue;
+      }
+
+      int64_t val = 0;
+      switch (type) {
+        case R_X86_64_64:
+          val = s + a;
+          memcpy(buf + pos, &val, 8);
+          continue;
+        case R_X86_64_PC64:
+          val = s + a - p;
+          memcpy(buf + pos, &val, 8);
+          continue;
+        case R_X86_64_PC32:
+        case R_X86_64_PLT32:
+          val = s + a - p;
+          break;
+        case R_X86_64_32:
+          val = s + a;
+          if ((uint64_t)val > UINT32_MAX) {
+            return fail("absolute reference to " + name + " out of range");
+          }
+          memcpy(buf + pos, &val, 4);
+          continue;
+        case R_X86_64_32S:
+          val = s + a;
+          break;
+        default:
+          return fail("unsupported relocation type " + to_string(type));
+      }
+      if (!fits_int32(val)) {
+        return fail((type == R_X86_64_32S ? "absolute" : "relative") +
+                    string(" reference to ") + name + " out of range");
+      }
+      const auto val32 = (int32_t)val;
+      memcpy(buf + pos, &val32, 4);
+    }
+  }
+
+  return true;
+}
+
+} // namespace x64asm
@@ -0,0 +1,94 @@
+/*
+Copyright 2013 eric schkufza
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef X64ASM_SRC_ELF_LOADER_H
+#define X64ASM_SRC_ELF_LOADER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "src/function.h"
+
+namespace x64asm {
+
+/** Loads the code and read-only data of a 64-bit x86 ELF relocatable object,
+    such as one built by gcc, into a function so that it can be linked with
+    assembled functions. Global symbols become definitions of the labels
+    with the same names, and references to undefined symbols become label
+    references which Linker resolves like any other. Relocations against
+    symbols in the object are applied as the object is loaded.
+
+    Loaded sections are the allocated, non-writable ones: .text, .rodata and
+    their variants. Objects which refer to writable or thread-local data
+    aren't supported. Supported relocations are R_X86_64_64, 32, 32S, PC32,
+    PLT32, PC64 and the GOTPCREL family. References to undefined symbols must
+    be rel32 branches or address loads; loads through the GOT are rewritten
+    as direct ones, as a linker would. Absolute relocations depend on the
+    address of the function, so it must not be copied or grown once loaded.
+*/
+class ElfLoader {
+  public:
+    /** A symbol defined by a loaded object. */
+    struct Symbol {
+      /** Symbol name. */
+      std::string name;
+      /** Offset of the first byte in the function. */
+      size_t offset;
+      /** Size in bytes. */
+      size_t size;
+      /** Is the symbol visible to other objects? */
+      bool global;
+    };
+
+    /** Loads an object into fxn, replacing its contents. Returns false if the
+        file can't be read, isn't a well-formed relocatable object, or uses
+        something which isn't supported; error() then says why.
+    */
+    bool load(const std::string& file, Function& fxn);
+
+    /** Returns the symbols defined by the last object loaded, in file order.
+        Section and file symbols are omitted.
+    */
+    const std::vector<Symbol>& symbols() const {
+      return symbols_;
+    }
+    /** Returns the first symbol with this name, or null. */
+    const Symbol* find_symbol(const std::string& name) const;
+    /** Returns why the last load failed, or the empty string. */
+    const std::string& error() const {
+      return error_;
+    }
+
+  private:
+    /** Symbols of the last object loaded. */
+    std::vector<Symbol> symbols_;
+    /** Reason for the last failure. */
+    std::string error_;
+
+    /** Records a failure and returns false. */
+    bool fail(const std::string& why) {
+      error_ = why;
+      return false;
+    }
+    /** Loads a mapped file. */
+    bool load(const uint8_t* base, size_t size, Function& fxn);
+};
+
+} // namespace x64asm
+
+#endif
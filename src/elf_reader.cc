@@ -0,0 +1,333 @@
+/*
+Copyright 2013 eric schkufza
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "src/elf_reader.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <elf.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "src/label.h"
+
+using namespace std;
+using namespace x64asm;
+
+namespace {
+
+/** Returns the system page size. */
+uint64_t page_size() {
+  static const uint64_t size = sysconf(_SC_PAGESIZE);
+  return size;
+}
+
+/** Returns true if [offset, offset+size) lies within a file of length len. */
+bool in_bounds(uint64_t offset, uint64_t size, uint64_t len) {
+  return offset <= len && size <= len - offset;
+}
+
+/** Returns the null-terminated string at offset idx of a string table, or
+    the empty string if it doesn't lie within the table.
+*/
+string read_str(const uint8_t* base, const Elf64_Shdr& tab, uint32_t idx) {
+  if (idx >= tab.sh_size) {
+    return "";
+  }
+  const auto s = (const char*)base + tab.sh_offset + idx;
+  const auto n = tab.sh_size - idx;
+  return (memchr(s, '\0', n) == nullptr) ? string(s, n) : string(s);
+}
+
+} // namespace
+
+namespace x64asm {
+
+ElfReader::ElfReader() : base_(nullptr), size_(0) {
+  rewind();
+}
+
+ElfReader::~ElfReader() {
+  close();
+}
+
+bool ElfReader::open(const string& file) {
+  close();
+
+  const auto fd = ::open(file.c_str(), O_RDONLY);
+  if (fd == -1) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_size <= 0) {
+    ::close(fd);
+    return false;
+  }
+  const auto addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (addr == MAP_FAILED) {
+    return false;
+  }
+
+  base_ = (const uint8_t*)addr;
+  size_ = st.st_size;
+  madvise(addr, size_, MADV_SEQUENTIAL);
+
+  if (!read_tables()) {
+    close();
+    return false;
+  }
+  rewind();
+  return true;
+}
+
+void ElfReader::close() {
+  if (base_ != nullptr) {
+    munmap((void*)base_, size_);
+  }
+  base_ = nullptr;
+  size_ = 0;
+  sections_.clear();
+  symbols_.clear();
+  rewind();
+}
+
+const ElfReader::Symbol* ElfReader::find_symbol(const string& name) const {
+  for (const auto& s : symbols_) {
+    if (s.name == name) {
+      return &s;
+    }
+  }
+  return nullptr;
+}
+
+void ElfReader::rewind() {
+  sec_ = 0;
+  pos_ = 0;
+  sym_ = 0;
+  released_ = 0;
+  chunk_addr_ = 0;
+  chunk_size_ = 0;
+  chunk_sec_ = 0;
+  skipped_ = 0;
+}
+
+bool ElfReader::next(Code& chunk, size_t max) {
+  chunk.clear();
+  Instruction instr(NOP);
+
+  for (; sec_ < sections_.size(); ++sec_, pos_ = 0) {
+    const auto& s = sections_[sec_];
+    const auto begin = data(s);
+    const auto end = begin + s.size;
+
+    auto p = begin + pos_;
+    // The first of the bytes skipped just before p, if any
+    auto from = p;
+    size_t count = 0;
+    while (p < end && count < max) {
+      const auto n = decoder_.decode(instr, p, end);
+      if (n == 0) {
+        if (count > 0) {
+          break;
+        }
+        const auto k = skip(p, end, s.addr + (p - begin));
+        skipped_ += k;
+        p += k;
+        continue;
+      }
+
+      const auto addr = s.addr + (p - begin);
+      if (count == 0) {
+        chunk_addr_ = addr;
+        chunk_sec_ = sec_;
+      }
+      // Symbols which start inside of an instruction are passed over without
+      // a label. Those which start in skipped bytes (eg: an endbr64 which the
+      // decoder rejects) are labeled here, unless a later one starts there
+      // too, in which case nothing of theirs was decoded.
+      const auto first = s.addr + (from - begin);
+      const auto mark = chunk.size();
+      auto labeled = first;
+      for (; sym_ < symbols_.size(); ++sym_) {
+        const auto& sym = symbols_[sym_];
+        if (sym.section > sec_ || (sym.section == sec_ && sym.addr > addr)) {
+          break;
+        }
+        if (sym.section != sec_ || sym.addr < first) {
+          continue;
+        }
+        if (sym.addr != labeled) {
+          chunk.erase(chunk.begin() + mark, chunk.end());
+          labeled = sym.addr;
+        }
+        chunk.push_back(Instruction(LABEL_DEFN, {Label(sym.name)}));
+      }
+
+      chunk.push_back(instr);
+      ++count;
+      p += n;
+      from = p;
+    }
+
+    pos_ = p - begin;
+    release(s.offset + pos_);
+    if (count > 0) {
+      chunk_size_ = s.addr + pos_ - chunk_addr_;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool ElfReader::function(const Symbol& sym, Code& code) {
+  const auto& s = sections_[sym.section];
+  const auto begin = data(s) + (sym.addr - s.addr);
+  return decoder_.decode(code, begin, begin + sym.size);
+}
+
+bool ElfReader::read_tables() {
+  if (size_ < sizeof(Elf64_Ehdr)) {
+    return false;
+  }
+  const auto& eh = *(const Elf64_Ehdr*)base_;
+  if (memcmp(eh.e_ident, ELFMAG, SELFMAG) != 0 ||
+      eh.e_ident[EI_CLASS] != ELFCLASS64 ||
+      eh.e_ident[EI_DATA] != ELFDATA2LSB || eh.e_machine != EM_X86_64) {
+    return false;
+  }
+  if (eh.e_shoff == 0) {
+    return true;
+  }
+  if (eh.e_shentsize != sizeof(Elf64_Shdr) ||
+      !in_bounds(eh.e_shoff, sizeof(Elf64_Shdr), size_)) {
+    return false;
+  }
+
+  // Section counts and the string table index may overflow into the first
+  // section header.
+  const auto shdrs = (const Elf64_Shdr*)(base_ + eh.e_shoff);
+  const uint64_t shnum = eh.e_shnum == 0 ? shdrs[0].sh_size : eh.e_shnum;
+  const uint64_t shstrndx = eh.e_shstrndx == SHN_XINDEX ?
+                            shdrs[0].sh_link : eh.e_shstrndx;
+  if (shnum > (size_ - eh.e_shoff) / sizeof(Elf64_Shdr) ||
+      shstrndx >= shnum) {
+    return false;
+  }
+  for (size_t i = 0; i < shnum; ++i) {
+    if (shdrs[i].sh_type != SHT_NOBITS &&
+        !in_bounds(shdrs[i].sh_offset, shdrs[i].sh_size, size_)) {
+      return false;
+    }
+  }
+
+  // Executable sections, and a map from section header indices to them.
+  vector<size_t> index(shnum, sections_.max_size());
+  for (size_t i = 0; i < shnum; ++i) {
+    const auto& sh = shdrs[i];
+    if (sh.sh_type == SHT_NOBITS || (sh.sh_flags & SHF_EXECINSTR) == 0) {
+      continue;
+    }
+    index[i] = sections_.size();
+    sections_.push_back({read_str(base_, shdrs[shstrndx], sh.sh_name),
+                         sh.sh_addr, sh.sh_offset, sh.sh_size});
+  }
+
+  // Function symbols; fall back on the dynamic symbol table if the file has
+  // been stripped.
+  const Elf64_Shdr* symtab = nullptr;
+  for (size_t i = 0; i < shnum; ++i) {
+    if (shdrs[i].sh_type == SHT_SYMTAB ||
+        (shdrs[i].sh_type == SHT_DYNSYM && symtab == nullptr)) {
+      symtab = &shdrs[i];
+    }
+  }
+  if (symtab == nullptr) {
+    return true;
+  }
+  if (symtab->sh_entsize != sizeof(Elf64_Sym) || symtab->sh_link >= shnum) {
+    return false;
+  }
+  const auto& strtab = shdrs[symtab->sh_link];
+  const auto syms = (const Elf64_Sym*)(base_ + symtab->sh_offset);
+  for (size_t i = 0, ie = symtab->sh_size / sizeof(Elf64_Sym); i < ie; ++i) {
+    const auto& sym = syms[i];
+    if (ELF64_ST_TYPE(sym.st_info) != STT_FUNC || sym.st_shndx >= shnum ||
+        index[sym.st_shndx] == sections_.max_size()) {
+      continue;
+    }
+    const auto sec = index[sym.st_shndx];
+    const auto& s = sections_[sec];
+    if (sym.st_value < s.addr || sym.st_value - s.addr >= s.size) {
+      continue;
+    }
+    const auto size = min(sym.st_size, s.size - (sym.st_value - s.addr));
+    symbols_.push_back({read_str(base_, strtab, sym.st_name), sym.st_value,
+                        size, sec});
+  }
+
+  sort(symbols_.begin(), symbols_.end(), [](const Symbol& a, const Symbol& b) {
+    return a.section != b.section ? a.section < b.section : a.addr < b.addr;
+  });
+  for (size_t i = 0, ie = symbols_.size(); i < ie; ++i) {
+    auto& sym = symbols_[i];
+    if (sym.size != 0) {
+      continue;
+    }
+    const auto& s = sections_[sym.section];
+    auto end = s.addr + s.size;
+    for (auto j = i + 1; j < ie && symbols_[j].section == sym.section; ++j) {
+      if (symbols_[j].addr > sym.addr) {
+        end = symbols_[j].addr;
+        break;
+      }
+    }
+    sym.size = end - sym.addr;
+  }
+
+  return true;
+}
+
+size_t ElfReader::skip(const uint8_t* begin, const uint8_t* end,
+                       uint64_t addr) const {
+  // Resynchronizing a byte at a time inside a function would decode junk
+  // and pass over its symbol, so skips stop at the next symbol instead
+  const auto next = upper_bound(symbols_.begin() + sym_, symbols_.end(),
+      make_pair(sec_, addr), [](const pair<size_t, uint64_t>& a,
+                                const Symbol& s) {
+    return a.first != s.section ? a.first < s.section : a.second < s.addr;
+  });
+  auto limit = (size_t)(end - begin);
+  if (next != symbols_.end() && next->section == sec_) {
+    limit = min(limit, (size_t)(next->addr - addr));
+  }
+
+  const auto n = lengths_.length(begin, end);
+  return n == 0 ? limit : min(n, limit);
+}
+
+void ElfReader::release(uint64_t offset) {
+  const auto end = offset & ~(page_size() - 1);
+  if (end > released_) {
+    madvise((void*)(base_ + released_), end - released_, MADV_DONTNEED);
+    released_ = end;
+  }
+}
+
+} // namespace x64asm
@@ -0,0 +1,186 @@
+/*
+Copyright 2013 eric schkufza
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef X64ASM_SRC_ELF_READER_H
+#define X64ASM_SRC_ELF_READER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "src/code.h"
+#include "src/decoder.h"
+#include "src/length_decoder.h"
+
+namespace x64asm {
+
+/** Disassembles the executable sections of a 64-bit x86 ELF file. The file
+    is mapped read-only rather than read into memory, and instructions are
+    streamed in bounded chunks, so apart from the section and symbol tables
+    memory use doesn't depend on the size of the file. Function symbols from
+    .symtab are kept so that the contents of a single function can be
+    decoded on demand. Symbols become named labels in the stream, which are
+    interned in the innermost LabelScope of the calling thread; callers
+    which stream large files should read each chunk inside a scope of their
+    own, or else every name is kept by the root scope.
+*/
+class ElfReader {
+  public:
+    /** An executable section. */
+    struct Section {
+      /** Section name. */
+      std::string name;
+      /** Virtual address of the first byte. */
+      uint64_t addr;
+      /** File offset of the first byte. */
+      uint64_t offset;
+      /** Size in bytes. */
+      uint64_t size;
+    };
+
+    /** A function symbol in an executable section. */
+    struct Symbol {
+      /** Symbol name. */
+      std::string name;
+      /** Virtual address of the first byte. */
+      uint64_t addr;
+      /** Size in bytes; symbols without a size extend to the next symbol or
+          the end of their section.
+      */
+      uint64_t size;
+      /** Index into sections(). */
+      size_t section;
+    };
+
+    ElfReader();
+    ~ElfReader();
+
+    ElfReader(const ElfReader&) = delete;
+    ElfReader& operator=(const ElfReader&) = delete;
+
+    /** Maps a file. Returns false if the file can't be read or isn't a
+        well-formed 64-bit x86 ELF file.
+    */
+    bool open(const std::string& file);
+    /** Unmaps the current file. */
+    void close();
+
+    /** Returns true if a file is mapped. */
+    bool is_open() const {
+      return base_ != nullptr;
+    }
+
+    /** Returns the executable sections in file order. */
+    const std::vector<Section>& sections() const {
+      return sections_;
+    }
+    /** Returns the function symbols, ordered by section and address. */
+    const std::vector<Symbol>& symbols() const {
+      return symbols_;
+    }
+    /** Returns the first function symbol with this name, or null. */
+    const Symbol* find_symbol(const std::string& name) const;
+
+    /** Restarts the stream at the first executable section. */
+    void rewind();
+    /** Decodes at most max instructions from the stream into chunk. Chunks
+        are contiguous: a chunk ends early at the end of a section or at
+        bytes which can't be decoded, which are skipped by the next call.
+        A label definition naming each function symbol precedes its first
+        instruction, or the first which decodes if the symbol starts with
+        skipped bytes. Label names are interned in the innermost scope of
+        the calling thread, and are released along with it. Returns false
+        once the stream is exhausted.
+    */
+    bool next(Code& chunk, size_t max = 4096);
+
+    /** Returns the address of the first byte of the last chunk. */
+    uint64_t chunk_addr() const {
+      return chunk_addr_;
+    }
+    /** Returns the number of bytes decoded into the last chunk. */
+    uint64_t chunk_size() const {
+      return chunk_size_;
+    }
+    /** Returns the section index of the last chunk. */
+    size_t chunk_section() const {
+      return chunk_sec_;
+    }
+    /** Returns the number of undecodable bytes skipped so far. */
+    uint64_t skipped() const {
+      return skipped_;
+    }
+
+    /** Decodes a function symbol into code. Returns false if some bytes
+        could not be decoded; code then holds the instructions which
+        precede them.
+    */
+    bool function(const Symbol& sym, Code& code);
+
+  private:
+    /** Start of the mapping. */
+    const uint8_t* base_;
+    /** Size of the mapping. */
+    size_t size_;
+
+    /** Executable sections. */
+    std::vector<Section> sections_;
+    /** Function symbols. */
+    std::vector<Symbol> symbols_;
+
+    /** The current stream section. */
+    size_t sec_;
+    /** Offset of the stream into the current section. */
+    uint64_t pos_;
+    /** The next symbol which the stream hasn't passed. */
+    size_t sym_;
+    /** Pages below this file offset have been released. */
+    uint64_t released_;
+
+    /** Address of the last chunk. */
+    uint64_t chunk_addr_;
+    /** Size of the last chunk. */
+    uint64_t chunk_size_;
+    /** Section of the last chunk. */
+    size_t chunk_sec_;
+    /** Undecodable bytes skipped by the stream. */
+    uint64_t skipped_;
+
+    /** Decodes instructions. */
+    Decoder decoder_;
+    /** Measures undecodable instructions so they can be skipped. */
+    LengthDecoder lengths_;
+
+    /** Reads the section and symbol tables; returns false if malformed. */
+    bool read_tables();
+    /** Returns the file contents of a section. */
+    const uint8_t* data(const Section& s) const {
+      return base_ + s.offset;
+    }
+    /** Returns the number of bytes to skip at an undecodable position, addr,
+        in the current section: the length of the instruction if it can be
+        measured, or else everything up to the next symbol or the end of the
+        section. Skips never pass the start of a symbol.
+    */
+    size_t skip(const uint8_t* begin, const uint8_t* end, uint64_t addr) const;
+    /** Allows the kernel to drop pages which the stream has passed. */
+    void release(uint64_t offset);
+};
+
+} // namespace x64asm
+
+#endif
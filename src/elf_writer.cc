@@ -0,0 +1,305 @@
+/*
+Copyright 2013 eric schkufza
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "src/elf_writer.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <unordered_map>
+
+#include <elf.h>
+
+using namespace std;
+using namespace x64asm;
+
+namespace {
+
+/** Functions are aligned within .text. */
+const uint64_t fxn_align = 16;
+
+/** Section header indices. */
+enum : uint16_t {
+  sec_null = 0,
+  sec_text,
+  sec_rela,
+  sec_symtab,
+  sec_strtab,
+  sec_shstrtab,
+  sec_note,
+  sec_count
+};
+
+/** Rounds an offset up to a multiple of a power of two. */
+uint64_t align(uint64_t offset, uint64_t a) {
+  return (offset + a - 1) & ~(a - 1);
+}
+
+/** Returns true if the rel32 at pos in bytes is the target of a call, jmp or
+    jcc; the linker may then send it through the procedure linkage table.
+*/
+bool is_branch(const vector<uint8_t>& bytes, size_t pos) {
+  if (pos >= 1 && (bytes[pos-1] == 0xe8 || bytes[pos-1] == 0xe9)) {
+    return true;
+  }
+  return pos >= 2 && bytes[pos-2] == 0x0f && (bytes[pos-1] & 0xf0) == 0x80;
+}
+
+/** A string table. */
+class StringTable {
+  public:
+    StringTable() : data_(1, '\0') { }
+
+    /** Returns the offset of a string, adding it if necessary. */
+    uint32_t add(const string& s) {
+      const auto itr = offsets_.find(s);
+      if (itr != offsets_.end()) {
+        return itr->second;
+      }
+      const auto offset = (uint32_t)data_.size();
+      data_.append(s).push_back('\0');
+      offsets_.insert(make_pair(s, offset));
+      return offset;
+    }
+    /** Returns the contents of the table. */
+    const string& data() const {
+      return data_;
+    }
+
+  private:
+    string data_;
+    map<string, uint32_t> offsets_;
+};
+
+/** Writes a table, padded to an alignment, and returns its file offset. */
+template <typename T>
+uint64_t write_table(ofstream& ofs, uint64_t& pos, const T* data, size_t n,
+                     uint64_t a) {
+  const string pad(align(pos, a) - pos, '\0');
+  ofs.write(pad.data(), pad.size());
+  pos += pad.size();
+  const auto offset = pos;
+  ofs.write((const char*)data, n * sizeof(T));
+  pos += n * sizeof(T);
+  return offset;
+}
+
+} // namespace
+
+namespace x64asm {
+
+void ElfWriter::add(const Function& fxn) {
+  Fxn f;
+  f.bytes.assign((const uint8_t*)fxn.buffer_, (const uint8_t*)fxn.head_);
+  for (size_t i = 0, ie = fxn.label_defs_.size(); i < ie; ++i) {
+    if (fxn.label_defs_[i] != Function::undef_label()) {
+      f.defs.push_back(make_pair(fxn.label_defs_[i], fxn.label_ids_[i]));
+    }
+  }
+  sort(f.defs.begin(), f.defs.end());
+  for (const auto& r : fxn.label_rels_) {
+    f.rels.push_back(make_pair(r.first, fxn.label_ids_[r.second]));
+  }
+  fxns_.push_back(move(f));
+}
+
+bool ElfWriter::write(const string& file) {
+  // Lay out the code and collect label definitions
+  vector<uint64_t> offsets;
+  uint64_t text_size = 0;
+  unordered_map<uint64_t, uint64_t> defs;
+  for (const auto& f : fxns_) {
+    text_size = align(text_size, fxn_align);
+    offsets.push_back(text_size);
+    for (const auto& d : f.defs) {
+      if (!defs.insert(make_pair(d.second, text_size + d.first)).second) {
+        return false;
+      }
+    }
+    text_size += f.bytes.size();
+  }
+
+  // Defined symbols. Locals must precede globals in the symbol table.
+  StringTable strtab;
+  vector<Elf64_Sym> locals;
+  vector<Elf64_Sym> globals;
+
+  Elf64_Sym sym;
+  memset(&sym, 0, sizeof(sym));
+  locals.push_back(sym);
+  sym.st_info = ELF64_ST_INFO(STB_LOCAL, STT_SECTION);
+  sym.st_shndx = sec_text;
+  locals.push_back(sym);
+
+  for (size_t i = 0, ie = fxns_.size(); i < ie; ++i) {
+    const auto& f = fxns_[i];
+    vector<pair<size_t, uint64_t>> named;
+    for (const auto& d : f.defs) {
+      const auto& s = LabelScope::text(d.second);
+      if (globals_.count(d.second) || (!s.empty() && s[0] != '.')) {
+        named.push_back(d);
+      }
+    }
+    // A symbol extends to the next symbol or the end of its function
+    for (size_t j = 0, je = named.size(); j < je; ++j) {
+      const auto end = j + 1 < je ? named[j+1].first : f.bytes.size();
+      const auto global = globals_.count(named[j].second) > 0;
+      memset(&sym, 0, sizeof(sym));
+      sym.st_name = strtab.add(LabelScope::text(named[j].second));
+      sym.st_info = global ? ELF64_ST_INFO(STB_GLOBAL, STT_FUNC) :
+                    ELF64_ST_INFO(STB_LOCAL, STT_NOTYPE);
+      sym.st_shndx = sec_text;
+      sym.st_value = offsets[i] + named[j].first;
+      sym.st_size = global ? end - named[j].first : 0;
+      (global ? globals : locals).push_back(sym);
+    }
+  }
+
+  // References to labels in the object are resolved now; everything else
+  // becomes a relocation against an undefined symbol
+  vector<uint8_t> text(text_size, 0xcc);
+  vector<Elf64_Rela> relas;
+  unordered_map<uint64_t, uint32_t> undefs;
+  for (size_t i = 0, ie = fxns_.size(); i < ie; ++i) {
+    const auto& f = fxns_[i];
+    const auto offset = offsets[i];
+    memcpy(text.data() + offset, f.bytes.data(), f.bytes.size());
+    for (const auto& r : f.rels) {
+      const auto pos = offset + r.first;
+      const auto itr = defs.find(r.second);
+      if (itr != defs.end()) {
+        const auto rel = (uint32_t)(itr->second - pos - 4);
+        memcpy(text.data() + pos, &rel, 4);
+        continue;
+      }
+
+      auto u = undefs.find(r.second);
+      if (u == undefs.end()) {
+        memset(&sym, 0, sizeof(sym));
+        sym.st_name = strtab.add(LabelScope::text(r.second));
+        sym.st_info = ELF64_ST_INFO(STB_GLOBAL, STT_NOTYPE);
+        sym.st_shndx = SHN_UNDEF;
+        globals.push_back(sym);
+        u = undefs.insert(make_pair(r.second,
+                                    (uint32_t)(globals.size() - 1))).first;
+      }
+      // Indices into globals are fixed up once the locals are counted
+      Elf64_Rela rela;
+      rela.r_offset = pos;
+      rela.r_info = ELF64_R_INFO(u->second, is_branch(f.bytes, r.first) ?
+                                 R_X86_64_PLT32 : R_X86_64_PC32);
+      rela.r_addend = -4;
+      memset(text.data() + pos, 0, 4);
+      relas.push_back(rela);
+    }
+  }
+
+  const auto first_global = locals.size();
+  for (auto& r : relas) {
+    r.r_info = ELF64_R_INFO(ELF64_R_SYM(r.r_info) + first_global,
+                            ELF64_R_TYPE(r.r_info));
+  }
+  vector<Elf64_Sym> symtab(locals);
+  symtab.insert(symtab.end(), globals.begin(), globals.end());
+
+  StringTable shstrtab;
+  const char* names[sec_count] = {"", ".text", ".rela.text", ".symtab",
+                                  ".strtab", ".shstrtab", ".note.GNU-stack"};
+  uint32_t name_offsets[sec_count];
+  for (size_t i = 0; i < sec_count; ++i) {
+    name_offsets[i] = shstrtab.add(names[i]);
+  }
+
+  // Sections follow the file header, and section headers come last
+  ofstream ofs(file, ios::binary | ios::trunc);
+  uint64_t pos = 0;
+
+  Elf64_Ehdr eh;
+  memset(&eh, 0, sizeof(eh));
+  write_table(ofs, pos, &eh, 1, 1);
+
+  Elf64_Shdr sh[sec_count];
+  memset(sh, 0, sizeof(sh));
+  for (size_t i = 0; i < sec_count; ++i) {
+    sh[i].sh_name = name_offsets[i];
+  }
+
+  sh[sec_text].sh_type = SHT_PROGBITS;
+  sh[sec_text].sh_flags = SHF_ALLOC | SHF_EXECINSTR;
+  sh[sec_text].sh_offset = write_table(ofs, pos, text.data(), text.size(),
+                                       fxn_align);
+  sh[sec_text].sh_size = text.size();
+  sh[sec_text].sh_addralign = fxn_align;
+
+  sh[sec_rela].sh_type = SHT_RELA;
+  sh[sec_rela].sh_flags = SHF_INFO_LINK;
+  sh[sec_rela].sh_offset = write_table(ofs, pos, relas.data(), relas.size(), 8);
+  sh[sec_rela].sh_size = relas.size() * sizeof(Elf64_Rela);
+  sh[sec_rela].sh_link = sec_symtab;
+  sh[sec_rela].sh_info = sec_text;
+  sh[sec_rela].sh_addralign = 8;
+  sh[sec_rela].sh_entsize = sizeof(Elf64_Rela);
+
+  sh[sec_symtab].sh_type = SHT_SYMTAB;
+  sh[sec_symtab].sh_offset = write_table(ofs, pos, symtab.data(),
+                                         symtab.size(), 8);
+  sh[sec_symtab].sh_size = symtab.size() * sizeof(Elf64_Sym);
+  sh[sec_symtab].sh_link = sec_strtab;
+  sh[sec_symtab].sh_info = first_global;
+  sh[sec_symtab].sh_addralign = 8;
+  sh[sec_symtab].sh_entsize = sizeof(Elf64_Sym);
+
+  sh[sec_strtab].sh_type = SHT_STRTAB;
+  sh[sec_strtab].sh_offset = write_table(ofs, pos, strtab.data().data(),
+                                         strtab.data().size(), 1);
+  sh[sec_strtab].sh_size = strtab.data().size();
+  sh[sec_strtab].sh_addralign = 1;
+
+  sh[sec_shstrtab].sh_type = SHT_STRTAB;
+  sh[sec_shstrtab].sh_offset = write_table(ofs, pos, shstrtab.data().data(),
+                                           shstrtab.data().size(), 1);
+  sh[sec_shstrtab].sh_size = shstrtab.data().size();
+  sh[sec_shstrtab].sh_addralign = 1;
+
+  // An empty note keeps the linker from making the stack executable
+  sh[sec_note].sh_type = SHT_PROGBITS;
+  sh[sec_note].sh_offset = pos;
+  sh[sec_note].sh_addralign = 1;
+
+  const auto shoff = write_table(ofs, pos, sh, sec_count, 8);
+
+  memcpy(eh.e_ident, ELFMAG, SELFMAG);
+  eh.e_ident[EI_CLASS] = ELFCLASS64;
+  eh.e_ident[EI_DATA] = ELFDATA2LSB;
+  eh.e_ident[EI_VERSION] = EV_CURRENT;
+  eh.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+  eh.e_type = ET_REL;
+  eh.e_machine = EM_X86_64;
+  eh.e_version = EV_CURRENT;
+  eh.e_shoff = shoff;
+  eh.e_ehsize = sizeof(Elf64_Ehdr);
+  eh.e_shentsize = sizeof(Elf64_Shdr);
+  eh.e_shnum = sec_count;
+  eh.e_shstrndx = sec_shstrtab;
+  ofs.seekp(0);
+  ofs.write((const char*)&eh, sizeof(eh));
+  ofs.close();
+
+  return !ofs.fail();
+}
+
+} // namespace x64asm
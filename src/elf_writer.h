@@ -0,0 +1,85 @@
+/*
+Copyright 2013 eric schkufza
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef X64ASM_SRC_ELF_WRITER_H
+#define X64ASM_SRC_ELF_WRITER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "src/function.h"
+#include "src/label.h"
+
+namespace x64asm {
+
+/** Writes assembled functions to a 64-bit x86 ELF relocatable object, so
+    that code can be assembled ahead of time and linked by the system linker.
+    Functions are placed one after another in .text. Labels which have been
+    exported become global function symbols; other named labels become local
+    symbols, except for names beginning with '.', which assemblers treat as
+    internal. References between functions in the same object are resolved
+    when the object is written. References to labels which no function
+    defines become undefined symbols with R_X86_64_PLT32 relocations for
+    branches and R_X86_64_PC32 relocations otherwise.
+*/
+class ElfWriter {
+  public:
+    /** Adds a function. */
+    void add(const Function& fxn);
+    /** Makes a label visible to other objects. Labels which no function
+        defines are ignored.
+    */
+    void global(const Label& label) {
+      globals_.insert(label);
+    }
+    /** Returns the number of functions added so far. */
+    size_t size() const {
+      return fxns_.size();
+    }
+    /** Discards every function and exported label. */
+    void clear() {
+      fxns_.clear();
+      globals_.clear();
+    }
+
+    /** Writes an object. Returns false if the file can't be written or if a
+        label is defined more than once.
+    */
+    bool write(const std::string& file);
+
+  private:
+    /** A function waiting to be written. */
+    struct Fxn {
+      std::vector<uint8_t> bytes;
+      /** Label definitions (position, label id), sorted by position. */
+      std::vector<std::pair<size_t, uint64_t>> defs;
+      /** Unresolved label references (position, label id). */
+      std::vector<std::pair<size_t, uint64_t>> rels;
+    };
+
+    /** Functions in the order they were added. */
+    std::vector<Fxn> fxns_;
+    /** Exported label ids. */
+    std::unordered_set<uint64_t> globals_;
+};
+
+} // namespace x64asm
+
+#endif
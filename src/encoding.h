@@ -0,0 +1,78 @@
+/*
+Copyright 2013 eric schkufza
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef X64ASM_SRC_ENCODING_H
+#define X64ASM_SRC_ENCODING_H
+
+#include <stdint.h>
+
+namespace x64asm {
+
+/** A compact description of how to encode an opcode. One of these rows is
+    generated for every opcode in x86.csv (see src/encoding.table). Operand
+    fields hold an operand index, or -1 if the field is absent.
+*/
+struct Encoding {
+  /** Encoding properties. */
+  enum Flag : uint16_t {
+    FWAIT   = 0x0001, // Emit a 9B prefix
+    PREF_66 = 0x0002, // Emit an operand size override prefix
+    PREF_F2 = 0x0004, // Emit an F2 prefix
+    PREF_F3 = 0x0008, // Emit an F3 prefix
+    VEX     = 0x0010, // Emit a VEX prefix rather than a REX prefix
+    VEX_L   = 0x0020, // VEX.L is set
+    VEX_W   = 0x0040, // VEX.W is set
+    MEM     = 0x0080, // The mod r/m operand is a memory operand
+    HINT    = 0x0100, // Operand 1 is a branch hint
+    REX_O   = 0x0200, // Rex prefix is derived from operand 0 only
+    II      = 0x0400, // Immediate is an Imm16 followed by an Imm8
+    IS4     = 0x0800, // Operand 3 is a register encoded as an immediate
+    LABEL   = 0x1000  // Immediate is a label reference
+  };
+
+  /** Bitwise or of Flag values. */
+  uint16_t flags;
+  /** Implied rex prefix bits. */
+  uint8_t rex;
+  /** Number of opcode bytes. */
+  uint8_t opc_len;
+  /** Opcode bytes. */
+  uint8_t opc[3];
+  /** Register operand which is added to the last opcode byte. */
+  int8_t opc_reg;
+  /** Memory operand which determines segment and address size prefixes. */
+  int8_t mem;
+  /** Mod r/m rm operand. */
+  int8_t rm;
+  /** Mod r/m reg operand. */
+  int8_t r;
+  /** Mod r/m digit; takes the place of r when present. */
+  int8_t digit;
+  /** Displacement or immediate operand. */
+  int8_t imm;
+  /** Number of displacement or immediate bytes. */
+  uint8_t imm_size;
+  /** VEX mmmmm bits. */
+  uint8_t vex_mmmmm;
+  /** VEX pp bits. */
+  uint8_t vex_pp;
+  /** VEX vvvv operand; xmm0 when absent. */
+  int8_t vvvv;
+};
+
+} // namespace x64asm
+
+#endif
@@ -0,0 +1,39 @@
+/*
+Copyright 2013 eric schkufza
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef X64ASM_SRC_ENCODING_TABLE_H
+#define X64ASM_SRC_ENCODING_TABLE_H
+
+#include "src/encoding.h"
+#include "src/opcode.h"
+
+namespace x64asm {
+
+/** Per-opcode encodings; see src/encoding.table. The table is usable in
+    constant expressions. It is large, so only include this header where it
+    is needed.
+*/
+constexpr Encoding encoding_table[X64ASM_NUM_OPCODES] {
+    // Internal mnemonics
+    {0, 0x00, 0, {0x00,0x00,0x00}, -1, -1, -1, -1, -1, -1, 0, 0x00, 0x0, -1},
+    {0, 0x00, 0, {0x00,0x00,0x00}, -1, -1, -1, -1, -1, -1, 0, 0x00, 0x0, -1}
+    // Auto-generated mnemonics
+    #include "src/encoding.table"
+};
+
+} // namespace x64asm
+
+#endif
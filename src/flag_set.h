@@ -25,6 +25,11 @@ limitations under the License.
 namespace x64asm {
 
 class FlagSet {
+		// Needs access to underlying bit mask.
+		friend class ImageWriter;
+		// Needs access to underlying bit mask.
+		friend class ImageLoader;
+
 	private:
 		/** Creates a flag set from a bit mask. */
 		constexpr FlagSet(uint64_t mask) : mask_(mask) { }
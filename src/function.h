@@ -27,7 +27,9 @@ limitations under the License.
 #include <stddef.h>
 #include <stdint.h>
 #include <string>
-#include <unordered_map>
+#include <vector>
+
+#include "src/code_arena.h"
 
 #ifdef __APPLE__
 #define MAP_ANONYMOUS MAP_ANON
@@ -37,49 +39,65 @@ namespace x64asm {
 
 /** An executable hex buffer. Supports zero to six argument calling
     conventions. In general, a function can be called with arguments of any
-    type which are or can be implicitly converted to native types.
+    type which are or can be implicitly converted to native types. A function
+    either maps its own buffer or borrows one from a CodeArena, in which case
+    code is written through one view of the buffer and run through another.
 */
 class Function {
     // Needs access to internal buffer.
     friend class Assembler;
     // Needs access to label data.
     friend class Linker;
+    // Needs access to internal buffer and label data.
+    friend class ElfLoader;
+    // Needs access to internal buffer and label data.
+    friend class ElfWriter;
+    // Needs access to internal buffer and label data.
+    friend class ImageWriter;
 
   public:
     /** Returns a new function; internal buffer may be larger than specified. */
-    Function(size_t capacity = 1024) {
-      capacity_ = round_up(capacity);
-      buffer_ = (unsigned char*) mmap(0, capacity_,
-          PROT_READ | PROT_WRITE | PROT_EXEC,
-          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    Function(size_t capacity = 1024) : arena_(nullptr) {
+      map(capacity);
       head_ = buffer_;
     }
-    /** Copy constructor. */
-    Function(const Function& rhs) : buffer_((unsigned char*)-1) {
-      if (good())
-        munmap(buffer_, capacity_);
-
-      capacity_ = rhs.capacity_;
-      buffer_ = (unsigned char*) mmap(0, capacity_,
-          PROT_READ | PROT_WRITE | PROT_EXEC,
-          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    /** Returns a new function whose buffer is allocated from an arena; the
+        arena must outlive the function.
+    */
+    Function(CodeArena& arena, size_t capacity = 1024) : arena_(&arena) {
+      map(capacity);
+      head_ = buffer_;
+    }
+    /** Copy constructor; the copy shares the arena of rhs. */
+    Function(const Function& rhs) : arena_(rhs.arena_) {
+      map(rhs.capacity_);
       if (good() && rhs.good())
         memcpy(buffer_, rhs.buffer_, rhs.size());
-      head_ = buffer_ + rhs.size();
+      head_ = good() ? buffer_ + rhs.size() : buffer_;
 
+      label_ids_ = rhs.label_ids_;
       label_defs_ = rhs.label_defs_;
       label_rels_ = rhs.label_rels_;
+      label_refs_ = rhs.label_refs_;
+      instr_offs_ = rhs.instr_offs_;
     }
     /** Move constructor. */
     Function(Function&& rhs) {
       capacity_ = rhs.capacity_;
       buffer_ = rhs.buffer_;
+      exec_ = rhs.exec_;
       head_ = rhs.head_;
+      arena_ = rhs.arena_;
 
+      label_ids_ = std::move(rhs.label_ids_);
       label_defs_ = std::move(rhs.label_defs_);
       label_rels_ = std::move(rhs.label_rels_);
+      label_refs_ = std::move(rhs.label_refs_);
+      instr_offs_ = std::move(rhs.instr_offs_);
 
       rhs.buffer_ = (unsigned char*)-1;
+      rhs.capacity_ = 0;
+      rhs.head_ = rhs.buffer_;
     }
 
     /** Copy assignment operator. */
@@ -95,15 +113,12 @@ class Function {
 
     /** Destructor. */
     ~Function() {
-      if (good()) {
-        munmap(buffer_, capacity_);
-        buffer_ = (unsigned char*)-1;
-      }
+      unmap();
     }
 
-    /** Returns a pointer to the internal buffer */
+    /** Returns a pointer to the internal buffer, as seen by executing code. */
     void* data() const {
-      return buffer_;
+      return exec_;
     }
     /** Returns the address of the entrypoint of this function. */
     void* get_entrypoint() const {
@@ -113,40 +128,40 @@ class Function {
     /** Zero argument usage form. */
     template <typename Y>
     Y call() const {
-      return ((Y(*)()) buffer_)();
+      return ((Y(*)()) exec_)();
     }
     /** One argument usage form. */
     template <typename Y, typename X1>
     Y call(X1 x1) const {
-      return ((Y(*)(X1)) buffer_)(x1);
+      return ((Y(*)(X1)) exec_)(x1);
     }
     /** Two argument usage form. */
     template <typename Y, typename X1, typename X2>
     Y call(X1 x1, X2 x2) const {
-      return ((Y(*)(X1, X2)) buffer_)(x1, x2);
+      return ((Y(*)(X1, X2)) exec_)(x1, x2);
     }
     /** Three argument usage form. */
     template <typename Y, typename X1, typename X2, typename X3>
     Y call(X1 x1, X2 x2, X3 x3) const {
-      return ((Y(*)(X1, X2, X3)) buffer_)(x1, x2, x3);
+      return ((Y(*)(X1, X2, X3)) exec_)(x1, x2, x3);
     }
     /** Four argument usage form. */
     template <typename Y, typename X1, typename X2, typename X3,
               typename X4>
     Y call(X1 x1, X2 x2, X3 x3, X4 x4) const {
-      return ((Y(*)(X1, X2, X3, X4)) buffer_)(x1, x2, x3, x4);
+      return ((Y(*)(X1, X2, X3, X4)) exec_)(x1, x2, x3, x4);
     }
     /** Five argument usage form. */
     template <typename Y, typename X1, typename X2, typename X3,
               typename X4, typename X5>
     Y call(X1 x1, X2 x2, X3 x3, X4 x4, X5 x5) const {
-      return ((Y(*)(X1, X2, X3, X4, X5)) buffer_)(x1, x2, x3, x4, x5);
+      return ((Y(*)(X1, X2, X3, X4, X5)) exec_)(x1, x2, x3, x4, x5);
     }
     /** Six argument usage form. */
     template <typename Y, typename X1, typename X2, typename X3,
               typename X4, typename X5, typename X6>
     Y call(X1 x1, X2 x2, X3 x3, X4 x4, X5 x5, X6 x6) const {
-      return ((Y(*)(X1, X2, X3, X4, X5, X6)) buffer_)(x1, x2, x3, x4, x5, x6);
+      return ((Y(*)(X1, X2, X3, X4, X5, X6)) exec_)(x1, x2, x3, x4, x5, x6);
     }
 
     /** Returns the number of bytes written to the internal buffer. */
@@ -158,25 +173,32 @@ class Function {
       return capacity_;
     }
 
-    /** Extends the size of the internal buffer; reallocates if necessary. */
-    void reserve(size_t capacity) {
+    /** Extends the size of the internal buffer; reallocates if necessary.
+        Label data is stored as offsets and is unaffected, but pointers into
+        the old buffer are invalidated. Returns false if no larger buffer
+        could be allocated, in which case the old one is left as it was.
+    */
+    bool reserve(size_t capacity) {
       if (capacity <= capacity_) {
-        return;
-      }
-
-      Function rhs(capacity);
-      if ( good() && rhs.good() ) {
-        memcpy(rhs.buffer_, buffer_, capacity_);
-        rhs.head_ = rhs.buffer_ + size();
+        return good();
+      } else if (!good()) {
+        map(capacity);
+        head_ = buffer_;
+        return good();
+      } else {
+        return remap(capacity);
       }
-
-      rhs.swap(*this);
     }
-    /** Resets the write pointer to the beginning of the internal pointer. */
+    /** Resets the write pointer to the beginning of the internal pointer.
+        Label tables keep their storage.
+    */
     void clear() {
       head_ = buffer_;
+      label_ids_.clear();
       label_defs_.clear();
       label_rels_.clear();
+      label_refs_.clear();
+      instr_offs_.clear();
     }
 
     /** Emits a byte at and increments the write pointer. */
@@ -224,6 +246,13 @@ class Function {
       *((uint64_t*)(buffer_ + index)) = q;
     }
 
+    /** Emits a sequence of bytes and increments the write pointer. */
+    void emit_bytes(const void* bytes, size_t n) {
+      assert(remaining() >= n);
+      memcpy(head_, bytes, n);
+      head_ += n;
+    }
+
     /** Increments the write pointer by one byte. */
     void advance_byte() {
       assert(remaining() >= 1);
@@ -278,16 +307,42 @@ class Function {
     void swap(Function& rhs) {
       std::swap(capacity_, rhs.capacity_);
       std::swap(buffer_, rhs.buffer_);
+      std::swap(exec_, rhs.exec_);
       std::swap(head_, rhs.head_);
+      std::swap(arena_, rhs.arena_);
+      label_ids_.swap(rhs.label_ids_);
+      label_defs_.swap(rhs.label_defs_);
+      label_rels_.swap(rhs.label_rels_);
+      label_refs_.swap(rhs.label_refs_);
+      instr_offs_.swap(rhs.instr_offs_);
     }
     /** STL compliant hash. */
     size_t hash() const {
       return good() ? std::hash<std::string>()(std::string((const char*)buffer_, size())) : 0;
     }
 
-    /** @todo This method is undefined. */
+    /** Reads whitespace separated hex bytes, as written by write_hex(), until
+        the end of the stream. Sets the failbit on malformed input, and the
+        badbit if the buffer can't grow.
+    */
     std::istream& read_hex(std::istream& is) {
-      is.setstate(std::ios::failbit);
+      clear();
+      const auto fmt = is.flags();
+      for (unsigned int b = 0; is >> std::hex >> b;) {
+        if (b > 0xff) {
+          is.setstate(std::ios::failbit);
+          break;
+        }
+        if (remaining() == 0 && !reserve(2 * capacity())) {
+          is.setstate(std::ios::badbit);
+          break;
+        }
+        emit_byte(b);
+      }
+      if (is.eof() && !is.bad()) {
+        is.clear(std::ios::eofbit);
+      }
+      is.flags(fmt);
       return is;
     }
     /** Writes this function to an ostream in human-readable hex. */
@@ -318,19 +373,114 @@ class Function {
     size_t capacity_;
     /** The internal buffer. */
     unsigned char* buffer_;
+    /** The internal buffer as seen by executing code; the same as buffer_
+        unless the buffer belongs to a dual mapped arena.
+    */
+    unsigned char* exec_;
     /** The current write position in the internal buffer. */
     unsigned char* head_;
-
-    /** Maps label definitions to code position. */
-    std::unordered_map<uint64_t, size_t> label_defs_;
-    /** Keeps track of unresolved label references. */
-    std::vector<std::pair<size_t, uint64_t>> label_rels_;
+    /** The arena which owns the internal buffer, or null. */
+    CodeArena* arena_;
+
+    /** Labels are numbered densely in order of first use; maps these local
+        numbers back to global label ids.
+    */
+    std::vector<uint64_t> label_ids_;
+    /** Maps local label numbers to code position, or undef_label(). */
+    std::vector<size_t> label_defs_;
+    /** Keeps track of unresolved label references (position, local label). */
+    std::vector<std::pair<size_t, size_t>> label_rels_;
+    /** Keeps track of all label references (incremental assembly only). */
+    std::vector<std::pair<size_t, size_t>> label_refs_;
+    /** Start position of each instruction, followed by the end of the last
+        instruction (incremental assembly only).
+    */
+    std::vector<size_t> instr_offs_;
+
+    /** The position of a label which isn't defined in this function. */
+    static constexpr size_t undef_label() {
+      return (size_t)-1;
+    }
 
     /** Returns the number of bytes remaining in the internal buffer. */
     size_t remaining() const {
       return capacity() - size();
     }
 
+    /** Allocates an internal buffer of at least capacity bytes. */
+    void map(size_t capacity) {
+      if (arena_ != nullptr) {
+        const auto buf = arena_->allocate(capacity);
+        capacity_ = buf.size;
+        buffer_ = buf.rw != nullptr ? buf.rw : (unsigned char*)-1;
+        exec_ = buf.rw != nullptr ? buf.rx : (unsigned char*)-1;
+      } else {
+        capacity_ = round_up(capacity);
+        buffer_ = (unsigned char*) mmap(0, capacity_,
+            PROT_READ | PROT_WRITE | PROT_EXEC,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        exec_ = buffer_;
+        if (!good()) {
+          capacity_ = 0;
+        }
+      }
+    }
+    /** Moves the contents of the internal buffer into a larger one. Mappings
+        of our own are extended by mremap() where it is available, which may
+        move them without copying. Returns false, leaving the old buffer
+        mapped and unchanged, if no larger one could be allocated.
+    */
+    bool remap(size_t capacity) {
+      const auto n = size();
+      if (arena_ != nullptr) {
+        const auto buf = arena_->allocate(capacity);
+        if (buf.rw == nullptr) {
+          return false;
+        }
+        memcpy(buf.rw, buffer_, n);
+        unmap();
+        capacity_ = buf.size;
+        buffer_ = buf.rw;
+        exec_ = buf.rx;
+      } else {
+        capacity = round_up(capacity);
+#ifdef MREMAP_MAYMOVE
+        const auto p = mremap(buffer_, capacity_, capacity, MREMAP_MAYMOVE);
+        if (p == MAP_FAILED) {
+          return false;
+        }
+#else
+        const auto p = mmap(0, capacity, PROT_READ | PROT_WRITE | PROT_EXEC,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+          return false;
+        }
+        memcpy(p, buffer_, n);
+        munmap(buffer_, capacity_);
+#endif
+        buffer_ = (unsigned char*)p;
+        capacity_ = capacity;
+        exec_ = buffer_;
+      }
+      head_ = buffer_ + n;
+      return true;
+    }
+    /** Returns the internal buffer to wherever it came from. A function
+        without a buffer has no room, so nothing can be written to it.
+    */
+    void unmap() {
+      if (!good()) {
+        return;
+      } else if (arena_ != nullptr) {
+        arena_->release({buffer_, exec_, capacity_});
+      } else {
+        munmap(buffer_, capacity_);
+      }
+      buffer_ = (unsigned char*)-1;
+      capacity_ = 0;
+      head_ = buffer_;
+    }
+
     /** Rounds an integer up to the nearest multiple of 1024. */
     size_t round_up(size_t size) const {
       if (size == 0) {
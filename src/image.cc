@@ -0,0 +1,424 @@
+/*
+Copyright 2013 eric schkufza
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "src/image.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <map>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace x64asm;
+
+namespace {
+
+/** Identifies an image file. */
+const char magic[8] = {'X', '6', '4', 'A', 'S', 'M', 'I', 'M'};
+/** Incremented whenever the layout below changes. */
+const uint32_t version = 1;
+/** Code is page aligned in the file so that it can be mapped directly. */
+const uint64_t text_align = 4096;
+/** Functions are aligned within the code. */
+const uint64_t fxn_align = 16;
+
+/** The first bytes of an image. Offsets are relative to the start of the
+    file, and every table is 8-byte aligned.
+*/
+struct Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t pad;
+  /** Functions, sorted by key. */
+  uint64_t entries;
+  uint64_t entry_count;
+  /** Relocations, grouped by function. */
+  uint64_t relocs;
+  uint64_t reloc_count;
+  /** Label definitions, sorted by name. */
+  uint64_t symbols;
+  uint64_t symbol_count;
+  /** Null-terminated label names. */
+  uint64_t strings;
+  uint64_t strings_size;
+  /** Code. */
+  uint64_t text;
+  uint64_t text_size;
+};
+
+/** A function. */
+struct Entry {
+  uint64_t key_lo;
+  uint64_t key_hi;
+  /** Required cpu flags. */
+  uint64_t flags;
+  /** Offset of the first byte in the code. */
+  uint64_t offset;
+  uint64_t size;
+};
+
+/** A rel32 reference to a label which isn't defined in the image. */
+struct Reloc {
+  /** Offset of the displacement in the code. */
+  uint64_t pos;
+  /** Offset of the label name in the string table. */
+  uint32_t name;
+  uint32_t pad;
+};
+
+/** A label definition. */
+struct Symbol {
+  /** Offset of the definition in the code. */
+  uint64_t pos;
+  /** Offset of the label name in the string table. */
+  uint32_t name;
+  uint32_t pad;
+};
+
+/** Rounds an offset up to a multiple of a power of two. */
+uint64_t align(uint64_t offset, uint64_t a) {
+  return (offset + a - 1) & ~(a - 1);
+}
+
+/** Returns true if a table of n elements of size s at offset lies within a
+    file of length len.
+*/
+bool in_bounds(uint64_t offset, uint64_t n, uint64_t s, uint64_t len) {
+  return offset <= len && n <= (len - offset) / s;
+}
+
+/** Returns true if key a is ordered before key b. */
+bool before(uint64_t a_lo, uint64_t a_hi, uint64_t b_lo, uint64_t b_hi) {
+  return a_lo != b_lo ? a_lo < b_lo : a_hi < b_hi;
+}
+
+} // namespace
+
+namespace x64asm {
+
+void ImageWriter::add(const Code& code, const Assembler& assm,
+                      const Function& fxn) {
+  Fxn f;
+  f.key = CodeCache::key(code, assm);
+  f.flags = code.required_flags();
+  f.bytes.assign((const uint8_t*)fxn.buffer_, (const uint8_t*)fxn.head_);
+  for (size_t i = 0, ie = fxn.label_defs_.size(); i < ie; ++i) {
+    if (fxn.label_defs_[i] != Function::undef_label()) {
+      f.defs.push_back(make_pair(fxn.label_defs_[i], fxn.label_ids_[i]));
+    }
+  }
+  for (const auto& r : fxn.label_rels_) {
+    f.rels.push_back(make_pair(r.first, fxn.label_ids_[r.second]));
+  }
+  fxns_.push_back(move(f));
+}
+
+bool ImageWriter::write(const string& file) {
+  // Later duplicates of a key are dropped
+  stable_sort(fxns_.begin(), fxns_.end(), [](const Fxn& a, const Fxn& b) {
+    return before(a.key.lo, a.key.hi, b.key.lo, b.key.hi);
+  });
+  fxns_.erase(unique(fxns_.begin(), fxns_.end(), [](const Fxn& a, const Fxn& b) {
+    return a.key == b.key;
+  }), fxns_.end());
+
+  // Lay out the code and collect label definitions
+  vector<uint64_t> offsets;
+  uint64_t text_size = 0;
+  unordered_map<uint64_t, uint64_t> defs;
+  for (const auto& f : fxns_) {
+    text_size = align(text_size, fxn_align);
+    offsets.push_back(text_size);
+    for (const auto& d : f.defs) {
+      if (!defs.insert(make_pair(d.second, text_size + d.first)).second) {
+        return false;
+      }
+    }
+    text_size += f.bytes.size();
+  }
+
+  // Label names are stored once each
+  string strings;
+  map<string, uint32_t> names;
+  const auto name = [&strings, &names](uint64_t id) {
+    const auto& s = LabelScope::text(id);
+    const auto itr = names.find(s);
+    if (itr != names.end()) {
+      return itr->second;
+    }
+    const auto offset = (uint32_t)strings.size();
+    strings.append(s).push_back('\0');
+    names.insert(make_pair(s, offset));
+    return offset;
+  };
+
+  // References to labels in the image are resolved now; code moves as a
+  // whole, so their displacements don't depend on where it is mapped
+  vector<uint8_t> text(text_size, 0xcc);
+  vector<Entry> entries;
+  vector<Reloc> relocs;
+  for (size_t i = 0, ie = fxns_.size(); i < ie; ++i) {
+    const auto& f = fxns_[i];
+    const auto offset = offsets[i];
+    memcpy(text.data() + offset, f.bytes.data(), f.bytes.size());
+    for (const auto& r : f.rels) {
+      const auto pos = offset + r.first;
+      const auto itr = defs.find(r.second);
+      if (itr == defs.end()) {
+        relocs.push_back(Reloc {pos, name(r.second), 0});
+      } else {
+        const auto rel = (uint32_t)(itr->second - pos - 4);
+        memcpy(text.data() + pos, &rel, 4);
+      }
+    }
+    entries.push_back(Entry {f.key.lo, f.key.hi, f.flags.mask_, offset,
+                             f.bytes.size()});
+  }
+
+  vector<Symbol> symbols;
+  for (const auto& d : defs) {
+    symbols.push_back(Symbol {d.second, name(d.first), 0});
+  }
+  sort(symbols.begin(), symbols.end(), [&strings](const Symbol& a,
+                                                  const Symbol& b) {
+    return strcmp(strings.c_str() + a.name, strings.c_str() + b.name) < 0;
+  });
+
+  Header h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, magic, sizeof(magic));
+  h.version = version;
+  h.entries = sizeof(Header);
+  h.entry_count = entries.size();
+  h.relocs = h.entries + entries.size() * sizeof(Entry);
+  h.reloc_count = relocs.size();
+  h.symbols = h.relocs + relocs.size() * sizeof(Reloc);
+  h.symbol_count = symbols.size();
+  h.strings = h.symbols + symbols.size() * sizeof(Symbol);
+  h.strings_size = strings.size();
+  h.text = align(h.strings + strings.size(), text_align);
+  h.text_size = text.size();
+
+  ofstream ofs(file, ios::binary | ios::trunc);
+  ofs.write((const char*)&h, sizeof(h));
+  ofs.write((const char*)entries.data(), entries.size() * sizeof(Entry));
+  ofs.write((const char*)relocs.data(), relocs.size() * sizeof(Reloc));
+  ofs.write((const char*)symbols.data(), symbols.size() * sizeof(Symbol));
+  ofs.write(strings.data(), strings.size());
+  const string pad(h.text - h.strings - strings.size(), '\0');
+  ofs.write(pad.data(), pad.size());
+  ofs.write((const char*)text.data(), text.size());
+  ofs.close();
+
+  return !ofs.fail();
+}
+
+ImageLoader::ImageLoader() : base_(nullptr), size_(0), text_(nullptr),
+  text_size_(0), linked_(false) { }
+
+ImageLoader::~ImageLoader() {
+  close();
+}
+
+bool ImageLoader::open(const string& file) {
+  close();
+
+  const auto fd = ::open(file.c_str(), O_RDONLY);
+  if (fd == -1) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(Header)) {
+    ::close(fd);
+    return false;
+  }
+  const auto addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (addr == MAP_FAILED) {
+    ::close(fd);
+    return false;
+  }
+  base_ = (const uint8_t*)addr;
+  size_ = st.st_size;
+  if (!check()) {
+    ::close(fd);
+    close();
+    return false;
+  }
+
+  // Code is mapped separately so that its pages can be made executable.
+  // Pages are only copied if a relocation patches them.
+  const auto& h = *(const Header*)base_;
+  text_size_ = h.text_size;
+  linked_ = h.reloc_count == 0;
+  if (text_size_ > 0) {
+    const auto prot = linked_ ? PROT_READ | PROT_EXEC : PROT_READ | PROT_WRITE;
+    const auto text = mmap(nullptr, text_size_, prot, MAP_PRIVATE, fd, h.text);
+    if (text == MAP_FAILED) {
+      ::close(fd);
+      close();
+      return false;
+    }
+    text_ = (uint8_t*)text;
+  }
+  ::close(fd);
+  return true;
+}
+
+void ImageLoader::close() {
+  if (text_ != nullptr) {
+    munmap(text_, text_size_);
+  }
+  if (base_ != nullptr) {
+    munmap((void*)base_, size_);
+  }
+  base_ = nullptr;
+  size_ = 0;
+  text_ = nullptr;
+  text_size_ = 0;
+  linked_ = false;
+  externs_.clear();
+}
+
+size_t ImageLoader::size() const {
+  return is_open() ? ((const Header*)base_)->entry_count : 0;
+}
+
+size_t ImageLoader::relocations() const {
+  return is_open() ? ((const Header*)base_)->reloc_count : 0;
+}
+
+void ImageLoader::define(const Label& label, const void* addr) {
+  externs_[label.get_text()] = (uint64_t)addr;
+}
+
+bool ImageLoader::link() {
+  if (!is_open()) {
+    return false;
+  } else if (linked_) {
+    return true;
+  }
+
+  const auto& h = *(const Header*)base_;
+  const auto relocs = (const Reloc*)(base_ + h.relocs);
+  for (size_t i = 0; i < h.reloc_count; ++i) {
+    const auto itr = externs_.find(str(relocs[i].name));
+    if (itr == externs_.end()) {
+      return false;
+    }
+    const auto here = (uint64_t)text_ + relocs[i].pos;
+    const auto rel = (int64_t)(itr->second - here - 4);
+    if (rel < INT32_MIN || rel > INT32_MAX) {
+      return false;
+    }
+    const auto rel32 = (int32_t)rel;
+    memcpy(text_ + relocs[i].pos, &rel32, 4);
+  }
+
+  if (mprotect(text_, text_size_, PROT_READ | PROT_EXEC) != 0) {
+    return false;
+  }
+  linked_ = true;
+  return true;
+}
+
+void* ImageLoader::find(const CodeCache::Key& key, FlagSet cpu) const {
+  if (!is_open()) {
+    return nullptr;
+  }
+  const auto& h = *(const Header*)base_;
+  const auto begin = (const Entry*)(base_ + h.entries);
+  const auto end = begin + h.entry_count;
+  const auto itr = lower_bound(begin, end, key, [](const Entry& e,
+                                                   const CodeCache::Key& k) {
+    return before(e.key_lo, e.key_hi, k.lo, k.hi);
+  });
+  if (itr == end || itr->key_lo != key.lo || itr->key_hi != key.hi ||
+      !cpu.contains(FlagSet(itr->flags))) {
+    return nullptr;
+  }
+  return text_ + itr->offset;
+}
+
+void* ImageLoader::address(const Label& label) const {
+  if (!is_open()) {
+    return nullptr;
+  }
+  const auto& h = *(const Header*)base_;
+  const auto begin = (const Symbol*)(base_ + h.symbols);
+  const auto end = begin + h.symbol_count;
+  const auto& name = label.get_text();
+  const auto itr = lower_bound(begin, end, name, [this](const Symbol& s,
+                                                        const string& n) {
+    return strcmp(str(s.name), n.c_str()) < 0;
+  });
+  if (itr == end || name != str(itr->name)) {
+    return nullptr;
+  }
+  return text_ + itr->pos;
+}
+
+bool ImageLoader::check() const {
+  const auto& h = *(const Header*)base_;
+  if (memcmp(h.magic, magic, sizeof(magic)) != 0 || h.version != version) {
+    return false;
+  }
+  if (!in_bounds(h.entries, h.entry_count, sizeof(Entry), size_) ||
+      !in_bounds(h.relocs, h.reloc_count, sizeof(Reloc), size_) ||
+      !in_bounds(h.symbols, h.symbol_count, sizeof(Symbol), size_) ||
+      !in_bounds(h.strings, h.strings_size, 1, size_) ||
+      !in_bounds(h.text, h.text_size, 1, size_) ||
+      h.entries % 8 != 0 || h.relocs % 8 != 0 || h.symbols % 8 != 0 ||
+      h.text % text_align != 0) {
+    return false;
+  }
+  // The string table must end in a null so that names can't run past it
+  if (h.strings_size > 0 && base_[h.strings + h.strings_size - 1] != '\0') {
+    return false;
+  }
+
+  const auto entries = (const Entry*)(base_ + h.entries);
+  for (size_t i = 0; i < h.entry_count; ++i) {
+    if (!in_bounds(entries[i].offset, entries[i].size, 1, h.text_size)) {
+      return false;
+    }
+  }
+  const auto relocs = (const Reloc*)(base_ + h.relocs);
+  for (size_t i = 0; i < h.reloc_count; ++i) {
+    if (!in_bounds(relocs[i].pos, 4, 1, h.text_size) ||
+        relocs[i].name >= h.strings_size) {
+      return false;
+    }
+  }
+  const auto symbols = (const Symbol*)(base_ + h.symbols);
+  for (size_t i = 0; i < h.symbol_count; ++i) {
+    if (symbols[i].pos > h.text_size || symbols[i].name >= h.strings_size) {
+      return false;
+    }
+  }
+  return true;
+}
+
+const char* ImageLoader::str(uint32_t offset) const {
+  const auto& h = *(const Header*)base_;
+  return (const char*)base_ + h.strings + offset;
+}
+
+} // namespace x64asm
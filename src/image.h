@@ -0,0 +1,161 @@
+/*
+Copyright 2013 eric schkufza
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef X64ASM_SRC_IMAGE_H
+#define X64ASM_SRC_IMAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "src/assembler.h"
+#include "src/code.h"
+#include "src/code_cache.h"
+#include "src/flag_set.h"
+#include "src/function.h"
+#include "src/label.h"
+
+namespace x64asm {
+
+/** Writes assembled functions to an image file which ImageLoader can map
+    back in, so that a process can skip assembling codes which an earlier
+    process has already assembled. Functions are keyed on the content hash
+    used by CodeCache, and record the cpu flags which their code requires.
+    References between functions in the same image are resolved when the
+    image is written; only references to labels defined elsewhere are left
+    as relocations. Labels are stored by name, so anonymous labels can't be
+    resolved across images.
+*/
+class ImageWriter {
+  public:
+    /** Adds a function which assm assembled from code. Codes which have
+        already been added are ignored.
+    */
+    void add(const Code& code, const Assembler& assm, const Function& fxn);
+    /** Returns the number of functions added so far. */
+    size_t size() const {
+      return fxns_.size();
+    }
+    /** Discards every function. */
+    void clear() {
+      fxns_.clear();
+    }
+
+    /** Writes an image. Returns false if the file can't be written or if a
+        label is defined more than once.
+    */
+    bool write(const std::string& file);
+
+  private:
+    /** A function waiting to be written. */
+    struct Fxn {
+      CodeCache::Key key;
+      FlagSet flags;
+      std::vector<uint8_t> bytes;
+      /** Label definitions (position, label id). */
+      std::vector<std::pair<size_t, uint64_t>> defs;
+      /** Unresolved label references (position, label id). */
+      std::vector<std::pair<size_t, uint64_t>> rels;
+    };
+
+    /** Functions in the order they were added. */
+    std::vector<Fxn> fxns_;
+};
+
+/** Maps an image written by ImageWriter. The code in an image is mapped
+    straight from the file; loading only reads the tables which describe it
+    and patches relocations, so pages of code which are never called are
+    never read. Once linked, code is executable and no longer writable.
+*/
+class ImageLoader {
+  public:
+    ImageLoader();
+    ~ImageLoader();
+
+    ImageLoader(const ImageLoader&) = delete;
+    ImageLoader& operator=(const ImageLoader&) = delete;
+
+    /** Maps an image. Returns false if the file can't be read or isn't a
+        well-formed image. An image without relocations is linked at once.
+    */
+    bool open(const std::string& file);
+    /** Unmaps the current image; its functions must no longer be used. */
+    void close();
+
+    /** Returns true if an image is mapped. */
+    bool is_open() const {
+      return base_ != nullptr;
+    }
+    /** Returns the number of functions in the image. */
+    size_t size() const;
+    /** Returns the number of relocations in the image. */
+    size_t relocations() const;
+
+    /** Provides the address of a label which the image references but
+        doesn't define. Must be called before link().
+    */
+    void define(const Label& label, const void* addr);
+    /** Patches every relocation and makes the image executable. Returns
+        false if a label is undefined or out of rel32 range.
+    */
+    bool link();
+    /** Returns true if the image has been linked. */
+    bool linked() const {
+      return linked_;
+    }
+
+    /** Returns the entrypoint of the function with this key, or null if
+        there is none or if it requires cpu flags which aren't in cpu. The
+        loader can't tell which flags the running cpu has, so callers must
+        say; FlagSet::universe() turns the check off.
+    */
+    void* find(const CodeCache::Key& key, FlagSet cpu) const;
+    /** Returns the entrypoint of the function which assm would assemble from
+        code, or null if there is none or if cpu lacks the flags it requires.
+    */
+    void* find(const Code& code, const Assembler& assm, FlagSet cpu) const {
+      return find(CodeCache::key(code, assm), cpu);
+    }
+    /** Returns the address of a label defined in the image, or null. */
+    void* address(const Label& label) const;
+
+  private:
+    /** Start of the mapped file. */
+    const uint8_t* base_;
+    /** Size of the mapped file. */
+    size_t size_;
+    /** Start of the mapped code. */
+    uint8_t* text_;
+    /** Size of the mapped code. */
+    size_t text_size_;
+    /** Have relocations been patched? */
+    bool linked_;
+
+    /** Addresses of labels which are defined elsewhere. */
+    std::unordered_map<std::string, uint64_t> externs_;
+
+    /** Checks that the tables lie within the file; returns false if not. */
+    bool check() const;
+    /** Returns a string from the string table. */
+    const char* str(uint32_t offset) const;
+};
+
+} // namespace x64asm
+
+#endif
@@ -32,6 +32,7 @@ namespace {
 array<const char*, X64ASM_NUM_OPCODES> att_ {{
     // Internal mnemonics
     "<label definition>"
+    , ".p2align"
     // Auto-generated mnemonics
     #include "src/opcode.att"
 }};
@@ -563,6 +564,11 @@ RegSet& Instruction::explicit_maybe_undef_set(RegSet& ret) const {
 }
 
 bool Instruction::check() const {
+  // Alignments are limited to 2^15 bytes
+  if (get_opcode() == P2ALIGN && (uint64_t)get_operand<Imm8>(0) >= 16) {
+    return false;
+  }
+
   for (size_t i = 0, ie = arity(); i < ie; ++i)
     switch (type(i)) {
       case Type::HINT:
@@ -800,6 +806,15 @@ ostream& Instruction::write_att(ostream& os) const {
     os << ":";
     return os;
   }
+  if (get_opcode() == P2ALIGN) {
+    const auto fmt = os.flags();
+    os << att_[P2ALIGN] << " " << dec << (uint64_t)get_operand<Imm8>(0);
+    if ((uint64_t)get_operand<Imm8>(1) != 0) {
+      os << ",," << (uint64_t)get_operand<Imm8>(1);
+    }
+    os.flags(fmt);
+    return os;
+  }
 
   os << att_[get_opcode()] << " ";
   if (arity() > 0)
@@ -988,6 +1003,7 @@ size_t Instruction::hash() const {
 const array<size_t, X64ASM_NUM_OPCODES> Instruction::arity_ {{
   // Internal mnemonics
   1
+  , 2
   // Auto-generated mnemonics
   #include "src/arity.table"
 }};
@@ -995,6 +1011,7 @@ const array<size_t, X64ASM_NUM_OPCODES> Instruction::arity_ {{
 const array<array<Instruction::Properties, 4>, X64ASM_NUM_OPCODES> Instruction::properties_ {{
   // Internal mnemonics
   {Properties::none() + Property::MUST_READ, Properties::none(), Properties::none(), Properties::none()}
+  , {Properties::none() + Property::MUST_READ, Properties::none() + Property::MUST_READ, Properties::none(), Properties::none()}
   // Auto-generated mnemonics
   #include "src/properties.table"
 }};
@@ -1002,6 +1019,7 @@ const array<array<Instruction::Properties, 4>, X64ASM_NUM_OPCODES> Instruction::
 const array<array<Type, 4>, X64ASM_NUM_OPCODES> Instruction::type_ {{
   // Internal mnemonics
   {{Type::LABEL}}
+  , {{Type::IMM_8, Type::IMM_8}}
   // Auto-generated mnemonics
   #include "src/type.table"
 }};
@@ -1009,6 +1027,7 @@ const array<array<Type, 4>, X64ASM_NUM_OPCODES> Instruction::type_ {{
 const array<int, X64ASM_NUM_OPCODES> Instruction::mem_index_ {{
   // Internal mnemonics
   -1
+  , -1
   // Auto-generated mnemonics
   #include "src/mem_index.table"
 }};
@@ -1016,6 +1035,7 @@ const array<int, X64ASM_NUM_OPCODES> Instruction::mem_index_ {{
 const array<RegSet, X64ASM_NUM_OPCODES> Instruction::implicit_must_read_set_ {{
   // Internal mnemonics
   RegSet::empty()
+  , RegSet::empty()
   // Auto-generated mnemonics
   #include "src/must_read.table"
 }};
@@ -1023,6 +1043,7 @@ const array<RegSet, X64ASM_NUM_OPCODES> Instruction::implicit_must_read_set_ {{
 const array<RegSet, X64ASM_NUM_OPCODES> Instruction::implicit_maybe_read_set_ {{
   // Internal mnemonics
   RegSet::empty()
+  , RegSet::empty()
   // Auto-generated mnemonics
   #include "src/maybe_read.table"
 }};
@@ -1030,6 +1051,7 @@ const array<RegSet, X64ASM_NUM_OPCODES> Instruction::implicit_maybe_read_set_ {{
 const array<RegSet, X64ASM_NUM_OPCODES> Instruction::implicit_must_write_set_ {{
   // Internal mnemonics
   RegSet::empty()
+  , RegSet::empty()
   // Auto-generated mnemonics
   #include "src/must_write.table"
 }};
@@ -1037,6 +1059,7 @@ const array<RegSet, X64ASM_NUM_OPCODES> Instruction::implicit_must_write_set_ {{
 const array<RegSet, X64ASM_NUM_OPCODES> Instruction::implicit_maybe_write_set_ {{
   // Internal mnemonics
   RegSet::empty()
+  , RegSet::empty()
   // Auto-generated mnemonics
   #include "src/maybe_write.table"
 }};
@@ -1044,6 +1067,7 @@ const array<RegSet, X64ASM_NUM_OPCODES> Instruction::implicit_maybe_write_set_ {
 const array<RegSet, X64ASM_NUM_OPCODES> Instruction::implicit_must_undef_set_ {{
   // Internal mnemonics
   RegSet::empty()
+  , RegSet::empty()
   // Auto-generated mnemonics
   #include "src/must_undef.table"
 }};
@@ -1051,6 +1075,7 @@ const array<RegSet, X64ASM_NUM_OPCODES> Instruction::implicit_must_undef_set_ {{
 const array<RegSet, X64ASM_NUM_OPCODES> Instruction::implicit_maybe_undef_set_ {{
   // Internal mnemonics
   RegSet::empty()
+  , RegSet::empty()
   // Auto-generated mnemonics
   #include "src/maybe_undef.table"
 }};
@@ -1058,6 +1083,7 @@ const array<RegSet, X64ASM_NUM_OPCODES> Instruction::implicit_maybe_undef_set_ {
 const array<FlagSet, X64ASM_NUM_OPCODES> Instruction::flags_ {{
   // Internal mnemonics
   FlagSet::empty()
+  , FlagSet::empty()
   // Auto-generatred mnemonics
   #include "src/flag.table"
 }};
@@ -251,6 +251,10 @@ class Instruction {
     bool is_label_defn() const {
 		  return opcode_ == LABEL_DEFN;
 		}
+    /** Returns true if this instruction is an alignment directive. */
+    bool is_p2align() const {
+		  return opcode_ == P2ALIGN;
+		}
 		/** Is this a variant of the lea instruction? */
 		bool is_lea() const {
 			return opcode_ >= LEA_R16_M16 && opcode_ <= LEA_R64_M64;
@@ -16,12 +16,79 @@ limitations under the License.
 
 #include "src/label.h"
 
+#include <cctype>
+#include <cstdlib>
+
 using namespace std;
 
+namespace {
+
+/** Prefix of the names given to anonymous labels. */
+const char anon_prefix[] = ".__x64asm_L";
+/** Length of the prefix. */
+const size_t anon_len = sizeof(anon_prefix) - 1;
+
+/** The innermost scope of each thread, or null for the root scope. */
+thread_local x64asm::LabelScope* innermost = nullptr;
+
+} // namespace
+
 namespace x64asm {
 
-map<string, uint64_t> Label::label2val_;
-map<uint64_t, string> Label::val2label_;
-uint64_t Label::next_val_ = 0;
+atomic<uint64_t> LabelScope::next_id_(0);
+
+LabelScope::LabelScope() : parent_(&current()) {
+  innermost = this;
+}
+
+LabelScope::~LabelScope() {
+  assert(innermost == this);
+  innermost = parent_;
+}
+
+uint64_t LabelScope::intern(const string& s) {
+  // Printed forms of anonymous labels round trip
+  if (s.length() > anon_len && s.compare(0, anon_len, anon_prefix) == 0 &&
+      isdigit((unsigned char)s[anon_len])) {
+    char* end = nullptr;
+    const auto id = strtoull(s.c_str() + anon_len, &end, 10);
+    if (*end == '\0' && valid(id)) {
+      return id;
+    }
+  }
+
+  auto& scope = current();
+  lock_guard<mutex> lock(scope.mutex_);
+  const auto itr = scope.ids_.find(s);
+  if (itr != scope.ids_.end()) {
+    return itr->second;
+  }
+  const auto id = fresh();
+  scope.ids_.insert(itr, {s, id});
+  scope.names_[id] = s;
+  return id;
+}
+
+const string& LabelScope::text(uint64_t id) {
+  auto& scope = current();
+  for (auto s = &scope; s != nullptr; s = s->parent_) {
+    lock_guard<mutex> lock(s->mutex_);
+    const auto itr = s->names_.find(id);
+    if (itr != s->names_.end()) {
+      return itr->second;
+    }
+  }
+
+  lock_guard<mutex> lock(scope.mutex_);
+  auto& name = scope.names_[id];
+  name = string(anon_prefix) + to_string(id);
+  return name;
+}
+
+LabelScope& LabelScope::current() {
+  // Never destroyed, so that labels remain usable during static destruction
+  static LabelScope* root = new LabelScope(Root());
+  return innermost == nullptr ? *root : *innermost;
+}
 
 } // namespace x64asm
@@ -17,88 +17,140 @@ limitations under the License.
 #ifndef X64ASM_SRC_LABEL_H
 #define X64ASM_SRC_LABEL_H
 
+#include <atomic>
 #include <cassert>
 #include <iostream>
-#include <map>
+#include <mutex>
 #include <string>
+#include <unordered_map>
 
 #include "src/operand.h"
 
 namespace x64asm {
 
+/** A label namespace. Creating a scope makes it the innermost scope of the
+    calling thread until it is destroyed; scopes must be destroyed on the
+    thread that created them, in reverse order. Named labels are interned in
+    the innermost scope, so the same name denotes different labels in
+    different scopes. Label ids are drawn from a single atomic counter and
+    anonymous labels are named only when printed, so creating one takes no
+    locks and allocates nothing. Destroying a scope releases every name it
+    holds. Threads which never create a scope share a process-wide root scope.
+*/
+class LabelScope {
+  public:
+    /** Enters a new scope on the calling thread. */
+    LabelScope();
+    /** Leaves this scope and releases its names. */
+    ~LabelScope();
+
+    LabelScope(const LabelScope&) = delete;
+    LabelScope& operator=(const LabelScope&) = delete;
+
+    /** Returns an unused label id. */
+    static uint64_t fresh() {
+      return next_id_.fetch_add(1, std::memory_order_relaxed);
+    }
+    /** Returns the id of a named label in the innermost scope of the calling
+        thread, creating it if necessary. Names which are printed forms of
+        anonymous labels map back to those labels.
+    */
+    static uint64_t intern(const std::string& s);
+    /** Returns the text of a label. Looks through the scopes of the calling
+        thread from the innermost outward; labels without a name are named
+        after their id in the innermost scope.
+    */
+    static const std::string& text(uint64_t id);
+    /** Returns true if id was returned by fresh() or intern(). */
+    static bool valid(uint64_t id) {
+      return id < next_id_.load(std::memory_order_relaxed);
+    }
+
+    /** Returns the number of names held by this scope. */
+    size_t size() const {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return names_.size();
+    }
+
+  private:
+    /** The next unused label id. */
+    static std::atomic<uint64_t> next_id_;
+
+    /** The enclosing scope, or null for the root scope. */
+    LabelScope* parent_;
+    /** Guards the tables below; only the root scope is ever contended. */
+    mutable std::mutex mutex_;
+    /** Maps names to label ids. */
+    std::unordered_map<std::string, uint64_t> ids_;
+    /** Maps label ids to names. */
+    std::unordered_map<uint64_t, std::string> names_;
+
+    /** Tag for the root scope constructor. */
+    struct Root {};
+    /** Creates the root scope. */
+    LabelScope(Root) : parent_(nullptr) { }
+
+    /** Returns the innermost scope of the calling thread. */
+    static LabelScope& current();
+};
+
 /** A symbolic representation of a Rel32. No Rel8 eqivalent is provided. */
 class Label : public Operand {
   public:
     /** Creates a new, globally unique label. */
     Label() : Operand(Type::LABEL) {
-        val_ = next_val_++;
-      std::string s(".__x64asm_L" + std::to_string(val_));
-      label2val_[s] = val_;
-      val2label_[val_] = s;
-        }
-    /** Creates a named label. Repeated calls will produce identical results. */
+      val_ = LabelScope::fresh();
+    }
+    /** Creates a named label. Repeated calls within a scope will produce
+        identical results.
+    */
     Label(const std::string& s) : Operand(Type::LABEL) {
-            auto itr = label2val_.find(s);
-            if (itr == label2val_.end()) {
-                val_ = next_val_++;
-                label2val_[s] = val_;
-                val2label_[val_] = s;
-            } else {
-                val_ = itr->second;
-            }
-        }
+      val_ = LabelScope::intern(s);
+    }
 
     /** Returns true if this label is well-formed. */
     bool check() const {
-            return val2label_.find(val_) != val2label_.end();
-        }
+      return LabelScope::valid(val_);
+    }
 
-        /** Returns the text value of this label. */
-        const std::string& get_text() const {
-            assert(check());
-            return val2label_[val_];
-        }
+    /** Returns the text value of this label. */
+    const std::string& get_text() const {
+      assert(check());
+      return LabelScope::text(val_);
+    }
 
     /** Comparison based on label id. */
     bool operator<(const Label& rhs) const {
-            return val_ < rhs.val_;
-        }
+      return val_ < rhs.val_;
+    }
     /** Comparison based on label id. */
     bool operator==(const Label& rhs) const {
-            return val_ == rhs.val_;
-        }
+      return val_ == rhs.val_;
+    }
     /** Comparison based on label id. */
     bool operator!=(const Label& rhs) const {
-            return !(*this == rhs);
-        }
+      return !(*this == rhs);
+    }
 
     /** Conversion based on label value. */
     operator uint64_t() const {
-            return val_;
-        }
+      return val_;
+    }
 
     /** STL-compliant hash. */
     size_t hash() const {
-            return val_;
-        }
-        /** @todo This method is undefined. */
-        std::istream& read_att(std::istream& is) {
-            is.setstate(std::ios::failbit);
-            return is;
-        }
+      return val_;
+    }
+    /** @todo This method is undefined. */
+    std::istream& read_att(std::istream& is) {
+      is.setstate(std::ios::failbit);
+      return is;
+    }
     /** Writes this label to an ostream using at&t syntax. */
     std::ostream& write_att(std::ostream& os) const {
-            assert(check());
-            return (os << val2label_[val_]);
-        }
-
-  private:
-    /** Global map from label text to values. */
-    static std::map<std::string, uint64_t> label2val_;
-        /** Global map from values back to label text. */
-        static std::map<uint64_t, std::string> val2label_;
-    /** The next previously unused label value. */
-    static uint64_t next_val_;
+      assert(check());
+      return (os << LabelScope::text(val_));
+    }
 };
 
 } // namespace x64asm
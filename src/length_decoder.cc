@@ -0,0 +1,521 @@
+/*
+Copyright 2013 eric schkufza
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "src/length_decoder.h"
+
+#include <immintrin.h>
+
+#include "src/encoding_table.h"
+
+using namespace std;
+using namespace x64asm;
+
+namespace {
+
+/** Properties of an opcode byte within an opcode map. */
+struct Op {
+  /** True if some opcode uses this byte. */
+  bool valid;
+  /** True if this byte is followed by a mod r/m byte. */
+  bool modrm;
+  /** One plus the number of immediate bytes, indexed by mod r/m digit and by
+      operand size (none, 66 prefix, rex.w); zero if undefined.
+  */
+  uint8_t imm[8][3];
+};
+
+/** Opcode properties for the one-byte, 0f, 0f38, and 0f3a maps. */
+struct Tables {
+  /** Legacy and rex encoded opcodes. */
+  Op legacy[4][256];
+  /** Vex encoded opcodes; indexed by vex.mmmmm. */
+  Op vex[4][256];
+  /** Summary of the one-byte map used by the vector engines: bit 7 is set
+      for a mod r/m byte, bit 6 if the length of an instruction which starts
+      with this byte and has at most a rex prefix is determined by this
+      table, and bits 0-3 hold the number of immediate bytes.
+  */
+  alignas(32) uint8_t info[256];
+};
+
+/** Returns true for legacy prefix bytes. */
+bool is_prefix(uint8_t b) {
+  switch (b) {
+    case 0x26:
+    case 0x2e:
+    case 0x36:
+    case 0x3e:
+    case 0x64:
+    case 0x65:
+    case 0x66:
+    case 0x67:
+    case 0xf2:
+    case 0xf3:
+      return true;
+    default:
+      return false;
+  }
+}
+
+/** Returns true for rex prefix bytes. */
+bool is_rex(uint8_t b) {
+  return (b & 0xf0) == 0x40;
+}
+
+/** Number of positions whose lengths the vector engines compute at once. */
+constexpr size_t chunk = 256;
+
+/** Records an immediate size for an opcode byte. The first row to describe
+    an opcode byte wins.
+*/
+void record(Op& op, bool modrm, int digit, size_t size, uint8_t imm) {
+  op.valid = true;
+  op.modrm |= modrm;
+  for (int d = 0; d < 8; ++d) {
+    if ((digit == -1 || d == digit) && op.imm[d][size] == 0) {
+      op.imm[d][size] = imm + 1;
+    }
+  }
+}
+
+/** Fills operand sizes which no row describes with the default size. */
+void fill(Op& op) {
+  for (auto& imm : op.imm) {
+    if (imm[0] == 0) {
+      imm[0] = imm[1] ? imm[1] : imm[2];
+    }
+    for (size_t s = 1; s < 3; ++s) {
+      if (imm[s] == 0) {
+        imm[s] = imm[0];
+      }
+    }
+  }
+}
+
+/** Builds opcode properties from the encoding table. */
+Tables* make_tables() {
+  auto t = new Tables();
+
+  for (size_t i = 0; i < X64ASM_NUM_OPCODES; ++i) {
+    const auto& e = encoding_table[i];
+    if (e.opc_len == 0) {
+      continue;
+    }
+    const uint8_t imm = (e.flags & Encoding::II) ? 3 :
+                        e.imm_size + ((e.flags & Encoding::IS4) ? 1 : 0);
+    const size_t size = (e.rex & 0x08) ? 2 : (e.flags & Encoding::PREF_66) ? 1 : 0;
+
+    if (e.flags & Encoding::VEX) {
+      record(t->vex[e.vex_mmmmm & 0x3][e.opc[0]], e.rm != -1, e.digit, 0, imm);
+      continue;
+    }
+
+    // Strip prefixes, then locate the opcode map. Bytes which follow the
+    // opcode take the place of a mod r/m byte (eg: d9 e8, 0f 01 d0).
+    auto b = e.opc;
+    auto n = e.opc_len;
+    while (n > 1 && (is_prefix(*b) || *b == 0x9b)) {
+      ++b;
+      --n;
+    }
+    size_t map = 0;
+    if (n > 1 && b[0] == 0x0f) {
+      map = n > 2 && b[1] == 0x38 ? 2 : n > 2 && b[1] == 0x3a ? 3 : 1;
+      b += map == 1 ? 1 : 2;
+      n -= map == 1 ? 1 : 2;
+    }
+    const auto modrm = e.rm != -1 || e.digit != -1 || n > 1;
+    const auto digit = e.digit != -1 ? e.digit : n > 1 ? (b[1] >> 3) & 0x7 : -1;
+    const auto regs = e.opc_reg != -1 && n == 1 ? 8 : 1;
+    for (auto r = 0; r < regs; ++r) {
+      record(t->legacy[map][b[0] + r], modrm, digit, size, imm);
+    }
+  }
+
+  for (auto& map : t->legacy) {
+    for (auto& op : map) {
+      fill(op);
+    }
+  }
+  for (auto& map : t->vex) {
+    for (auto& op : map) {
+      fill(op);
+    }
+  }
+
+  // 0f 18-1f is reserved for hint nops, which take a mod r/m byte and no
+  // immediate whatever their digit; compilers emit some which the encoding
+  // table lacks (eg: endbr64, f3 0f 1e fa)
+  for (size_t i = 0x18; i <= 0x1f; ++i) {
+    auto& op = t->legacy[1][i];
+    op.valid = true;
+    op.modrm = true;
+    for (auto& d : op.imm) {
+      for (auto& imm : d) {
+        imm = imm == 0 ? 1 : imm;
+      }
+    }
+  }
+
+  // Bytes whose length doesn't depend on prefixes, the mod r/m digit, or
+  // rex.w (other than mov r64, imm64) are handled by the vector engines
+  for (size_t i = 0; i < 256; ++i) {
+    const auto& op = t->legacy[0][i];
+    if (!op.valid || is_prefix(i) || is_rex(i) || i == 0x0f || i == 0x9b ||
+        i == 0xc4 || i == 0xc5) {
+      continue;
+    }
+    const auto imm = op.imm[0][0];
+    const auto imm_w = (i & 0xf8) == 0xb8 ? imm + 4 : imm;
+    auto simple = imm != 0;
+    for (const auto& d : op.imm) {
+      simple &= d[0] == imm && d[2] == imm_w;
+    }
+    if (simple) {
+      t->info[i] = 0x40 | (op.modrm ? 0x80 : 0x00) | (imm - 1);
+    }
+  }
+
+  return t;
+}
+
+/** Returns opcode properties; built on first use. */
+const Tables& tables() {
+  static const Tables* t = make_tables();
+  return *t;
+}
+
+/** Computes, for each of 16 positions starting at p, the length of an
+    instruction which starts there, or zero if it isn't covered by the
+    one-byte map summary. Reads p[0] through p[17].
+*/
+__attribute__((target("ssse3")))
+__m128i lengths_ssse3(const uint8_t* p, const uint8_t* info) {
+  const auto op = _mm_loadu_si128((const __m128i*)p);
+  const auto m = _mm_loadu_si128((const __m128i*)(p + 1));
+  const auto s = _mm_loadu_si128((const __m128i*)(p + 2));
+  const auto zero = _mm_setzero_si128();
+
+  // 256-entry lookup; one 16-entry shuffle per high nibble
+  const auto lo = _mm_and_si128(op, _mm_set1_epi8(0x0f));
+  const auto hi = _mm_and_si128(_mm_srli_epi16(op, 4), _mm_set1_epi8(0x0f));
+  auto e = zero;
+  for (auto h = 0; h < 16; ++h) {
+    const auto row = _mm_load_si128((const __m128i*)(info + 16 * h));
+    const auto sel = _mm_cmpeq_epi8(hi, _mm_set1_epi8(h));
+    e = _mm_or_si128(e, _mm_and_si128(_mm_shuffle_epi8(row, lo), sel));
+  }
+
+  // Mod r/m, sib, and displacement bytes
+  const auto mod = _mm_and_si128(m, _mm_set1_epi8((char)0xc0));
+  const auto rm = _mm_and_si128(m, _mm_set1_epi8(0x07));
+  const auto mod0 = _mm_cmpeq_epi8(mod, zero);
+  const auto mod1 = _mm_cmpeq_epi8(mod, _mm_set1_epi8(0x40));
+  const auto mod2 = _mm_cmpeq_epi8(mod, _mm_set1_epi8((char)0x80));
+  const auto mod3 = _mm_cmpeq_epi8(mod, _mm_set1_epi8((char)0xc0));
+  const auto sib = _mm_andnot_si128(mod3, _mm_cmpeq_epi8(rm, _mm_set1_epi8(0x04)));
+  const auto rip = _mm_and_si128(mod0, _mm_cmpeq_epi8(rm, _mm_set1_epi8(0x05)));
+  const auto sib_base = _mm_cmpeq_epi8(_mm_and_si128(s, _mm_set1_epi8(0x07)), _mm_set1_epi8(0x05));
+  const auto no_base = _mm_and_si128(_mm_and_si128(mod0, sib), sib_base);
+  const auto disp32 = _mm_or_si128(_mm_or_si128(mod2, rip), no_base);
+  const auto disp = _mm_or_si128(_mm_and_si128(mod1, _mm_set1_epi8(1)),
+                                 _mm_and_si128(disp32, _mm_set1_epi8(4)));
+  const auto modrm = _mm_add_epi8(_mm_set1_epi8(1),
+                                  _mm_add_epi8(_mm_and_si128(sib, _mm_set1_epi8(1)), disp));
+
+  const auto has_modrm = _mm_cmplt_epi8(e, zero);
+  const auto simple = _mm_cmpeq_epi8(_mm_and_si128(e, _mm_set1_epi8(0x40)), _mm_set1_epi8(0x40));
+  const auto len = _mm_add_epi8(_mm_set1_epi8(1),
+                                _mm_add_epi8(_mm_and_si128(has_modrm, modrm),
+                                             _mm_and_si128(e, _mm_set1_epi8(0x0f))));
+  return _mm_and_si128(len, simple);
+}
+
+/** Computes instruction lengths for the chunk positions starting at p,
+    allowing for a rex prefix. Lengths for the positions which follow a rex
+    prefix are reused rather than computed a second time. Reads p[0] through
+    p[chunk + 17].
+*/
+__attribute__((target("ssse3")))
+void chunk_ssse3(const uint8_t* p, const uint8_t* info, uint8_t* lens) {
+  alignas(16) uint8_t ls[chunk + 32];
+  for (size_t i = 0; i <= chunk; i += 16) {
+    _mm_store_si128((__m128i*)(ls + i), lengths_ssse3(p + i, info));
+  }
+
+  for (size_t i = 0; i < chunk; i += 16) {
+    const auto l0 = _mm_load_si128((const __m128i*)(ls + i));
+    const auto l1 = _mm_loadu_si128((const __m128i*)(ls + i + 1));
+    const auto b0 = _mm_loadu_si128((const __m128i*)(p + i));
+    const auto b1 = _mm_loadu_si128((const __m128i*)(p + i + 1));
+
+    const auto rex = _mm_cmpeq_epi8(_mm_and_si128(b0, _mm_set1_epi8((char)0xf0)), _mm_set1_epi8(0x40));
+    const auto w = _mm_cmpeq_epi8(_mm_and_si128(b0, _mm_set1_epi8(0x08)), _mm_set1_epi8(0x08));
+    const auto mov = _mm_cmpeq_epi8(_mm_and_si128(b1, _mm_set1_epi8((char)0xf8)), _mm_set1_epi8((char)0xb8));
+    const auto imm64 = _mm_and_si128(_mm_and_si128(w, mov), _mm_set1_epi8(4));
+    const auto lr = _mm_andnot_si128(_mm_cmpeq_epi8(l1, _mm_setzero_si128()),
+                                     _mm_add_epi8(l1, _mm_add_epi8(imm64, _mm_set1_epi8(1))));
+
+    const auto len = _mm_or_si128(_mm_and_si128(rex, lr), _mm_andnot_si128(rex, l0));
+    _mm_storeu_si128((__m128i*)(lens + i), len);
+  }
+}
+
+/** The avx2 equivalent of lengths_ssse3() for 32 positions. Reads p[0]
+    through p[33].
+*/
+__attribute__((target("avx2")))
+__m256i lengths_avx2(const uint8_t* p, const uint8_t* info) {
+  const auto op = _mm256_loadu_si256((const __m256i*)p);
+  const auto m = _mm256_loadu_si256((const __m256i*)(p + 1));
+  const auto s = _mm256_loadu_si256((const __m256i*)(p + 2));
+  const auto zero = _mm256_setzero_si256();
+
+  // Shuffles stay within 128-bit lanes, so each row is broadcast to both
+  const auto lo = _mm256_and_si256(op, _mm256_set1_epi8(0x0f));
+  const auto hi = _mm256_and_si256(_mm256_srli_epi16(op, 4), _mm256_set1_epi8(0x0f));
+  auto e = zero;
+  for (auto h = 0; h < 16; ++h) {
+    const auto row = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*)(info + 16 * h)));
+    const auto sel = _mm256_cmpeq_epi8(hi, _mm256_set1_epi8(h));
+    e = _mm256_or_si256(e, _mm256_and_si256(_mm256_shuffle_epi8(row, lo), sel));
+  }
+
+  const auto mod = _mm256_and_si256(m, _mm256_set1_epi8((char)0xc0));
+  const auto rm = _mm256_and_si256(m, _mm256_set1_epi8(0x07));
+  const auto mod0 = _mm256_cmpeq_epi8(mod, zero);
+  const auto mod1 = _mm256_cmpeq_epi8(mod, _mm256_set1_epi8(0x40));
+  const auto mod2 = _mm256_cmpeq_epi8(mod, _mm256_set1_epi8((char)0x80));
+  const auto mod3 = _mm256_cmpeq_epi8(mod, _mm256_set1_epi8((char)0xc0));
+  const auto sib = _mm256_andnot_si256(mod3, _mm256_cmpeq_epi8(rm, _mm256_set1_epi8(0x04)));
+  const auto rip = _mm256_and_si256(mod0, _mm256_cmpeq_epi8(rm, _mm256_set1_epi8(0x05)));
+  const auto sib_base = _mm256_cmpeq_epi8(_mm256_and_si256(s, _mm256_set1_epi8(0x07)), _mm256_set1_epi8(0x05));
+  const auto no_base = _mm256_and_si256(_mm256_and_si256(mod0, sib), sib_base);
+  const auto disp32 = _mm256_or_si256(_mm256_or_si256(mod2, rip), no_base);
+  const auto disp = _mm256_or_si256(_mm256_and_si256(mod1, _mm256_set1_epi8(1)),
+                                    _mm256_and_si256(disp32, _mm256_set1_epi8(4)));
+  const auto modrm = _mm256_add_epi8(_mm256_set1_epi8(1),
+                                     _mm256_add_epi8(_mm256_and_si256(sib, _mm256_set1_epi8(1)), disp));
+
+  const auto has_modrm = _mm256_cmpgt_epi8(zero, e);
+  const auto simple = _mm256_cmpeq_epi8(_mm256_and_si256(e, _mm256_set1_epi8(0x40)), _mm256_set1_epi8(0x40));
+  const auto len = _mm256_add_epi8(_mm256_set1_epi8(1),
+                                   _mm256_add_epi8(_mm256_and_si256(has_modrm, modrm),
+                                                   _mm256_and_si256(e, _mm256_set1_epi8(0x0f))));
+  return _mm256_and_si256(len, simple);
+}
+
+/** The avx2 equivalent of chunk_ssse3(). Reads p[0] through p[chunk + 33]. */
+__attribute__((target("avx2")))
+void chunk_avx2(const uint8_t* p, const uint8_t* info, uint8_t* lens) {
+  alignas(32) uint8_t ls[chunk + 64];
+  for (size_t i = 0; i <= chunk; i += 32) {
+    _mm256_store_si256((__m256i*)(ls + i), lengths_avx2(p + i, info));
+  }
+
+  for (size_t i = 0; i < chunk; i += 32) {
+    const auto l0 = _mm256_load_si256((const __m256i*)(ls + i));
+    const auto l1 = _mm256_loadu_si256((const __m256i*)(ls + i + 1));
+    const auto b0 = _mm256_loadu_si256((const __m256i*)(p + i));
+    const auto b1 = _mm256_loadu_si256((const __m256i*)(p + i + 1));
+
+    const auto rex = _mm256_cmpeq_epi8(_mm256_and_si256(b0, _mm256_set1_epi8((char)0xf0)), _mm256_set1_epi8(0x40));
+    const auto w = _mm256_cmpeq_epi8(_mm256_and_si256(b0, _mm256_set1_epi8(0x08)), _mm256_set1_epi8(0x08));
+    const auto mov = _mm256_cmpeq_epi8(_mm256_and_si256(b1, _mm256_set1_epi8((char)0xf8)), _mm256_set1_epi8((char)0xb8));
+    const auto imm64 = _mm256_and_si256(_mm256_and_si256(w, mov), _mm256_set1_epi8(4));
+    const auto lr = _mm256_andnot_si256(_mm256_cmpeq_epi8(l1, _mm256_setzero_si256()),
+                                        _mm256_add_epi8(l1, _mm256_add_epi8(imm64, _mm256_set1_epi8(1))));
+
+    const auto len = _mm256_or_si256(_mm256_and_si256(rex, lr), _mm256_andnot_si256(rex, l0));
+    _mm256_storeu_si256((__m256i*)(lens + i), len);
+  }
+}
+
+} // namespace
+
+namespace x64asm {
+
+LengthDecoder::LengthDecoder() {
+  set_engine(Engine::AVX2);
+}
+
+void LengthDecoder::set_engine(Engine e) {
+  __builtin_cpu_init();
+  if (e == Engine::AVX2 && !__builtin_cpu_supports("avx2")) {
+    e = Engine::SSSE3;
+  }
+  if (e == Engine::SSSE3 && !__builtin_cpu_supports("ssse3")) {
+    e = Engine::SCALAR;
+  }
+  engine_ = e;
+}
+
+size_t LengthDecoder::length(const uint8_t* begin, const uint8_t* end) const {
+  const auto& t = tables();
+  const auto avail = (size_t)(end - begin);
+  size_t i = 0;
+
+  // An fwait is part of a following x87 instruction
+  if (avail > 0 && begin[0] == 0x9b) {
+    size_t j = 1;
+    while (j < avail && (is_prefix(begin[j]) || is_rex(begin[j]))) {
+      ++j;
+    }
+    if (j < avail && begin[j] >= 0xd8 && begin[j] <= 0xdf) {
+      i = 1;
+    }
+  }
+
+  // Legacy prefixes
+  auto p66 = false;
+  auto p67 = false;
+  for (; i < avail && is_prefix(begin[i]); ++i) {
+    p66 |= begin[i] == 0x66;
+    p67 |= begin[i] == 0x67;
+  }
+
+  // Rex prefix
+  auto w = false;
+  if (i < avail && is_rex(begin[i])) {
+    w = begin[i++] & 0x08;
+  }
+  if (i >= avail) {
+    return 0;
+  }
+
+  // Vex prefix or legacy opcode maps
+  const Op* op = nullptr;
+  auto moffs = false;
+  if (begin[i] == 0xc4 || begin[i] == 0xc5) {
+    const size_t n = begin[i] == 0xc5 ? 2 : 3;
+    if (i + n >= avail) {
+      return 0;
+    }
+    const auto map = n == 2 ? 1 : begin[i + 1] & 0x1f;
+    if (map < 1 || map > 3) {
+      return 0;
+    }
+    i += n;
+    op = &t.vex[map][begin[i++]];
+    w = false;
+    p66 = false;
+  } else {
+    size_t map = 0;
+    if (begin[i] == 0x0f) {
+      map = 1;
+      if (++i < avail && (begin[i] == 0x38 || begin[i] == 0x3a)) {
+        map = begin[i++] == 0x38 ? 2 : 3;
+      }
+      if (i >= avail) {
+        return 0;
+      }
+    }
+    moffs = map == 0 && (begin[i] & 0xfc) == 0xa0;
+    op = &t.legacy[map][begin[i++]];
+  }
+  if (!op->valid) {
+    return 0;
+  }
+
+  // Mod R/M, SIB, and displacement bytes
+  size_t digit = 0;
+  if (op->modrm) {
+    if (i >= avail) {
+      return 0;
+    }
+    const auto m = begin[i++];
+    const auto mod = m >> 6;
+    const auto rm = m & 0x7;
+    digit = (m >> 3) & 0x7;
+
+    if (mod != 0x3 && rm == 0x4) {
+      if (i >= avail) {
+        return 0;
+      }
+      if (mod == 0x0 && (begin[i] & 0x7) == 0x5) {
+        i += 4;
+      }
+      ++i;
+    }
+    if (mod == 0x1) {
+      i += 1;
+    } else if (mod == 0x2 || (mod == 0x0 && rm == 0x5)) {
+      i += 4;
+    }
+  }
+
+  // Immediate bytes; moffs shrink with an address size override
+  const auto imm = op->imm[digit][w ? 2 : p66 ? 1 : 0];
+  if (imm == 0) {
+    return 0;
+  }
+  i += moffs && p67 ? 4 : imm - 1;
+
+  return i <= avail ? i : 0;
+}
+
+bool LengthDecoder::scan(const uint8_t* begin, const uint8_t* end,
+                         vector<uint32_t>& offs) const {
+  if (engine_ != Engine::SCALAR) {
+    return scan_vector(begin, end, offs);
+  }
+  for (auto p = begin; p < end;) {
+    const auto n = length(p, end);
+    if (n == 0) {
+      return false;
+    }
+    offs.push_back(p - begin);
+    p += n;
+  }
+  return true;
+}
+
+bool LengthDecoder::scan_vector(const uint8_t* begin, const uint8_t* end,
+                                vector<uint32_t>& offs) const {
+  const auto avx2 = engine_ == Engine::AVX2;
+  const size_t lookahead = chunk + (avx2 ? 34 : 18);
+  const auto info = tables().info;
+
+  // Lengths for positions [base, base + chunk); computed on demand
+  uint8_t lens[chunk];
+  size_t base = 0;
+  auto valid = false;
+
+  for (size_t i = 0, ie = end - begin; i < ie;) {
+    if ((!valid || i >= base + chunk) && ie - i >= lookahead) {
+      if (avx2) {
+        chunk_avx2(begin + i, info, lens);
+      } else {
+        chunk_ssse3(begin + i, info, lens);
+      }
+      base = i;
+      valid = true;
+    }
+
+    size_t n = valid && i < base + chunk ? lens[i - base] : 0;
+    if (n == 0 || n > ie - i) {
+      n = length(begin + i, end);
+    }
+    if (n == 0) {
+      return false;
+    }
+    offs.push_back(i);
+    i += n;
+  }
+  return true;
+}
+
+} // namespace x64asm
@@ -0,0 +1,86 @@
+/*
+Copyright 2013 eric schkufza
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef X64ASM_SRC_LENGTH_DECODER_H
+#define X64ASM_SRC_LENGTH_DECODER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+namespace x64asm {
+
+/** Finds instruction boundaries without decoding operands. Opcode properties
+    (mod r/m presence and immediate sizes by operand size) are derived from
+    the generated encoding table. Boundaries follow the Assembler's notion of
+    an instruction: lock is a one-byte instruction of its own, and an fwait
+    which precedes an x87 instruction is part of that instruction.
+*/
+class LengthDecoder {
+  public:
+    /** Strategies for scanning a buffer. SCALAR decodes one instruction at a
+        time. SSSE3 and AVX2 first compute, for 16 or 32 positions at once,
+        the length of an instruction starting at that position, assuming it
+        has at most a rex prefix and a one-byte opcode. Opcode properties are
+        looked up using byte shuffles. The scan then follows these lengths
+        and falls back on the scalar decoder everywhere else. Every engine
+        produces identical results.
+    */
+    enum class Engine {
+      SCALAR = 0,
+      SSSE3,
+      AVX2
+    };
+
+    /** Creates a length decoder which uses the fastest engine supported by
+        this cpu.
+    */
+    LengthDecoder();
+
+    /** Sets the strategy used by scan(); falls back on SCALAR if the cpu
+        doesn't support e.
+    */
+    void set_engine(Engine e);
+
+    /** Returns the strategy used by scan(). */
+    Engine get_engine() const {
+      return engine_;
+    }
+
+    /** Returns the length of the instruction at the start of [begin, end), or
+        zero if it is truncated or unrecognized.
+    */
+    size_t length(const uint8_t* begin, const uint8_t* end) const;
+
+    /** Appends the offset of every instruction in [begin, end) to offs.
+        Returns false if scanning stopped at an instruction which is
+        truncated or unrecognized.
+    */
+    bool scan(const uint8_t* begin, const uint8_t* end,
+              std::vector<uint32_t>& offs) const;
+
+  private:
+    /** The current scanning strategy. */
+    Engine engine_;
+
+    /** Scans using the current vector engine. */
+    bool scan_vector(const uint8_t* begin, const uint8_t* end,
+                     std::vector<uint32_t>& offs) const;
+};
+
+} // namespace x64asm
+
+#endif
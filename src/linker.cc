@@ -1,5 +1,5 @@
 /*
-Copyright 2014 eric schkufza
+Copyright 2013 eric schkufza
 
 Licensed under the Apache License, Version 2.0 (the "License");
 you may not use this file except in compliance with the License.
@@ -16,48 +16,379 @@ limitations under the License.
 
 #include "src/linker.h"
 
+#include <cstring>
+
+#include "src/parallel.h"
+
 using namespace std;
 
+namespace {
+
+// Saves the registers which may hold arguments, calls Linker::bind_stub()
+// with the linker and the return address pushed by the stub, and returns to
+// the address it returns in place of that one. The stack is aligned here,
+// since hand-written code doesn't always keep it aligned.
+const uint8_t thunk[] = {
+	0x55,                               // push rbp
+	0x48, 0x89, 0xe5,                   // mov rbp, rsp
+	0x57,                               // push rdi
+	0x56,                               // push rsi
+	0x52,                               // push rdx
+	0x51,                               // push rcx
+	0x41, 0x50,                         // push r8
+	0x41, 0x51,                         // push r9
+	0x50,                               // push rax
+	0x41, 0x52,                         // push r10
+	0x41, 0x53,                         // push r11
+	0x48, 0x81, 0xec, 0x80, 0, 0, 0,    // sub rsp, 0x80
+	0x48, 0x83, 0xe4, 0xf0,             // and rsp, -16
+	0xf3, 0x0f, 0x7f, 0x04, 0x24,       // movdqu [rsp], xmm0
+	0xf3, 0x0f, 0x7f, 0x4c, 0x24, 0x10, // movdqu [rsp+0x10], xmm1
+	0xf3, 0x0f, 0x7f, 0x54, 0x24, 0x20, // movdqu [rsp+0x20], xmm2
+	0xf3, 0x0f, 0x7f, 0x5c, 0x24, 0x30, // movdqu [rsp+0x30], xmm3
+	0xf3, 0x0f, 0x7f, 0x64, 0x24, 0x40, // movdqu [rsp+0x40], xmm4
+	0xf3, 0x0f, 0x7f, 0x6c, 0x24, 0x50, // movdqu [rsp+0x50], xmm5
+	0xf3, 0x0f, 0x7f, 0x74, 0x24, 0x60, // movdqu [rsp+0x60], xmm6
+	0xf3, 0x0f, 0x7f, 0x7c, 0x24, 0x70, // movdqu [rsp+0x70], xmm7
+	0x48, 0xbf, 0, 0, 0, 0, 0, 0, 0, 0, // mov rdi, linker
+	0x48, 0x8b, 0x75, 0x08,             // mov rsi, [rbp+8]
+	0x48, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, // mov rax, bind_stub
+	0xff, 0xd0,                         // call rax
+	0x48, 0x89, 0x45, 0x08,             // mov [rbp+8], rax
+	0xf3, 0x0f, 0x6f, 0x04, 0x24,       // movdqu xmm0, [rsp]
+	0xf3, 0x0f, 0x6f, 0x4c, 0x24, 0x10, // movdqu xmm1, [rsp+0x10]
+	0xf3, 0x0f, 0x6f, 0x54, 0x24, 0x20, // movdqu xmm2, [rsp+0x20]
+	0xf3, 0x0f, 0x6f, 0x5c, 0x24, 0x30, // movdqu xmm3, [rsp+0x30]
+	0xf3, 0x0f, 0x6f, 0x64, 0x24, 0x40, // movdqu xmm4, [rsp+0x40]
+	0xf3, 0x0f, 0x6f, 0x6c, 0x24, 0x50, // movdqu xmm5, [rsp+0x50]
+	0xf3, 0x0f, 0x6f, 0x74, 0x24, 0x60, // movdqu xmm6, [rsp+0x60]
+	0xf3, 0x0f, 0x6f, 0x7c, 0x24, 0x70, // movdqu xmm7, [rsp+0x70]
+	0x48, 0x8d, 0x65, 0xb8,             // lea rsp, [rbp-0x48]
+	0x41, 0x5b,                         // pop r11
+	0x41, 0x5a,                         // pop r10
+	0x58,                               // pop rax
+	0x41, 0x59,                         // pop r9
+	0x41, 0x58,                         // pop r8
+	0x59,                               // pop rcx
+	0x5a,                               // pop rdx
+	0x5e,                               // pop rsi
+	0x5f,                               // pop rdi
+	0x5d,                               // pop rbp
+	0xc3,                               // ret
+	0x0f, 0x0b                          // ud2
+};
+// Offsets of the operands of the two movs, and of the trap where branches
+// to labels which can't be bound end up
+const size_t thunk_linker = 77;
+const size_t thunk_bind = 91;
+const size_t thunk_trap = sizeof(thunk) - 2;
+
+// Jumps to the address in its slot, which is initially the call to the
+// thunk that binds the label
+const uint8_t stub[] = {
+	0xff, 0x25, 0x02, 0, 0, 0,          // jmp [rip+2]
+	0xcc, 0xcc,
+	0, 0, 0, 0, 0, 0, 0, 0,             // slot
+	0xff, 0x15, 0x02, 0, 0, 0,          // call [rip+2]
+	0xcc, 0xcc,
+	0, 0, 0, 0, 0, 0, 0, 0              // thunk
+};
+// Offsets of the slot, the call, the return address of the call, and the
+// address of the thunk
+const size_t stub_slot = 8;
+const size_t stub_call = 16;
+const size_t stub_ret = 22;
+const size_t stub_thunk = 24;
+
+// Returns true if a rel32 at here can reach addr
+bool reaches(uint64_t here, uint64_t addr) {
+	const auto rel = (int64_t)(addr - here - 4);
+	return rel >= INT32_MIN && rel <= INT32_MAX;
+}
+
+} // namespace
+
 namespace x64asm {
 
 void Linker::link(Function& fxn) {
 	// Record this function if it requires linking. Remember, the assembler
 	// will remove label_rels_ whenever they are resolved. So if anything is
 	// left in this map, it must require the linker.
-	if (!fxn.label_rels_.empty()) {
+	if (define(fxn) && !fxn.label_rels_.empty()) {
 		fxns_.push_back(&fxn);
 	}
+}
+
+void Linker::finish() {
+	// Small batches aren't worth starting threads for
+	size_t rels = 0;
+	for (auto fxn : fxns_) {
+		rels += fxn->label_rels_.size();
+	}
+	const auto threads = parallel_threads(rels, threads_, 16384);
+
+	// The definition table is only read here, and every thread patches
+	// different functions. References which can't be resolved yet are
+	// collected per thread and kept once every thread is done.
+	vector<vector<pair<uint64_t, Ref>>> missing(threads);
+	parallel_for(fxns_.size(), threads, [this, &missing](size_t t, size_t i) {
+		auto fxn = fxns_[i];
+		for (const auto& l : fxn->label_rels_) {
+			const auto id = fxn->label_ids_[l.second];
+			const auto itr = label_defs_.find(id);
+			if (itr == label_defs_.end()) {
+				missing[t].push_back({id, {fxn, l.first}});
+			} else {
+				patch(*fxn, l.first, itr->second);
+			}
+		}
+	});
+	fxns_.clear();
+
+	for (const auto& m : missing) {
+		for (const auto& r : m) {
+			if (!defer(*r.second.fxn, r.second.pos, r.first)) {
+				pending_[r.first].push_back(r.second);
+				++num_pending_;
+			}
+		}
+	}
+}
 
-	// Aggregate label_defs_ into a single structure and check for multiple defs 
-	for (const auto& l : fxn.label_defs_) {
-		const auto itr = label_defs_.find(l.first);
+void Linker::add(Function& fxn) {
+	if (!define(fxn)) {
+		return;
+	}
+	for (const auto& l : fxn.label_rels_) {
+		const auto id = fxn.label_ids_[l.second];
+		const auto itr = label_defs_.find(id);
 		if (itr != label_defs_.end()) {
+			patch(fxn, l.first, itr->second);
+		} else if (!defer(fxn, l.first, id)) {
+			pending_[id].push_back({&fxn, l.first});
+			++num_pending_;
+		}
+	}
+}
+
+bool Linker::define(const Function& fxn) {
+	// Check for multiple defs before touching anything, so that a clash leaves
+	// no half-defined function behind
+	for (size_t i = 0, ie = fxn.label_defs_.size(); i < ie; ++i) {
+		if (fxn.label_defs_[i] != Function::undef_label() &&
+				label_defs_.count(fxn.label_ids_[i])) {
 			multiple_def_ = true;
-			return;
+			return false;
+		}
+	}
+	// Aggregate label_defs_ into a single structure
+	for (size_t i = 0, ie = fxn.label_defs_.size(); i < ie; ++i) {
+		const auto def = fxn.label_defs_[i];
+		if (def == Function::undef_label()) {
+			continue;
 		}
+		const auto id = fxn.label_ids_[i];
 		// Here we store global offsets, rather than function local offsets
-		label_defs_.insert(itr, {l.first, (uint64_t)fxn.data()+l.second});
+		const auto addr = (uint64_t)fxn.data() + def;
+		label_defs_.insert({id, addr});
+		if (!pending_.empty()) {
+			resolve(id, addr);
+		}
+		if (!stubs_.empty()) {
+			bind(id, addr);
+		}
 	}
+	return true;
 }
 
-void Linker::finish() {
-	for (auto fxn : fxns_) {
-		for (const auto& l : fxn->label_rels_) {
-			const auto pos = l.first;
+void Linker::resolve(uint64_t id, uint64_t addr) {
+	const auto itr = pending_.find(id);
+	if (itr == pending_.end()) {
+		return;
+	}
+	for (const auto& r : itr->second) {
+		patch(*r.fxn, r.pos, addr);
+	}
+	num_pending_ -= itr->second.size();
+	pending_.erase(itr);
+}
 
-			const auto itr = label_defs_.find(l.second);
-			if (itr == label_defs_.end()) {
-				undef_symbol_ = true;
-				return;
+void Linker::bind(uint64_t id, uint64_t addr) {
+	const auto itr = stubs_.find(id);
+	if (itr == stubs_.end()) {
+		return;
+	}
+	for (auto& s : itr->second) {
+		// Code may be running through the stub, so each address is changed with
+		// a single write. Writes which don't cross a cache line are atomic;
+		// references which can't be patched that way keep using the stub.
+		__atomic_store_n(s.slot, addr, __ATOMIC_RELEASE);
+		for (const auto& r : s.refs) {
+			const auto here = (uint64_t)r.fxn->data() + r.pos;
+			if (reaches(here, addr) && here % 64 <= 60) {
+				*(volatile uint32_t*)(r.fxn->buffer_ + r.pos) = addr - here - 4;
 			}
+		}
+	}
+	stubs_.erase(itr);
+}
 
-			const auto here = (uint64_t)fxn->data() + pos;
-			const auto there = itr->second;
-			const auto rel = there - here - 4;
+bool Linker::defer(Function& fxn, size_t pos, uint64_t id) {
+	if (!resolver_ || !branch(fxn, pos)) {
+		return false;
+	}
 
-			fxn->emit_long(rel, pos);
+	// Use a stub for this label within reach, or create one
+	const auto here = (uint64_t)fxn.data() + pos;
+	auto& ss = stubs_[id];
+	Stub* s = nullptr;
+	for (auto& i : ss) {
+		if (reaches(here, i.addr)) {
+			s = &i;
+			break;
+		}
+	}
+	if (s == nullptr) {
+		lock_guard<mutex> lock(veneer_mutex_);
+		if (thunk_ == 0) {
+			const auto p = reserve(here, (sizeof(thunk) + 15) / 16 * 16, thunk_);
+			if (p == nullptr) {
+				return false;
+			}
+			const auto self = (uint64_t)this;
+			const auto fn = (uint64_t)&Linker::bind_stub;
+			memcpy(p, thunk, sizeof(thunk));
+			memcpy(p + thunk_linker, &self, 8);
+			memcpy(p + thunk_bind, &fn, 8);
 		}
-	}	
-}	
+
+		uint64_t addr = 0;
+		const auto p = reserve(here, sizeof(stub), addr);
+		if (p == nullptr) {
+			return false;
+		}
+		const auto call = addr + stub_call;
+		memcpy(p, stub, sizeof(stub));
+		memcpy(p + stub_slot, &call, 8);
+		memcpy(p + stub_thunk, &thunk_, 8);
+
+		ss.push_back({addr, (uint64_t*)(p + stub_slot), {}});
+		stub_ids_[addr] = id;
+		++num_stubs_;
+		s = &ss.back();
+	}
+
+	s->refs.push_back({&fxn, pos});
+	fxn.emit_long(s->addr - here - 4, pos);
+	return true;
+}
+
+uint64_t Linker::bind_stub(Linker* linker, uint64_t ret) {
+	lock_guard<recursive_mutex> lock(linker->bind_mutex_);
+
+	const auto stub = linker->stub_ids_.find(ret - stub_ret);
+	if (stub == linker->stub_ids_.end()) {
+		return linker->thunk_ + thunk_trap;
+	}
+	// Another thread may have bound the label since this one read the slot
+	const auto id = stub->second;
+	auto& defs = linker->label_defs_;
+	auto itr = defs.find(id);
+	if (itr == defs.end() && linker->resolver_ && linker->resolver_(id)) {
+		itr = defs.find(id);
+	}
+	return itr == defs.end() ? linker->thunk_ + thunk_trap : itr->second;
+}
+
+void Linker::patch_far(Function& fxn, size_t pos, uint64_t addr) {
+	lock_guard<mutex> lock(veneer_mutex_);
+
+	// Only branches can be redirected
+	const auto here = (uint64_t)fxn.data() + pos;
+	const auto v = branch(fxn, pos) ? veneer(here, addr) : 0;
+	if (v == 0) {
+		out_of_range_ = true;
+		return;
+	}
+	fxn.emit_long(v - here - 4, pos);
+}
+
+uint64_t Linker::veneer(uint64_t here, uint64_t addr) {
+	auto& vs = veneer_addrs_[addr];
+	for (auto v : vs) {
+		if (reaches(here, v)) {
+			return v;
+		}
+	}
+
+	uint64_t v = 0;
+	const auto p = reserve(here, 16, v);
+	if (p == nullptr) {
+		return 0;
+	}
+
+	// jmp [rip+0], followed by the address of the label
+	const uint8_t jmp[6] = {0xff, 0x25, 0x00, 0x00, 0x00, 0x00};
+	memcpy(p, jmp, sizeof(jmp));
+	memcpy(p + sizeof(jmp), &addr, 8);
+	memset(p + sizeof(jmp) + 8, 0xcc, 2);
+
+	vs.push_back(v);
+	++num_veneers_;
+	return v;
+}
+
+uint8_t* Linker::reserve(uint64_t here, size_t size, uint64_t& rx) {
+	// Use an island within reach which has room, or place a new one near
+	// the branch
+	Island* island = nullptr;
+	for (auto& i : islands_) {
+		if (i.used + size <= i.buf.size &&
+			reaches(here, (uint64_t)i.buf.rx + i.used)) {
+			island = &i;
+			break;
+		}
+	}
+	// Otherwise carve a new one out of an arena within reach, or out of a new
+	// arena placed near the branch. Arenas are only tried if the branch
+	// reaches the address they were placed near, so that they don't grow
+	// regions far from the branch.
+	if (island == nullptr) {
+		Island i {{nullptr, nullptr, 0}, 0};
+		for (const auto& a : island_arenas_) {
+			if (!reaches(here, (uint64_t)a->near())) {
+				continue;
+			}
+			i.buf = a->allocate(island_size_);
+			if (i.buf.rw != nullptr && reaches(here, (uint64_t)i.buf.rx)) {
+				break;
+			}
+			a->release(i.buf);
+			i.buf.rw = nullptr;
+		}
+		if (i.buf.rw == nullptr) {
+			island_arenas_.emplace_back(
+				new CodeArena(island_region_size_, false, (const void*)here));
+			i.buf = island_arenas_.back()->allocate(island_size_);
+			if (i.buf.rw == nullptr || !reaches(here, (uint64_t)i.buf.rx)) {
+				return nullptr;
+			}
+		}
+		islands_.push_back(i);
+		island = &islands_.back();
+	}
+
+	const auto p = island->buf.rw + island->used;
+	rx = (uint64_t)island->buf.rx + island->used;
+	island->used += size;
+	return p;
+}
+
+bool Linker::branch(const Function& fxn, size_t pos) {
+	// E8 cd (call), E9 cd (jmp) or 0F 8x cd (jcc)
+	const auto buf = fxn.buffer_;
+	return (pos >= 1 && (buf[pos-1] == 0xe8 || buf[pos-1] == 0xe9)) ||
+		(pos >= 2 && buf[pos-2] == 0x0f && (buf[pos-1] & 0xf0) == 0x80);
+}
 
 } // x64asm
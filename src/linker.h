@@ -1,5 +1,5 @@
 /*
-Copyright 2014 eric schkufza
+Copyright 2013 eric schkufza
 
 Licensed under the Apache License, Version 2.0 (the "License");
 you may not use this file except in compliance with the License.
@@ -17,49 +17,241 @@ limitations under the License.
 #ifndef X64ASM_SRC_LINKER_H
 #define X64ASM_SRC_LINKER_H
 
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
+#include "src/code_arena.h"
 #include "src/function.h"
 
 namespace x64asm {
 
+/** Resolves label references between functions. Functions may be linked in
+    batches, by calling link() for each and then finish(), which patches
+    large batches in parallel; or one at a time by calling add(), which
+    patches only the references which the new function makes resolvable.
+    Either way the table of label definitions stays live, and references to
+    labels which haven't been defined yet are kept until they can be
+    resolved. Linked functions must not be moved or grown.
+
+    Branches to labels beyond the reach of a rel32 displacement go through
+    veneers: indirect jumps placed in small islands of code near the branch,
+    which are shared by nearby branches to the same label. Veneers outlive
+    start() and are freed with the linker. Other references out of reach are
+    errors.
+
+    Given a resolver, branches to labels which aren't defined yet are bound
+    lazily instead: they go through stubs which call the resolver the first
+    time they are taken, so that functions need only be assembled once they
+    are called. Once a label is defined, its stubs jump straight to it, and
+    branches to them are patched to reach it directly where that can be done
+    with a single atomic write. Like veneers, stubs outlive start(): those
+    which haven't been bound are bound by labels defined afterwards, but no
+    longer patch the branches to them. Linked code must not run after the
+    linker is destroyed; while it may be binding labels, the linker should
+    only be used by the resolver.
+*/
 class Linker {
 	public:
+		Linker() : threads_(0), num_veneers_(0), thunk_(0), num_stubs_(0) {
+			start();
+		}
+
+		Linker(const Linker&) = delete;
+		Linker& operator=(const Linker&) = delete;
+
 		/** Restart the linking process */
 		void start() {
 			multiple_def_ = false;
-			undef_symbol_ = false;
+			out_of_range_ = false;
 			label_defs_.clear();
 			fxns_.clear();
+			pending_.clear();
+			num_pending_ = 0;
+			// Stubs are kept, but the functions which branch to them may not be
+			for (auto& ss : stubs_) {
+				for (auto& s : ss.second) {
+					s.refs.clear();
+				}
+			}
 		}
-		/** Link a new function */
+		/** Link a new function. Its references are patched by finish();
+		    pending references to the labels it defines are patched at once.
+		*/
 		void link(Function& fxn);
-		/** Finish the linking process */
+		/** Finish the linking process. Patches references made by functions
+		    linked since the last call; those to undefined labels are kept.
+		*/
 		void finish();
+		/** Links a function and patches every reference which it makes
+		    resolvable, both from the function and to the labels it defines.
+		*/
+		void add(Function& fxn);
+
+		/** Sets the number of threads used by finish(); 0 means one per core.
+		    Small batches are always patched by the calling thread.
+		*/
+		void set_threads(size_t threads) {
+			threads_ = threads;
+		}
+
+		/** Sets the function called the first time code branches to a label
+		    which isn't defined, with the id of the label; a Label converts to
+		    its id. It should define the label, with add() or link(), and return
+		    true. If it returns false, the branch traps. From now on, branches to
+		    labels which aren't defined are bound lazily rather than pending.
+		*/
+		void set_resolver(const std::function<bool(uint64_t)>& resolver) {
+			resolver_ = resolver;
+		}
 
 		/** Returns true if no errors occurred during linking. */
 		bool good() const {
-			return !multiple_def() && !undef_symbol();
+			return !multiple_def() && !undef_symbol() && !out_of_range();
 		}
-		/** Returns true if a multiple definition error occurred. */
+		/** Returns true if a multiple definition error occurred. A function which
+		    redefines a label is rejected whole: none of its labels are defined.
+		*/
 		bool multiple_def() const {
 			return multiple_def_;
 		}
-		/** Returns true if an undefined symbol error occurred. */
+		/** Returns true if references to undefined labels remain. */
 		bool undef_symbol() const {
-			return undef_symbol_;
+			return num_pending_ > 0;
+		}
+		/** Returns true if a reference other than a branch was out of reach. */
+		bool out_of_range() const {
+			return out_of_range_;
+		}
+		/** Returns the number of references to undefined labels. */
+		size_t pending() const {
+			return num_pending_;
+		}
+		/** Returns the number of veneers created by this linker. */
+		size_t veneers() const {
+			return num_veneers_;
+		}
+		/** Returns the number of lazy-binding stubs created by this linker. */
+		size_t stubs() const {
+			return num_stubs_;
 		}
 
 	private:
+		/** A reference waiting for a label definition. */
+		struct Ref {
+			Function* fxn;
+			size_t pos;
+		};
+
+		/** A region of code which holds veneers. */
+		struct Island {
+			CodeArena::Buffer buf;
+			/** Number of bytes holding veneers. */
+			size_t used;
+		};
+
+		/** A lazy-binding stub, and the references which go through it. */
+		struct Stub {
+			/** Address of the stub. */
+			uint64_t addr;
+			/** The writable view of the address the stub jumps to. */
+			uint64_t* slot;
+			/** References to the stub. */
+			std::vector<Ref> refs;
+		};
+
+		/** Size of an island; a veneer takes 16 bytes and a stub 32. */
+		static constexpr size_t island_size_ = 4096;
+		/** Size of the regions which islands are carved out of. */
+		static constexpr size_t island_region_size_ = 1 << 20;
+
+		/** Number of threads used by finish(). */
+		size_t threads_;
 		/** Label definition map for all functions (uses global addrs). */
-    std::unordered_map<uint64_t, size_t> label_defs_;
+		std::unordered_map<uint64_t, uint64_t> label_defs_;
 		/** List of functions that require linking. */
 		std::vector<Function*> fxns_;
+		/** References to undefined labels, by label id. */
+		std::unordered_map<uint64_t, std::vector<Ref>> pending_;
+		/** Number of references in pending_. */
+		size_t num_pending_;
 		/** Did a multiple definition error occur? */
 		bool multiple_def_;
-		/** Did an undefined symbol error occur? */
-		bool undef_symbol_;
+		/** Was a reference other than a branch out of reach? */
+		bool out_of_range_;
+
+		/** Arenas which islands are carved out of, each placed near the branch
+		    which first needed it.
+		*/
+		std::vector<std::unique_ptr<CodeArena>> island_arenas_;
+		/** Islands of veneers. */
+		std::vector<Island> islands_;
+		/** Addresses of veneers, by target address. */
+		std::unordered_map<uint64_t, std::vector<uint64_t>> veneer_addrs_;
+		/** Number of veneers. */
+		size_t num_veneers_;
+		/** Guards islands, where veneers may be created while patching in
+		    parallel.
+		*/
+		std::mutex veneer_mutex_;
+
+		/** Called to define labels which stubs branch to. */
+		std::function<bool(uint64_t)> resolver_;
+		/** Address of the code which stubs call to bind labels, or zero. */
+		uint64_t thunk_;
+		/** Stubs of labels which haven't been bound, by label id. */
+		std::unordered_map<uint64_t, std::vector<Stub>> stubs_;
+		/** Label ids, by stub address; kept once labels are bound. */
+		std::unordered_map<uint64_t, uint64_t> stub_ids_;
+		/** Number of stubs. */
+		size_t num_stubs_;
+		/** Serializes binding; recursive, since resolvers may run linked code. */
+		std::recursive_mutex bind_mutex_;
+
+		/** Adds the label definitions of a function to the table; returns
+		    false on a multiple definition.
+		*/
+		bool define(const Function& fxn);
+		/** Patches every pending reference to a label which is now defined. */
+		void resolve(uint64_t id, uint64_t addr);
+		/** Points the stubs of a label which is now defined, and the references
+		    to them, at the label.
+		*/
+		void bind(uint64_t id, uint64_t addr);
+		/** Sends a reference to an undefined label through a stub; returns
+		    false if it should be left pending.
+		*/
+		bool defer(Function& fxn, size_t pos, uint64_t id);
+		/** Called by the thunk with the return address of a stub's call to it.
+		    Returns the address at which the stub should continue.
+		*/
+		static uint64_t bind_stub(Linker* linker, uint64_t ret);
+		/** Patches a reference, through a veneer if it is out of reach. */
+		void patch(Function& fxn, size_t pos, uint64_t addr) {
+			const auto here = (uint64_t)fxn.data() + pos;
+			const auto rel = (int64_t)(addr - here - 4);
+			if (rel >= INT32_MIN && rel <= INT32_MAX) {
+				fxn.emit_long(rel, pos);
+			} else {
+				patch_far(fxn, pos, addr);
+			}
+		}
+		/** Patches a reference which is out of reach. */
+		void patch_far(Function& fxn, size_t pos, uint64_t addr);
+		/** Returns the address of a veneer to addr which a rel32 at here can
+		    reach, or zero if none can be created.
+		*/
+		uint64_t veneer(uint64_t here, uint64_t addr);
+		/** Reserves size bytes of an island which a rel32 at here can reach.
+		    Returns the writable view, or null, and sets rx to the address.
+		*/
+		uint8_t* reserve(uint64_t here, size_t size, uint64_t& rx);
+		/** Returns true if the rel32 at pos belongs to a branch. */
+		static bool branch(const Function& fxn, size_t pos);
 };
 
 } // namespace x64asm
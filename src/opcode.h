@@ -19,12 +19,13 @@ limitations under the License.
 
 namespace x64asm {
 
-#define X64ASM_NUM_OPCODES 3804
+#define X64ASM_NUM_OPCODES 3805
 
 /** An instruction mnemonic. */
 enum Opcode : int32_t {
   // Internal mnemonics
-  LABEL_DEFN = 0
+  LABEL_DEFN = 0,
+  P2ALIGN
   // Auto-generated mnemonics
   #include "src/opcode.enum"
 };
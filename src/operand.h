@@ -37,8 +37,14 @@ class Operand {
     friend class std::array<Operand, 4>;
     // Needs access to underlying value.
     friend class Assembler;
+    // Needs access to underlying value.
+    friend class CodeCache;
     // Needs access to non-default constructor.
     friend class Instruction;
+    // Needs access to default constructor and underlying value.
+    friend class StaticAssembler;
+    // Needs access to default constructor and underlying value.
+    friend class Decoder;
 
   public:
     /** Return the type of this operand */
@@ -0,0 +1,77 @@
+/*
+Copyright 2013 eric schkufza
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef X64ASM_SRC_PARALLEL_H
+#define X64ASM_SRC_PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <stddef.h>
+#include <thread>
+#include <vector>
+
+namespace x64asm {
+
+/** Applies f(thread, index) to every index in [0, n) using a pool of
+    threads. Each thread owns an equal share of the range, and steals
+    fixed-size chunks from the other threads when its own share runs out.
+*/
+template <typename F>
+void parallel_for(size_t n, size_t threads, F f) {
+  const size_t chunk = 16;
+  std::vector<std::atomic<size_t>> next(threads);
+  std::vector<size_t> end(threads);
+  for (size_t t = 0; t < threads; ++t) {
+    next[t].store(n * t / threads);
+    end[t] = n * (t+1) / threads;
+  }
+
+  auto work = [&](size_t t) {
+    for (size_t k = 0; k < threads; ++k) {
+      const auto v = (t + k) % threads;
+      for (auto i = next[v].fetch_add(chunk); i < end[v];
+           i = next[v].fetch_add(chunk)) {
+        for (size_t j = i, je = std::min(i + chunk, end[v]); j < je; ++j) {
+          f(t, j);
+        }
+      }
+    }
+  };
+
+  std::vector<std::thread> pool;
+  for (size_t t = 1; t < threads; ++t) {
+    pool.emplace_back(work, t);
+  }
+  work(0);
+  for (auto& th : pool) {
+    th.join();
+  }
+}
+
+/** Returns the number of threads to use for n items of work, given at most
+    max threads (one per core if max is 0) and at least min_work items per
+    thread.
+*/
+inline size_t parallel_threads(size_t n, size_t max, size_t min_work) {
+  if (max == 0) {
+    max = std::max(1u, std::thread::hardware_concurrency());
+  }
+  return std::max((size_t)1, std::min(max, n / std::max(min_work, (size_t)1)));
+}
+
+} // namespace x64asm
+
+#endif
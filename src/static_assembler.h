@@ -0,0 +1,341 @@
+/*
+Copyright 2013 eric schkufza
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef X64ASM_SRC_STATIC_ASSEMBLER_H
+#define X64ASM_SRC_STATIC_ASSEMBLER_H
+
+#include <array>
+#include <stddef.h>
+#include <stdexcept>
+#include <stdint.h>
+#include <type_traits>
+
+#include "src/encoding.h"
+#include "src/encoding_table.h"
+#include "src/opcode.h"
+#include "src/operand.h"
+
+namespace x64asm {
+
+/** A compile-time assembler. Fixed sequences of instructions such as
+    prologues, trampolines, and state save and restore stubs are encoded by
+    the compiler using the same table as Assembler::Engine::TABLE, and the
+    resulting bytes can be copied into a Function with Function::emit_bytes().
+
+      constexpr StaticAssembler::Instr prologue[] {
+        {PUSH_R64, Constants::rbp()},
+        {MOV_R64_R64, Constants::rbp(), Constants::rsp()}
+      };
+      constexpr auto bytes = StaticAssembler::assemble<
+          StaticAssembler::length(prologue)>(prologue);
+
+    Label references and alignment directives depend on where code is placed
+    and are rejected at compile time. This header is not included by
+    include/x64asm.h because it pulls in the full encoding table.
+*/
+class StaticAssembler {
+  public:
+    /** An instruction which can be assembled at compile time. Operands are
+        stored in intel order, as they are for Instruction.
+    */
+    class Instr {
+        friend class StaticAssembler;
+
+      public:
+        /** Creates an instruction with up to four operands. */
+        constexpr Instr(Opcode opcode, Operand o0 = Operand(),
+                        Operand o1 = Operand(), Operand o2 = Operand(),
+                        Operand o3 = Operand()) :
+          opcode_(opcode), operands_{o0, o1, o2, o3} { }
+
+      private:
+        /** The instruction mnemonic. */
+        Opcode opcode_;
+        /** Operands; unused operands are empty. */
+        Operand operands_[4];
+    };
+
+    /** Returns the number of bytes that assembling a code will produce. */
+    template <size_t K>
+    static constexpr size_t length(const Instr (&code)[K]) {
+      return length(code, K, 0);
+    }
+
+    /** Assembles a code. N must equal length(code); any other value, or an
+        instruction which cannot be assembled statically, is a compile error
+        when the result is used to initialize a constexpr variable.
+    */
+    template <size_t N, size_t K>
+    static constexpr std::array<uint8_t, N> assemble(const Instr (&code)[K]) {
+      return length(code) != N ?
+        throw std::length_error("StaticAssembler: N must equal length(code)") :
+        assemble(code, K, typename MakeIndices<N>::type());
+    }
+
+  private:
+    /** A compile-time sequence of indices. */
+    template <size_t... I>
+    struct Indices {
+      typedef Indices<I..., (sizeof...(I) + I)...> twice;
+      typedef Indices<I..., (sizeof...(I) + I)..., 2 * sizeof...(I)> twice_plus_one;
+    };
+    /** Generates Indices<0, ..., N-1> using logarithmic template depth. */
+    template <size_t N, typename = void>
+    struct MakeIndices {
+      typedef typename std::conditional<N % 2 == 0,
+        typename MakeIndices<N / 2>::type::twice,
+        typename MakeIndices<N / 2>::type::twice_plus_one>::type type;
+    };
+    template <typename T>
+    struct MakeIndices<0, T> {
+      typedef Indices<> type;
+    };
+
+    /** The encoding of a single instruction. Instructions are at most 15
+        bytes long.
+    */
+    struct Bytes {
+      uint8_t bytes[16];
+      size_t size;
+    };
+
+    /** Returns b followed by the low n bytes of x in little-endian order. */
+    template <size_t... I>
+    static constexpr Bytes append(const Bytes& b, uint64_t x, size_t n,
+                                  Indices<I...>) {
+      return Bytes {{(uint8_t)(I < b.size ? b.bytes[I] :
+                               I < b.size + n ? x >> (8 * (I - b.size)) : 0)...},
+                    b.size + n};
+    }
+    static constexpr Bytes append(const Bytes& b, uint64_t x, size_t n = 1) {
+      return append(b, x, n, MakeIndices<16>::type());
+    }
+
+    // Operand and encoding table accessors
+
+    static constexpr const Encoding& enc(const Instr& i) {
+      return encoding_table[i.opcode_];
+    }
+    static constexpr uint64_t val(const Instr& i, int idx) {
+      return i.operands_[idx].val_;
+    }
+    static constexpr bool has(const Instr& i, Encoding::Flag f) {
+      return (enc(i).flags & f) != 0;
+    }
+    /** The mod r/m reg field; an opcode extension digit if present. */
+    static constexpr uint64_t r(const Instr& i) {
+      return enc(i).digit != -1 ? (uint64_t)enc(i).digit :
+             val(i, enc(i).r == -1 ? 0 : enc(i).r);
+    }
+
+    // Memory operand fields; see the bit layout in src/m.h
+
+    static constexpr bool has_seg(uint64_t m) {
+      return ((m >> 56) & 0x7) != 0x7;
+    }
+    static constexpr bool has_base(uint64_t m) {
+      return ((m >> 32) & 0x1f) != 0x10;
+    }
+    static constexpr bool has_index(uint64_t m) {
+      return ((m >> 40) & 0x1f) != 0x10;
+    }
+    static constexpr uint64_t base(uint64_t m) {
+      return (m >> 32) & 0x1f;
+    }
+    static constexpr uint64_t index(uint64_t m) {
+      return (m >> 40) & 0x1f;
+    }
+    static constexpr uint64_t scale_bits(uint64_t m) {
+      return ((m >> 48) & 0x3) << 6;
+    }
+    static constexpr bool addr_or(uint64_t m) {
+      return (m >> 60) & 0x1;
+    }
+    static constexpr bool rip_offset(uint64_t m) {
+      return (m >> 61) & 0x1;
+    }
+    static constexpr int32_t disp(uint64_t m) {
+      return (int32_t)(uint32_t)m;
+    }
+
+    // Prefixes; ordering matches Assembler::assemble_table()
+
+    static constexpr uint8_t seg_prefix(uint64_t seg) {
+      return seg == 0 ? 0x26 : seg == 1 ? 0x2e : seg == 2 ? 0x36 :
+             seg == 3 ? 0x3e : seg == 4 ? 0x64 : 0x65;
+    }
+    static constexpr Bytes fwait(const Instr& i, const Bytes& b) {
+      return has(i, Encoding::FWAIT) ? append(b, 0x9b) : b;
+    }
+    static constexpr Bytes group2(const Instr& i, const Bytes& b) {
+      return has(i, Encoding::HINT) ?
+               append(b, val(i, 1) == 0 ? 0x3e : 0x2e) :
+             enc(i).mem != -1 && has_seg(val(i, enc(i).mem)) ?
+               append(b, seg_prefix((val(i, enc(i).mem) >> 56) & 0x7)) : b;
+    }
+    static constexpr Bytes group4(const Instr& i, const Bytes& b) {
+      return enc(i).mem != -1 && addr_or(val(i, enc(i).mem)) ?
+             append(b, 0x67) : b;
+    }
+    static constexpr Bytes group3(const Instr& i, const Bytes& b) {
+      return has(i, Encoding::PREF_66) ? append(b, 0x66) : b;
+    }
+    static constexpr Bytes group1(const Instr& i, const Bytes& b) {
+      return has(i, Encoding::PREF_F2) ? append(b, 0xf2) :
+             has(i, Encoding::PREF_F3) ? append(b, 0xf3) : b;
+    }
+
+    // Vex prefixes. See Figure 2-9: Intel Manual Vol 2A 2-14.
+
+    static constexpr bool mem(const Instr& i) {
+      return has(i, Encoding::MEM);
+    }
+    static constexpr uint8_t vex_r(const Instr& i) {
+      return enc(i).rm == -1 ? 0x80 : (~r(i) << 4) & 0x80;
+    }
+    static constexpr uint8_t vex_x(const Instr& i) {
+      return enc(i).rm == -1 || !mem(i) || !has_index(val(i, enc(i).rm)) ?
+             0x40 : (~index(val(i, enc(i).rm)) << 3) & 0x40;
+    }
+    static constexpr uint8_t vex_b(const Instr& i) {
+      return enc(i).rm == -1 ? 0x20 :
+             !mem(i) ? (~val(i, enc(i).rm) << 2) & 0x20 :
+             !has_base(val(i, enc(i).rm)) ? 0x20 :
+             (~base(val(i, enc(i).rm)) << 2) & 0x20;
+    }
+    static constexpr uint8_t vex_w(const Instr& i) {
+      return has(i, Encoding::VEX_W) ? 0x1 : 0x0;
+    }
+    static constexpr uint8_t vex_lpp(const Instr& i) {
+      return ((~(enc(i).vvvv != -1 ? val(i, enc(i).vvvv) : 0) << 3) & 0x78) |
+             ((has(i, Encoding::VEX_L) ? 0x1 : 0x0) << 2) | enc(i).vex_pp;
+    }
+    static constexpr Bytes vex(const Instr& i, const Bytes& b) {
+      return vex_x(i) == 0x40 && vex_b(i) == 0x20 &&
+             enc(i).vex_mmmmm == 0x01 && vex_w(i) == 0 ?
+        append(b, 0xc5 | ((vex_r(i) | vex_lpp(i)) << 8), 2) :
+        append(b, 0xc4 |
+                  ((vex_r(i) | vex_x(i) | vex_b(i) | enc(i).vex_mmmmm) << 8) |
+                  (((vex_w(i) << 7) | vex_lpp(i)) << 16), 3);
+    }
+
+    // Rex prefixes. See Figures 2.4 through 2.7: Intel Manual Vol 2A 2-8.
+
+    static constexpr uint8_t rex_bits(const Instr& i) {
+      return has(i, Encoding::REX_O) ? enc(i).rex | (val(i, 0) >> 3) :
+             (enc(i).rex | (enc(i).r != -1 ? (r(i) >> 1) & 0x4 : 0) |
+              (!mem(i) ? val(i, enc(i).rm) >> 3 :
+               (has_base(val(i, enc(i).rm)) ? base(val(i, enc(i).rm)) >> 3 : 0) |
+               (has_index(val(i, enc(i).rm)) ?
+                 (index(val(i, enc(i).rm)) >> 2) & 0x2 : 0)));
+    }
+    static constexpr Bytes rex(const Instr& i, const Bytes& b) {
+      return !has(i, Encoding::REX_O) && enc(i).rm == -1 ?
+               (enc(i).rex ? append(b, enc(i).rex) : b) :
+             rex_bits(i) ? append(b, rex_bits(i) | 0x40) : b;
+    }
+
+    // Opcode bytes
+
+    static constexpr uint64_t opcode_byte(const Instr& i, int k) {
+      return (enc(i).opc[k] + (k == enc(i).opc_len - 1 && enc(i).opc_reg != -1 ?
+                               val(i, enc(i).opc_reg) & 0x7 : 0)) & 0xff;
+    }
+    static constexpr Bytes opcode(const Instr& i, const Bytes& b) {
+      return append(b, opcode_byte(i, 0) | (opcode_byte(i, 1) << 8) |
+                       (opcode_byte(i, 2) << 16), enc(i).opc_len);
+    }
+
+    // Mod R/M and SIB bytes. See Assembler::emit_mod_rm_sib().
+
+    static constexpr uint64_t mod(uint64_t m) {
+      return disp(m) < -128 || disp(m) >= 128 ? 0x80 :
+             disp(m) == 0 && (base(m) & 0x7) != 0x5 ? 0x00 : 0x40;
+    }
+    static constexpr Bytes mod_disp(uint64_t m, const Bytes& b) {
+      return mod(m) == 0x40 ? append(b, (uint32_t)disp(m)) :
+             mod(m) == 0x80 ? append(b, (uint32_t)disp(m), 4) : b;
+    }
+    static constexpr Bytes mod_rm_sib(uint64_t m, uint64_t rrr, const Bytes& b) {
+      return rip_offset(m) ?
+               append(b, (rrr | 0x5) | ((uint64_t)(uint32_t)disp(m) << 8), 5) :
+             !has_base(m) ?
+               append(b, (rrr | 0x4) |
+                         ((has_index(m) ?
+                           scale_bits(m) | ((index(m) << 3) & 0x38) | 0x5 :
+                           0x25) << 8) |
+                         ((uint64_t)(uint32_t)disp(m) << 16), 6) :
+             has_index(m) ?
+               mod_disp(m, append(b, (mod(m) | rrr | 0x4) |
+                 ((scale_bits(m) | ((index(m) << 3) & 0x38) | (base(m) & 0x7)) << 8), 2)) :
+             (base(m) & 0x7) == 0x4 ?
+               mod_disp(m, append(b, (mod(m) | rrr | 0x4) |
+                 ((scale_bits(m) | 0x20 | 0x4) << 8), 2)) :
+               mod_disp(m, append(b, mod(m) | rrr | (base(m) & 0x7)));
+    }
+    static constexpr Bytes modrm(const Instr& i, const Bytes& b) {
+      return enc(i).rm == -1 ? b :
+             mem(i) ? mod_rm_sib(val(i, enc(i).rm), (r(i) << 3) & 0x38, b) :
+             append(b, 0xc0 | ((r(i) << 3) & 0x38) | (val(i, enc(i).rm) & 0x7));
+    }
+
+    // Displacement or immediate bytes
+
+    static constexpr Bytes imm(const Instr& i, const Bytes& b) {
+      return has(i, Encoding::II) ?
+               append(b, (val(i, 1) & 0xffff) | ((val(i, 0) & 0xff) << 16), 3) :
+             enc(i).imm == -1 ? b :
+             has(i, Encoding::LABEL) ?
+               throw std::invalid_argument("StaticAssembler: labels are unsupported") :
+             append(b, val(i, enc(i).imm), enc(i).imm_size);
+    }
+    static constexpr Bytes is4(const Instr& i, const Bytes& b) {
+      return has(i, Encoding::IS4) ? append(b, val(i, 3) << 4) : b;
+    }
+
+    /** Encodes an instruction. */
+    static constexpr Bytes encode(const Instr& i) {
+      return i.opcode_ == LABEL_DEFN || i.opcode_ == P2ALIGN ?
+        throw std::invalid_argument("StaticAssembler: directives are unsupported") :
+        is4(i, imm(i, modrm(i, has(i, Encoding::VEX) ?
+          append(vex(i, group4(i, group2(i, fwait(i, Bytes {{0}, 0})))),
+                 enc(i).opc[0]) :
+          opcode(i, rex(i, group1(i, group3(i, group4(i, group2(i,
+                 fwait(i, Bytes {{0}, 0}))))))))));
+    }
+
+    /** Returns the total length of code[j..k). */
+    static constexpr size_t length(const Instr* code, size_t k, size_t j) {
+      return j == k ? 0 : encode(code[j]).size + length(code, k, j + 1);
+    }
+
+    /** Returns the byte at offset off of code[j..k). */
+    static constexpr uint8_t byte(const Instr* code, size_t k, size_t j,
+                                  size_t off) {
+      return off < encode(code[j]).size ? encode(code[j]).bytes[off] :
+             byte(code, k, j + 1, off - encode(code[j]).size);
+    }
+
+    template <size_t... I>
+    static constexpr std::array<uint8_t, sizeof...(I)> assemble(
+        const Instr* code, size_t k, Indices<I...>) {
+      return std::array<uint8_t, sizeof...(I)> {{byte(code, k, 0, I)...}};
+    }
+};
+
+} // namespace x64asm
+
+#endif
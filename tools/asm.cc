@@ -12,7 +12,32 @@ int parse_error() {
 	return 1;
 }
 
-/** A simple test program. Reads att syntax and prints human readable hex. */
+/** Prints a write error. */
+int write_error() {
+	cerr << "Unable to write object file!" << endl;
+	return 1;
+}
+
+/** Writes an ELF relocatable object. Labels whose names don't begin with '.'
+	  are exported.
+*/
+int write_object(const Code& c, const string& file) {
+	ElfWriter elf;
+	elf.add(Assembler().assemble(c));
+	for (const auto& instr : c) {
+		if (instr.is_label_defn()) {
+			const auto& l = instr.get_operand<Label>(0);
+			if (l.get_text()[0] != '.') {
+				elf.global(l);
+			}
+		}
+	}
+	return elf.write(file) ? 0 : write_error();
+}
+
+/** A simple test program. Reads att syntax and prints human readable hex, or
+	  writes an object file if one is named.
+*/
 int main(int argc, char** argv) {
 	Code c;
 	cin >> c;
@@ -20,6 +45,9 @@ int main(int argc, char** argv) {
 	if (!cin.good())
 		return parse_error();
 
+	if (argc > 1)
+		return write_object(c, argv[1]);
+
 	cout << Assembler().assemble(c) << endl;
 
 	return 0;
@@ -0,0 +1,1973 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "include/x64asm.h"
+#include "src/static_assembler.h"
+
+using namespace std;
+using namespace x64asm;
+
+/** Counts L1 instruction cache misses for the calling thread, or misses in
+	  some other cache such as PERF_COUNT_HW_CACHE_ITLB.
+*/
+class ICacheCounter {
+	public:
+		explicit ICacheCounter(uint64_t cache = PERF_COUNT_HW_CACHE_L1I) {
+			perf_event_attr attr;
+			memset(&attr, 0, sizeof(attr));
+			attr.size = sizeof(attr);
+			attr.type = PERF_TYPE_HW_CACHE;
+			attr.config = cache |
+				(PERF_COUNT_HW_CACHE_OP_READ << 8) |
+				(PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+			attr.disabled = 1;
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+			fd_ = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+		}
+		~ICacheCounter() {
+			if (fd_ != -1) {
+				close(fd_);
+			}
+		}
+
+		/** Returns false if this counter is unavailable on this machine. */
+		bool ok() const {
+			return fd_ != -1;
+		}
+
+		void start() {
+			if (ok()) {
+				ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+				ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+			}
+		}
+		uint64_t stop() {
+			uint64_t val = 0;
+			if (ok()) {
+				ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+				if (read(fd_, &val, sizeof(val)) != sizeof(val)) {
+					val = 0;
+				}
+			}
+			return val;
+		}
+
+	private:
+		int fd_;
+};
+
+/** Returns a random operand of type t. */
+Operand operand(Type t) {
+	switch (t) {
+		case Type::HINT: return rand() % 2 ? taken : not_taken;
+		case Type::IMM_8: return Imm8(rand());
+		case Type::IMM_16: return Imm16(rand());
+		case Type::IMM_32: return Imm32(rand());
+		case Type::IMM_64: return Imm64(((uint64_t)rand() << 32) | rand());
+		case Type::ZERO: return zero;
+		case Type::ONE: return one;
+		case Type::THREE: return three;
+		case Type::LABEL: return Label(".L0");
+		case Type::MM: return mms[rand() % mms.size()];
+		case Type::PREF_66: return pref_66;
+		case Type::PREF_REX_W: return pref_rex_w;
+		case Type::FAR: return far;
+		case Type::MOFFS_8:
+		case Type::MOFFS_16:
+		case Type::MOFFS_32:
+		case Type::MOFFS_64: return Moffs8(Imm64(((uint64_t)rand() << 32) | rand()));
+		case Type::RL: return rls[rand() % rls.size()];
+		case Type::RH: return rhs[rand() % rhs.size()];
+		case Type::RB: return rbs[rand() % rbs.size()];
+		case Type::AL: return al;
+		case Type::CL: return cl;
+		case Type::R_16: return r16s[rand() % r16s.size()];
+		case Type::AX: return ax;
+		case Type::DX: return dx;
+		case Type::R_32: return r32s[rand() % r32s.size()];
+		case Type::EAX: return eax;
+		case Type::R_64: return r64s[rand() % r64s.size()];
+		case Type::RAX: return rax;
+		case Type::REL_8: return Rel8(rand());
+		case Type::REL_32: return Rel32(rand());
+		case Type::SREG: return sregs[rand() % sregs.size()];
+		case Type::FS: return fs;
+		case Type::GS: return gs;
+		case Type::ST: return sts[rand() % sts.size()];
+		case Type::ST_0: return st0;
+		case Type::XMM: return xmms[rand() % xmms.size()];
+		case Type::XMM_0: return xmm0;
+		case Type::YMM: return ymms[rand() % ymms.size()];
+
+		// Everything else is a memory
+		default:
+			break;
+	}
+
+	auto m = M8(sregs[rand() % sregs.size()], r64s[rand() % 16],
+		r64s[rand() % 16], (Scale)(rand() % 4), Imm32(rand() % 2 ? rand() : rand() % 256));
+	m.set_addr_or(rand() % 2);
+	if (rand() % 2) {
+		m.clear_seg();
+	}
+	if (rand() % 2) {
+		m.clear_base();
+	}
+	if (rand() % 2 || m.get_index() == rsp) {
+		m.clear_index();
+	}
+	return m;
+}
+
+/** Returns a random instruction. */
+Instruction instruction() {
+	Instruction instr(NOP);
+	instr.set_opcode((Opcode)(P2ALIGN + 1 + rand() % (XTEST - P2ALIGN)));
+	for (size_t i = 0, ie = instr.arity(); i < ie; ++i) {
+		instr.set_operand(i, operand(instr.type(i)));
+	}
+	return instr;
+}
+
+/** Returns a random code of length n. */
+Code code(size_t n) {
+	Code c;
+	for (size_t i = 0; i < n; ++i) {
+		c.push_back(instruction());
+	}
+	return c;
+}
+
+/** Returns the number of seconds elapsed since start. */
+double since(chrono::steady_clock::time_point start) {
+	const auto d = chrono::steady_clock::now() - start;
+	return chrono::duration_cast<chrono::duration<double>>(d).count();
+}
+
+/** Compares the switch, table, and bulk assembler engines. */
+int engine(size_t n) {
+	const auto c = code(n);
+
+	Assembler sw;
+	Assembler tb;
+	tb.set_engine(Assembler::Engine::TABLE);
+	Assembler bk;
+	bk.set_engine(Assembler::Engine::BULK);
+
+	// Every engine must produce identical bytes
+	Function f1 = sw.assemble(c);
+	Function f2 = tb.assemble(c);
+	Function f3 = bk.assemble(c);
+	size_t diffs = 0;
+	for (const auto& instr : c) {
+		Function g1 = sw.assemble(Code{instr});
+		Function g2 = tb.assemble(Code{instr});
+		Function g3 = bk.assemble(Code{instr});
+		if (g1.size() != g2.size() || memcmp(g1.data(), g2.data(), g1.size()) ||
+				g1.size() != g3.size() || memcmp(g1.data(), g3.data(), g1.size())) {
+			cerr << "Engine disagreement: " << instr << endl;
+			cerr << "  switch: " << g1 << endl;
+			cerr << "  table:  " << g2 << endl;
+			cerr << "  bulk:   " << g3 << endl;
+			++diffs;
+		}
+	}
+
+	const size_t reps = 10;
+	ICacheCounter counter;
+	cout << setw(8) << "engine" << setw(16) << "instrs/sec" << setw(16) << "bytes/sec";
+	cout << setw(16) << "l1i misses" << endl;
+	for (auto* assm : {&sw, &tb, &bk}) {
+		counter.start();
+		const auto start = chrono::steady_clock::now();
+		for (size_t i = 0; i < reps; ++i) {
+			assm->assemble(f1, c);
+		}
+		const auto secs = since(start);
+		const auto misses = counter.stop();
+
+		cout << setw(8) << (assm == &sw ? "switch" : assm == &tb ? "table" : "bulk");
+		cout << setw(16) << (size_t)(reps * n / secs);
+		cout << setw(16) << (size_t)(reps * f1.size() / secs);
+		if (counter.ok()) {
+			cout << setw(16) << misses << endl;
+		} else {
+			cout << setw(16) << "n/a" << endl;
+		}
+	}
+
+	return diffs == 0 && f1 == f2 && f1 == f3 ? 0 : 1;
+}
+
+/** Compares the length oracle against assembled sizes. */
+int length(size_t n) {
+	const auto c = code(n);
+
+	Assembler assm;
+	size_t diffs = 0;
+	for (const auto& instr : c) {
+		const auto f = assm.assemble(Code{instr});
+		if (assm.length(instr) != f.size()) {
+			cerr << "Length disagreement: " << instr << endl;
+			cerr << "  length():   " << assm.length(instr) << endl;
+			cerr << "  assembled:  " << f.size() << endl;
+			++diffs;
+		}
+	}
+
+	const size_t reps = 10;
+	size_t total = 0;
+	auto start = chrono::steady_clock::now();
+	for (size_t i = 0; i < reps; ++i) {
+		total += assm.length(c);
+	}
+	const auto len_secs = since(start);
+
+	Function f(15 * n);
+	start = chrono::steady_clock::now();
+	for (size_t i = 0; i < reps; ++i) {
+		assm.assemble(f, c);
+	}
+	const auto asm_secs = since(start);
+
+	cout << "bytes (exact):     " << total / reps << endl;
+	cout << "bytes (15/instr):  " << 15 * n << endl;
+	cout << "length instrs/sec: " << (size_t)(reps * n / len_secs) << endl;
+	cout << "asm instrs/sec:    " << (size_t)(reps * n / asm_secs) << endl;
+
+	return diffs == 0 ? 0 : 1;
+}
+
+/** Measures batch assembly scaling from 1 to N threads. */
+int scale(size_t n) {
+	vector<Code> codes;
+	for (size_t i = 0; i < n / 32; ++i) {
+		codes.push_back(code(32));
+	}
+
+	// Baseline: one function per code
+	Assembler assm;
+	vector<Function> fxns;
+	auto start = chrono::steady_clock::now();
+	for (const auto& c : codes) {
+		fxns.push_back(assm.assemble(c));
+	}
+	const auto base_secs = since(start);
+	cout << setw(8) << "threads" << setw(16) << "instrs/sec" << setw(10) << "speedup" << endl;
+	cout << setw(8) << "serial" << setw(16) << (size_t)(n / base_secs) << setw(10) << 1.0 << endl;
+
+	size_t diffs = 0;
+	const auto cores = max(1u, thread::hardware_concurrency());
+	for (size_t t = 1; t <= cores; ++t) {
+		Function arena;
+		start = chrono::steady_clock::now();
+		const auto hs = assm.assemble_all(arena, codes, t);
+		const auto secs = since(start);
+		cout << setw(8) << t << setw(16) << (size_t)(n / secs) << setw(10) << base_secs / secs << endl;
+
+		for (size_t i = 0, ie = codes.size(); i < ie; ++i) {
+			if (hs[i].size != fxns[i].size() || memcmp(hs[i].entrypoint, fxns[i].data(), hs[i].size)) {
+				++diffs;
+			}
+		}
+	}
+	if (diffs > 0) {
+		cerr << "Batch assembly disagreements: " << diffs << endl;
+	}
+
+	return diffs == 0 ? 0 : 1;
+}
+
+/** Returns a random code of length n with a label definition in the middle
+	  and periodic jumps to it.
+*/
+Code labeled_code(size_t n) {
+	auto c = code(n);
+	for (size_t i = 3; i < n; i += 8) {
+		c[i] = Instruction(i % 16 == 3 ? JMP_LABEL : JE_LABEL, {Label(".L0")});
+	}
+	c[n / 2] = Instruction(LABEL_DEFN, {Label(".L0")});
+	return c;
+}
+
+/** Writes n bytes of the multi-byte nops which the assembler pads with. */
+void write_nops(char* buf, size_t n) {
+	static const char* nops[9] {
+		"\x90",
+		"\x66\x90",
+		"\x0f\x1f\x00",
+		"\x0f\x1f\x40\x00",
+		"\x0f\x1f\x44\x00\x00",
+		"\x66\x0f\x1f\x44\x00\x00",
+		"\x0f\x1f\x80\x00\x00\x00\x00",
+		"\x0f\x1f\x84\x00\x00\x00\x00\x00",
+		"\x66\x0f\x1f\x84\x00\x00\x00\x00\x00"
+	};
+	while (n > 0) {
+		const auto len = min(n, (size_t)9);
+		memcpy(buf, nops[len-1], len);
+		buf += len;
+		n -= len;
+	}
+}
+
+/** Reassembles random instructions of a function n times with assm, and
+    returns the number of results which disagree with a full assembly.
+*/
+size_t mutations(Assembler& assm, size_t n, double& inc_secs,
+    double& full_secs) {
+	const size_t len = 50;
+	auto c = labeled_code(len);
+
+	assm.set_incremental(true);
+	Function f = assm.assemble(c);
+
+	// Tracks the size of each slot; reassemble() never shrinks a slot
+	vector<size_t> slots;
+	for (const auto& instr : c) {
+		slots.push_back(assm.length(instr));
+	}
+
+	Assembler full;
+	Function g;
+	size_t diffs = 0;
+	for (size_t i = 0; i < n; ++i) {
+		// Leave the label definition and jumps in place
+		auto idx = rand() % len;
+		if (idx == len / 2 || idx % 8 == 3) {
+			idx = 0;
+		}
+		c[idx] = instruction();
+		const auto old_slot = slots[idx];
+		slots[idx] = max(slots[idx], assm.length(c[idx]));
+
+		// Unless the slot grows, the code after it must be left untouched
+		size_t end = old_slot;
+		for (size_t j = 0; j < idx; ++j) {
+			end += slots[j];
+		}
+		const string tail((const char*)f.data() + end, f.size() - end);
+
+		auto start = chrono::steady_clock::now();
+		const auto grown = assm.reassemble(f, c, idx);
+		inc_secs += since(start);
+		diffs += !grown;
+
+		if (slots[idx] == old_slot &&
+		    tail != string((const char*)f.data() + end, f.size() - end)) {
+			++diffs;
+		}
+
+		start = chrono::steady_clock::now();
+		full.assemble(g, c);
+		full_secs += since(start);
+
+		// Check against a full assembly with explicit padding, which keeps
+		// labels in place, once its nops are replaced by multi-byte nops
+		Code padded;
+		for (size_t j = 0; j < len; ++j) {
+			padded.push_back(c[j]);
+			for (size_t k = full.length(c[j]); k < slots[j]; ++k) {
+				padded.push_back(Instruction(NOP));
+			}
+		}
+		const auto h = full.assemble(padded);
+		string expected((const char*)h.data(), h.size());
+		for (size_t j = 0, pos = 0; j < len; ++j) {
+			const auto l = full.length(c[j]);
+			write_nops(&expected[pos + l], slots[j] - l);
+			pos += slots[j];
+		}
+		if (expected != string((const char*)f.data(), f.size())) {
+			++diffs;
+		}
+	}
+	return diffs;
+}
+
+/** Compares incremental reassembly against full reassembly, with and
+    without the encoding cache and the bulk engine, both of which store past
+    the end of instructions.
+*/
+int mutate(size_t n) {
+	Assembler plain;
+	double inc_secs = 0;
+	double full_secs = 0;
+	auto diffs = mutations(plain, n, inc_secs, full_secs);
+
+	Assembler cached;
+	cached.set_cache_size(1024);
+	double cached_secs = 0;
+	double cached_full_secs = 0;
+	diffs += mutations(cached, n, cached_secs, cached_full_secs);
+
+	Assembler bulk;
+	bulk.set_engine(Assembler::Engine::BULK);
+	double bulk_secs = 0;
+	double bulk_full_secs = 0;
+	diffs += mutations(bulk, n, bulk_secs, bulk_full_secs);
+
+	if (diffs > 0) {
+		cerr << "Incremental reassembly disagreements: " << diffs << endl;
+	}
+
+	cout << "full mutations/sec:        " << (size_t)(n / full_secs) << endl;
+	cout << "incremental mutations/sec: " << (size_t)(n / inc_secs) << endl;
+	cout << "cached mutations/sec:      " << (size_t)(n / cached_secs) << endl;
+	cout << "bulk mutations/sec:        " << (size_t)(n / bulk_secs) << endl;
+
+	return diffs == 0 ? 0 : 1;
+}
+
+/** Compares cached assembly against uncached assembly. */
+int cache(size_t n) {
+	// Draw instructions from a small pool to model repeated instances
+	const auto pool = labeled_code(1024);
+	Code c;
+	for (size_t i = 0; i < n; ++i) {
+		c.push_back(pool[rand() % pool.size()]);
+	}
+
+	Assembler plain;
+	Assembler cached;
+	cached.set_cache_size(4096);
+
+	const size_t reps = 10;
+	Function f1 = plain.assemble(c);
+	Function f2 = cached.assemble(c);
+
+	auto start = chrono::steady_clock::now();
+	for (size_t i = 0; i < reps; ++i) {
+		plain.assemble(f1, c);
+	}
+	const auto plain_secs = since(start);
+	start = chrono::steady_clock::now();
+	for (size_t i = 0; i < reps; ++i) {
+		cached.assemble(f2, c);
+	}
+	const auto cached_secs = since(start);
+
+	cout << "uncached instrs/sec: " << (size_t)(reps * n / plain_secs) << endl;
+	cout << "cached instrs/sec:   " << (size_t)(reps * n / cached_secs) << endl;
+	cout << "hits:                " << cached.get_cache_hits() << endl;
+	cout << "misses:              " << cached.get_cache_misses() << endl;
+
+	if (f1.size() != f2.size() || memcmp(f1.data(), f2.data(), f1.size())) {
+		cerr << "Cached assembly disagreement" << endl;
+		return 1;
+	}
+	return 0;
+}
+
+/** Checks that every jump in two assemblies of a code lands on its label,
+    where the second may have relaxed jumps, and that nothing else differs.
+    Returns the number of disagreements.
+*/
+size_t check_relaxed(const Code& c, const Function& f1, const Function& f2) {
+	Assembler assm;
+	const auto b1 = (const uint8_t*)f1.data();
+	const auto b2 = (const uint8_t*)f2.data();
+	size_t diffs = 0;
+	size_t p1 = 0;
+	size_t p2 = 0;
+	size_t label1 = 0;
+	size_t label2 = 0;
+	vector<pair<int64_t, int64_t>> targets;
+	for (const auto& instr : c) {
+		if (instr.is_label_defn()) {
+			label1 = p1;
+			label2 = p2;
+			continue;
+		}
+		const auto len = assm.length(instr);
+		bool label = false;
+		for (size_t i = 0, ie = instr.arity(); i < ie; ++i) {
+			label |= instr.type(i) == Type::LABEL;
+		}
+		if (p1 + len > f1.size() || p2 + (label ? len - 4 : len) > f2.size()) {
+			++diffs;
+			break;
+		} else if (!label) {
+			diffs += memcmp(b1 + p1, b2 + p2, len) != 0;
+			p1 += len;
+			p2 += len;
+			continue;
+		}
+
+		// The rel32 ends the instruction. Relaxation rewrites E9 cd (jmp) as
+		// EB cb, and 0F 8x cd (jcc) as 7x cb, keeping any prefixes.
+		int32_t rel32;
+		memcpy(&rel32, b1 + p1 + len - 4, 4);
+		const auto t1 = (int64_t)(p1 + len) + rel32;
+		const auto jmp = b1[p1 + len - 5] == 0xe9;
+		const auto jcc = len >= 6 && b1[p1 + len - 6] == 0x0f &&
+			(b1[p1 + len - 5] & 0xf0) == 0x80;
+		size_t len2 = len;
+		int64_t t2 = 0;
+		if (jmp && b2[p2 + len - 5] == 0xeb) {
+			len2 = len - 3;
+			diffs += memcmp(b1 + p1, b2 + p2, len - 5) != 0;
+		} else if (jcc && b2[p2 + len - 6] == (0x70 | (b1[p1 + len - 5] & 0x0f))) {
+			len2 = len - 4;
+			diffs += memcmp(b1 + p1, b2 + p2, len - 6) != 0;
+		} else {
+			diffs += memcmp(b1 + p1, b2 + p2, len - 4) != 0;
+		}
+		if (len2 == len) {
+			memcpy(&rel32, b2 + p2 + len - 4, 4);
+			t2 = (int64_t)(p2 + len) + rel32;
+		} else {
+			t2 = (int64_t)(p2 + len2) + (int8_t)b2[p2 + len2 - 1];
+		}
+		targets.push_back({t1, t2});
+		p1 += len;
+		p2 += len2;
+	}
+
+	diffs += p1 != f1.size() || p2 != f2.size();
+	for (const auto& t : targets) {
+		diffs += t.first != (int64_t)label1 || t.second != (int64_t)label2;
+	}
+	return diffs;
+}
+
+/** Compares relaxed and unrelaxed assembly, of single functions and of
+    batches.
+*/
+int relax(size_t n) {
+	const auto c = labeled_code(n);
+
+	Assembler plain;
+	Assembler relaxed;
+	relaxed.set_relaxation(true);
+
+	const size_t reps = 10;
+	Function f1 = plain.assemble(c);
+	Function f2 = relaxed.assemble(c);
+
+	auto start = chrono::steady_clock::now();
+	for (size_t i = 0; i < reps; ++i) {
+		plain.assemble(f1, c);
+	}
+	const auto plain_secs = since(start);
+	start = chrono::steady_clock::now();
+	for (size_t i = 0; i < reps; ++i) {
+		relaxed.assemble(f2, c);
+	}
+	const auto relaxed_secs = since(start);
+
+	// Every jump must still land on the label
+	auto diffs = check_relaxed(c, f1, f2);
+
+	// Batches are placed by the size of their relaxed code
+	Function arena;
+	const auto hs = relaxed.assemble_all(arena, vector<Code>(8, c), 2);
+	for (const auto& h : hs) {
+		diffs += h.size != f2.size() ||
+			memcmp(h.entrypoint, f2.data(), f2.size()) != 0;
+	}
+
+	cout << "bytes:                 " << f1.size() << endl;
+	cout << "relaxed bytes:         " << f2.size() << endl;
+	cout << "instrs/sec:            " << (size_t)(reps * n / plain_secs) << endl;
+	cout << "relaxed instrs/sec:    " << (size_t)(reps * n / relaxed_secs) << endl;
+
+	if (diffs > 0) {
+		cerr << "Relaxation disagreements: " << diffs << endl;
+	}
+	return diffs == 0 && f2.size() < f1.size() ? 0 : 1;
+}
+
+/** Checks alignment directives against the length oracle, with and without
+	  relaxation and batch assembly, and checks that out of range alignments
+	  are rejected.
+*/
+int align(size_t n) {
+	// Align the label definition to 32 bytes and every 64th instruction to
+	// 16, 32 or 64 bytes, sometimes with a limit on padding
+	auto c = labeled_code(n);
+	c.insert(c.begin() + n / 2, Instruction(P2ALIGN, {Imm8(5), Imm8(0)}));
+	for (size_t i = 0; i < c.size(); i += 64) {
+		c.insert(c.begin() + i, Instruction(P2ALIGN, {Imm8(4 + rand() % 3), Imm8(rand() % 2 ? 0 : 15)}));
+	}
+
+	Assembler plain;
+	Assembler relaxed;
+	relaxed.set_relaxation(true);
+	const auto f1 = plain.assemble(c);
+	const auto f2 = relaxed.assemble(c);
+
+	// Batches must match single functions, relaxed or not
+	Function arena;
+	Function relaxed_arena;
+	const auto hs = plain.assemble_all(arena, vector<Code>(8, c), 2);
+	const auto rhs = relaxed.assemble_all(relaxed_arena, vector<Code>(8, c), 2);
+	size_t misaligned = 0;
+	size_t batch_diffs = 0;
+	for (size_t i = 0; i < hs.size(); ++i) {
+		misaligned += (hs[i].offset % 64) != 0 || (rhs[i].offset % 64) != 0;
+		batch_diffs += hs[i].size != f1.size() ||
+			memcmp(hs[i].entrypoint, f1.data(), f1.size()) != 0;
+		batch_diffs += rhs[i].size != f2.size() ||
+			memcmp(rhs[i].entrypoint, f2.data(), f2.size()) != 0;
+	}
+
+	cout << "bytes:         " << f1.size() << endl;
+	cout << "relaxed bytes: " << f2.size() << endl;
+
+	if (f1.size() != plain.length(c)) {
+		cerr << "Alignment length disagreement" << endl;
+		return 1;
+	} else if (misaligned > 0) {
+		cerr << "Misaligned batch entries: " << misaligned << endl;
+		return 1;
+	} else if (batch_diffs > 0) {
+		cerr << "Batch entry disagreements: " << batch_diffs << endl;
+		return 1;
+	}
+	return f2.size() <= f1.size() ? 0 : 1;
+}
+
+/** Measures the cost of jcc erratum mitigation, with and without
+	  relaxation.
+*/
+int jcc(size_t n) {
+	// Every conditional jump follows a fusible compare
+	auto c = labeled_code(n);
+	for (size_t i = 3; i < n; i += 8) {
+		if (c[i].is_jcc() && i != n / 2 + 1) {
+			c[i-1] = Instruction(CMP_R64_R64, {rax, rbx});
+		}
+	}
+
+	Assembler plain;
+	Assembler padded;
+	padded.set_jcc_erratum(true);
+	Assembler relaxed;
+	relaxed.set_jcc_erratum(true);
+	relaxed.set_relaxation(true);
+
+	const size_t reps = 10;
+	Function f1 = plain.assemble(c);
+	Function f2 = padded.assemble(c);
+	Function f3 = relaxed.assemble(c);
+	const auto padding = padded.get_jcc_padding();
+
+	auto start = chrono::steady_clock::now();
+	for (size_t i = 0; i < reps; ++i) {
+		plain.assemble(f1, c);
+	}
+	const auto plain_secs = since(start);
+	start = chrono::steady_clock::now();
+	for (size_t i = 0; i < reps; ++i) {
+		padded.assemble(f2, c);
+	}
+	const auto padded_secs = since(start);
+
+	cout << "bytes:                " << f1.size() << endl;
+	cout << "padded bytes:         " << f2.size() << endl;
+	cout << "padding:              " << padding << endl;
+	cout << "relaxed padded bytes: " << f3.size() << endl;
+	cout << "relaxed padding:      " << relaxed.get_jcc_padding() << endl;
+	cout << "instrs/sec:           " << (size_t)(reps * n / plain_secs) << endl;
+	cout << "padded instrs/sec:    " << (size_t)(reps * n / padded_secs) << endl;
+
+	if (f2.size() != padded.length(c) || f2.size() != f1.size() + padding) {
+		cerr << "Jcc erratum length disagreement" << endl;
+		return 1;
+	}
+	return 0;
+}
+
+/** A prologue and epilogue which is assembled at compile time. */
+constexpr StaticAssembler::Instr stub_[] {
+	{PUSH_R64, Constants::rbp()},
+	{MOV_R64_R64, Constants::rbp(), Constants::rsp()},
+	{MOV_R64_M64, Constants::rax(), M64(Constants::rsp(), Imm32(16))},
+	{MOV_R64_M64, Constants::r12(), M64(Constants::r13(), Constants::r9(), Scale::TIMES_4, Imm32(0x1000))},
+	{POP_R64, Constants::rbp()},
+	{RET}
+};
+constexpr auto stub_bytes_ = StaticAssembler::assemble<StaticAssembler::length(stub_)>(stub_);
+
+/** Compares compile-time assembly against the runtime assembler. */
+int stub(size_t n) {
+	const Code c {
+		Instruction(PUSH_R64, {rbp}),
+		Instruction(MOV_R64_R64, {rbp, rsp}),
+		Instruction(MOV_R64_M64, {rax, M64(rsp, Imm32(16))}),
+		Instruction(MOV_R64_M64, {r12, M64(r13, r9, Scale::TIMES_4, Imm32(0x1000))}),
+		Instruction(POP_R64, {rbp}),
+		Instruction(RET)
+	};
+
+	Assembler assm;
+	Function f = assm.assemble(c);
+	Function g;
+
+	auto start = chrono::steady_clock::now();
+	for (size_t i = 0; i < n; ++i) {
+		assm.assemble(f, c);
+	}
+	const auto assm_secs = since(start);
+	start = chrono::steady_clock::now();
+	for (size_t i = 0; i < n; ++i) {
+		g.clear();
+		g.emit_bytes(stub_bytes_.data(), stub_bytes_.size());
+	}
+	const auto static_secs = since(start);
+
+	cout << "assembled stubs/sec: " << (size_t)(n / assm_secs) << endl;
+	cout << "static stubs/sec:    " << (size_t)(n / static_secs) << endl;
+
+	if (f != g) {
+		cerr << "Static assembly disagreement" << endl;
+		cerr << "  assembled: " << f << endl;
+		cerr << "  static:    " << g << endl;
+		return 1;
+	}
+	return 0;
+}
+
+/** Returns the number of instructions that objdump finds in a file, or -1
+	  if objdump is unavailable.
+*/
+int objdump(const string& file) {
+	const auto cmd = "objdump -D -b binary -mi386:x86-64 " + file + " 2>/dev/null";
+	auto* p = popen(cmd.c_str(), "r");
+	if (p == nullptr) {
+		return -1;
+	}
+	// Instruction lines look like "   0:\t48 89 e5 \tmov %rsp,%rbp"
+	int instrs = 0;
+	char line[256];
+	while (fgets(line, sizeof(line), p) != nullptr) {
+		const auto tab = strchr(line, '\t');
+		instrs += tab != nullptr && strchr(tab + 1, '\t') != nullptr;
+	}
+	return pclose(p) == 0 ? instrs : -1;
+}
+
+/** Checks that every instruction decodes to an instruction with identical
+	  encoding, and compares decoder throughput against parsing objdump output.
+	  Then streams the executable sections of this benchmark through
+	  ElfReader, and reports throughput and the share of bytes which decode
+	  rather than being skipped.
+*/
+int decode(size_t n) {
+	const auto c = code(n);
+
+	Assembler assm;
+	Decoder decoder;
+	size_t diffs = 0;
+	for (const auto& instr : c) {
+		const auto f = assm.assemble(Code{instr});
+		const auto begin = (const uint8_t*)f.data();
+		Instruction d(NOP);
+		if (decoder.decode(d, begin, begin + f.size()) != f.size() ||
+				assm.assemble(Code{d}) != f) {
+			cerr << "Decoder disagreement: " << instr << endl;
+			cerr << "  bytes:   " << f << endl;
+			cerr << "  decoded: " << d << endl;
+			++diffs;
+		}
+	}
+
+	const size_t reps = 10;
+	const auto f = assm.assemble(c);
+	Code d;
+	auto start = chrono::steady_clock::now();
+	for (size_t i = 0; i < reps; ++i) {
+		d.clear();
+		decoder.decode(d, f);
+	}
+	const auto dec_secs = since(start);
+	if (assm.assemble(d) != f) {
+		cerr << "Decoder disagreement on complete code" << endl;
+		++diffs;
+	}
+
+	char file[] = "/tmp/x64asm_decode_XXXXXX";
+	const auto fd = mkstemp(file);
+	const auto ok = fd != -1 && write(fd, f.data(), f.size()) == (ssize_t)f.size();
+	if (fd != -1) {
+		close(fd);
+	}
+	start = chrono::steady_clock::now();
+	const auto instrs = ok ? objdump(file) : -1;
+	const auto obj_secs = since(start);
+	unlink(file);
+
+	// Compiler output uses instructions which the assembler never emits, so
+	// this benchmark's own executable is decoded as well
+	ElfReader self;
+	if (!self.open("/proc/self/exe")) {
+		cerr << "Unable to read bin/bench" << endl;
+		return 1;
+	}
+	uint64_t elf_bytes = 0;
+	for (const auto& s : self.sections()) {
+		elf_bytes += s.size;
+	}
+	uint64_t elf_decoded = 0;
+	size_t elf_instrs = 0;
+	start = chrono::steady_clock::now();
+	for (Code chunk; ; ) {
+		LabelScope scope;
+		if (!self.next(chunk)) {
+			break;
+		}
+		elf_decoded += self.chunk_size();
+		for (const auto& instr : chunk) {
+			elf_instrs += !instr.is_label_defn();
+		}
+	}
+	const auto elf_secs = since(start);
+
+	cout << "bytes:             " << f.size() << endl;
+	cout << "instrs:            " << d.size() << endl;
+	cout << "decoder MB/sec:    " << reps * f.size() / dec_secs / 1e6 << endl;
+	if (instrs == -1) {
+		cout << "objdump MB/sec:    n/a" << endl;
+	} else {
+		cout << "objdump MB/sec:    " << f.size() / obj_secs / 1e6 << endl;
+		cout << "objdump instrs:    " << instrs << endl;
+	}
+	cout << "elf bytes:         " << elf_bytes << endl;
+	cout << "elf instrs:        " << elf_instrs << endl;
+	cout << "elf decoded bytes: " << elf_decoded << endl;
+	cout << "elf skipped bytes: " << self.skipped() << endl;
+	cout << "elf decoded:       " << 100.0 * elf_decoded / max(elf_bytes, (uint64_t)1) << "%" << endl;
+	cout << "elf MB/sec:        " << elf_bytes / elf_secs / 1e6 << endl;
+
+	return diffs == 0 ? 0 : 1;
+}
+
+/** Checks the vector length decoders against the scalar length decoder and
+	  the assembler, and compares their throughput.
+*/
+int boundary(size_t n) {
+	const auto c = code(n);
+
+	Assembler assm;
+	vector<uint32_t> expected;
+	size_t pos = 0;
+	for (const auto& instr : c) {
+		expected.push_back(pos);
+		pos += assm.length(instr);
+	}
+	const auto f = assm.assemble(c);
+	const auto begin = (const uint8_t*)f.data();
+	const auto end = begin + f.size();
+
+	const size_t reps = 10;
+	size_t diffs = 0;
+	cout << setw(8) << "engine" << setw(16) << "instrs/sec" << setw(16) << "bytes/sec" << endl;
+	for (auto e : {LengthDecoder::Engine::SCALAR, LengthDecoder::Engine::SSSE3, LengthDecoder::Engine::AVX2}) {
+		LengthDecoder ld;
+		ld.set_engine(e);
+		if (ld.get_engine() != e) {
+			continue;
+		}
+
+		// Every engine must agree with the assembler...
+		vector<uint32_t> offs;
+		if (!ld.scan(begin, end, offs) || offs != expected) {
+			cerr << "Length decoder disagreement with assembler" << endl;
+			++diffs;
+		}
+		// ... and with the scalar engine on arbitrary bytes
+		LengthDecoder scalar;
+		scalar.set_engine(LengthDecoder::Engine::SCALAR);
+		for (size_t i = 0; i < 100; ++i) {
+			vector<uint8_t> bytes(1024);
+			for (auto& b : bytes) {
+				b = rand() % 2 ? begin[rand() % f.size()] : rand();
+			}
+			vector<uint32_t> o1;
+			vector<uint32_t> o2;
+			const auto ok1 = ld.scan(bytes.data(), bytes.data() + bytes.size(), o1);
+			const auto ok2 = scalar.scan(bytes.data(), bytes.data() + bytes.size(), o2);
+			if (ok1 != ok2 || o1 != o2) {
+				cerr << "Length decoder disagreement with scalar engine" << endl;
+				++diffs;
+			}
+		}
+
+		const auto start = chrono::steady_clock::now();
+		for (size_t i = 0; i < reps; ++i) {
+			offs.clear();
+			ld.scan(begin, end, offs);
+		}
+		const auto secs = since(start);
+
+		cout << setw(8) << (e == LengthDecoder::Engine::SCALAR ? "scalar" : e == LengthDecoder::Engine::SSSE3 ? "ssse3" : "avx2");
+		cout << setw(16) << (size_t)(reps * n / secs);
+		cout << setw(16) << (size_t)(reps * f.size() / secs) << endl;
+	}
+
+	return diffs == 0 ? 0 : 1;
+}
+
+/** Measures label resolution on code which defines and references many
+	  labels. Checks every displacement, both within a function and across a
+	  pair of functions joined by the linker.
+*/
+int labels(size_t n) {
+	// Every eighth instruction defines a label, and every eighth jumps to one
+	vector<Label> ls;
+	for (size_t i = 0; i < n; i += 8) {
+		ls.push_back(Label(".labels_" + to_string(i / 8)));
+	}
+	auto c = code(n);
+	vector<size_t> targets(n, ls.size());
+	for (size_t i = 0; i < n; ++i) {
+		if (i % 8 == 0) {
+			c[i] = Instruction(LABEL_DEFN, {ls[i / 8]});
+		} else if (i % 8 == 4) {
+			targets[i] = rand() % ls.size();
+			c[i] = Instruction(JMP_LABEL, {ls[targets[i]]});
+		}
+	}
+	c[1] = Instruction(LABEL_DEFN, {Label(".L0")});
+
+	Assembler assm;
+	const size_t reps = 10;
+	Function f = assm.assemble(c);
+	auto start = chrono::steady_clock::now();
+	for (size_t i = 0; i < reps; ++i) {
+		assm.assemble(f, c);
+	}
+	const auto secs = since(start);
+
+	// Small functions assembled into a function which once held many labels
+	const size_t len = 64;
+	vector<Code> small;
+	for (size_t i = 0; i + len <= n; i += len) {
+		small.push_back(Code(c.begin() + i, c.begin() + i + len));
+	}
+	start = chrono::steady_clock::now();
+	for (const auto& s : small) {
+		assm.assemble(f, s);
+	}
+	const auto small_secs = since(start);
+	assm.assemble(f, c);
+
+	// Compares the target of every jump to the address of its label
+	const auto check = [&](const vector<pair<size_t, const Function*>>& parts) {
+		vector<uint64_t> defs(ls.size());
+		vector<pair<const unsigned char*, size_t>> jumps;
+		size_t i = 0;
+		for (const auto& p : parts) {
+			auto addr = (const unsigned char*)p.second->data();
+			for (const auto ie = i + p.first; i < ie; ++i) {
+				if (i % 8 == 0) {
+					defs[i / 8] = (uint64_t)addr;
+				}
+				addr += assm.length(c[i]);
+				if (targets[i] != ls.size()) {
+					jumps.push_back(make_pair(addr, targets[i]));
+				}
+			}
+		}
+		size_t diffs = 0;
+		for (const auto& j : jumps) {
+			int32_t rel;
+			memcpy(&rel, j.first - 4, 4);
+			diffs += (uint64_t)(j.first + rel) != defs[j.second];
+		}
+		return diffs;
+	};
+
+	// Split the code in two and resolve references between the halves
+	const auto half = n / 2;
+	Function f1 = assm.assemble(Code(c.begin(), c.begin() + half));
+	Function f2 = assm.assemble(Code(c.begin() + half, c.end()));
+	Linker lnkr;
+	lnkr.start();
+	lnkr.link(f1);
+	lnkr.link(f2);
+	lnkr.finish();
+
+	const auto diffs = check({{n, &f}});
+	const auto link_diffs = check({{half, &f1}, {n - half, &f2}});
+
+	cout << "labels:          " << ls.size() << endl;
+	cout << "instrs/sec:      " << (size_t)(reps * n / secs) << endl;
+	cout << "small fxns/sec:  " << (size_t)(small.size() / small_secs) << endl;
+	cout << "diffs:           " << diffs << endl;
+	cout << "linked diffs:    " << link_diffs << endl;
+
+	return diffs == 0 && link_diffs == 0 && lnkr.good() ? 0 : 1;
+}
+
+/** Creates and prints labels in per-thread scopes. Checks that names are
+	  private to a scope and that printed names map back to their labels.
+*/
+int scopes(size_t n) {
+	const size_t threads = max(2u, thread::hardware_concurrency());
+	vector<size_t> errors(threads, 0);
+	vector<uint64_t> firsts(threads);
+
+	const auto start = chrono::steady_clock::now();
+	vector<thread> ts;
+	for (size_t t = 0; t < threads; ++t) {
+		ts.emplace_back([n, t, &errors, &firsts] {
+			LabelScope scope;
+			vector<Label> ls;
+			for (size_t i = 0; i < n; ++i) {
+				ls.push_back(i % 2 ? Label() : Label(".scope_" + to_string(i)));
+			}
+			for (const auto& l : ls) {
+				errors[t] += Label(l.get_text()) != l;
+			}
+			errors[t] += scope.size() != n;
+			{
+				LabelScope inner;
+				errors[t] += Label(".scope_0") == ls[0];
+				errors[t] += ls[0].get_text() != ".scope_0";
+			}
+			firsts[t] = ls[0];
+		});
+	}
+	for (auto& t : ts) {
+		t.join();
+	}
+	const auto secs = since(start);
+
+	size_t errs = 0;
+	for (size_t t = 0; t < threads; ++t) {
+		errs += errors[t];
+		errs += count(firsts.begin(), firsts.end(), firsts[t]) != 1;
+	}
+
+	cout << "threads:    " << threads << endl;
+	cout << "labels/sec: " << (size_t)(threads * n / secs) << endl;
+	cout << "errors:     " << errs << endl;
+
+	return errs == 0 ? 0 : 1;
+}
+
+/** Compares assembling into functions which grow on demand against
+	  reserving their exact length up front. Checks that both produce
+	  identical bytes with every engine.
+*/
+int grow(size_t n) {
+	const auto c = code(n);
+
+	Assembler sw;
+	Assembler tb;
+	tb.set_engine(Assembler::Engine::TABLE);
+	Assembler bk;
+	bk.set_engine(Assembler::Engine::BULK);
+
+	const size_t reps = 10;
+	size_t diffs = 0;
+	cout << setw(8) << "engine" << setw(16) << "grown/sec" << setw(16) << "reserved/sec";
+	cout << setw(12) << "capacity" << endl;
+	for (auto* assm : {&sw, &tb, &bk}) {
+		auto start = chrono::steady_clock::now();
+		for (size_t i = 0; i < reps; ++i) {
+			Function f(1);
+			assm->assemble(f, c);
+		}
+		const auto grown_secs = since(start);
+		start = chrono::steady_clock::now();
+		for (size_t i = 0; i < reps; ++i) {
+			Function f(1);
+			assm->reserve(f, c);
+			assm->assemble(f, c);
+		}
+		const auto reserved_secs = since(start);
+
+		Function f1(1);
+		assm->assemble(f1, c);
+		Function f2(1);
+		assm->reserve(f2, c);
+		assm->assemble(f2, c);
+		diffs += f1 != f2;
+
+		cout << setw(8) << (assm == &sw ? "switch" : assm == &tb ? "table" : "bulk");
+		cout << setw(16) << (size_t)(reps * n / grown_secs);
+		cout << setw(16) << (size_t)(reps * n / reserved_secs);
+		cout << setw(12) << f1.capacity() << endl;
+	}
+
+	return diffs == 0 ? 0 : 1;
+}
+
+/** Returns the resident set size of this process in bytes. */
+size_t resident() {
+	size_t pages = 0;
+	size_t rss = 0;
+	if (auto* f = fopen("/proc/self/statm", "r")) {
+		if (fscanf(f, "%zu %zu", &pages, &rss) != 2) {
+			rss = 0;
+		}
+		fclose(f);
+	}
+	return rss * sysconf(_SC_PAGESIZE);
+}
+
+/** Holds n small functions, first in their own mappings and then in an arena,
+	  and compares the mmap calls and resident memory that each requires. Checks
+	  that every function returns its own index.
+*/
+int arena(size_t n) {
+	Assembler assm;
+	Code c {
+		Instruction(MOV_R64_IMM64, {rax, Imm64(0)}),
+		Instruction(RET)
+	};
+
+	size_t errs = 0;
+	size_t rss = resident();
+	auto start = chrono::steady_clock::now();
+	size_t own_rss = 0;
+	{
+		vector<Function> fs;
+		fs.reserve(n);
+		for (size_t i = 0; i < n; ++i) {
+			c[0].set_operand(1, Imm64(i));
+			fs.emplace_back(assm.assemble(c));
+		}
+		for (size_t i = 0; i < n; ++i) {
+			errs += fs[i].call<uint64_t>() != i;
+		}
+		own_rss = resident() - rss;
+	}
+	const auto own_secs = since(start);
+
+	rss = resident();
+	start = chrono::steady_clock::now();
+	size_t arena_rss = 0;
+	CodeArena ca;
+	{
+		vector<Function> fs;
+		fs.reserve(n);
+		for (size_t i = 0; i < n; ++i) {
+			c[0].set_operand(1, Imm64(i));
+			fs.emplace_back(ca, assm.length(c));
+			assm.assemble(fs.back(), c);
+		}
+		for (size_t i = 0; i < n; ++i) {
+			errs += fs[i].call<uint64_t>() != i;
+		}
+		arena_rss = resident() - rss;
+	}
+	const auto arena_secs = since(start);
+
+	// Both views of an arena page are counted by the resident set size, even
+	// though they share the same physical page.
+	cout << "functions:          " << n << endl;
+	cout << "dual mapped:        " << (ca.dual_mapped() ? "yes" : "no") << endl;
+	cout << "own mmap calls:     " << n << endl;
+	cout << "arena mmap calls:   " << ca.mmap_calls() << endl;
+	cout << "own rss kB:         " << own_rss / 1024 << endl;
+	cout << "arena rss kB:       " << arena_rss / 1024 << endl;
+	cout << "arena mapped kB:    " << ca.mapped_bytes() / 1024 << endl;
+	cout << "own fxns/sec:       " << (size_t)(n / own_secs) << endl;
+	cout << "arena fxns/sec:     " << (size_t)(n / arena_secs) << endl;
+	cout << "errors:             " << errs << endl;
+
+	return errs == 0 && ca.used_bytes() == 0 ? 0 : 1;
+}
+
+/** Returns the number of bytes of memory in this process which are backed
+	  by huge pages, or zero if this can't be determined.
+*/
+size_t huge_resident() {
+	ifstream ifs("/proc/self/smaps_rollup");
+	size_t total = 0;
+	for (string line; getline(ifs, line); ) {
+		if (line.find("AnonHugePages:") == 0 || line.find("ShmemPmdMapped:") == 0 ||
+				line.find("Shared_Hugetlb:") == 0 || line.find("Private_Hugetlb:") == 0) {
+			total += strtoull(line.c_str() + line.find(':') + 1, nullptr, 10) * 1024;
+		}
+	}
+	return total;
+}
+
+/** Calls n small functions in random order, from arenas with and without
+	  huge pages. Each function occupies its own kilobyte, so calls are
+	  scattered over many pages. Checks that every function returns its own
+	  index.
+*/
+int huge(size_t n) {
+	Assembler assm;
+	Code c {
+		Instruction(MOV_R64_IMM64, {rax, Imm64(0)}),
+		Instruction(RET)
+	};
+
+	vector<size_t> order(n);
+	for (size_t i = 0; i < n; ++i) {
+		order[i] = i;
+	}
+	random_shuffle(order.begin(), order.end());
+
+	const size_t reps = 10;
+	size_t errs = 0;
+	cout << setw(8) << "huge" << setw(8) << "w^x" << setw(12) << "huge kB";
+	cout << setw(16) << "calls/sec" << setw(16) << "itlb misses" << endl;
+	for (auto huge_pages : {false, true}) {
+		CodeArena ca(64 << 20, huge_pages);
+		vector<Function> fs;
+		fs.reserve(n);
+		for (size_t i = 0; i < n; ++i) {
+			c[0].set_operand(1, Imm64(i));
+			fs.emplace_back(ca);
+			assm.assemble(fs.back(), c);
+		}
+
+		ICacheCounter counter(PERF_COUNT_HW_CACHE_ITLB);
+		counter.start();
+		const auto start = chrono::steady_clock::now();
+		uint64_t sum = 0;
+		for (size_t r = 0; r < reps; ++r) {
+			for (auto i : order) {
+				sum += fs[i].call<uint64_t>();
+			}
+		}
+		const auto secs = since(start);
+		const auto misses = counter.stop();
+		errs += sum != reps * (n * (n - 1) / 2);
+
+		cout << setw(8) << (ca.huge_pages() ? "yes" : "no");
+		cout << setw(8) << (ca.dual_mapped() ? "yes" : "no");
+		cout << setw(12) << huge_resident() / 1024;
+		cout << setw(16) << (size_t)(reps * n / secs);
+		if (counter.ok()) {
+			cout << setw(16) << misses << endl;
+		} else {
+			cout << setw(16) << "n/a" << endl;
+		}
+	}
+
+	return errs == 0 ? 0 : 1;
+}
+
+/** Looks up codes drawn from a pool of distinct codes, favoring some over
+	  others, from several threads which share a cache that only has room for
+	  half of the pool. Checks cached functions against fresh assembly.
+*/
+int codecache(size_t n) {
+	const size_t threads = max(2u, thread::hardware_concurrency());
+	const size_t distinct = max((size_t)1, n / 100);
+	vector<Code> pool;
+	for (size_t i = 0; i < distinct; ++i) {
+		pool.push_back(code(32));
+	}
+	// Squaring a uniform draw favors low indices
+	vector<vector<size_t>> lookups(threads);
+	for (auto& l : lookups) {
+		for (size_t i = 0; i < n / threads; ++i) {
+			const auto r = (size_t)rand() % distinct;
+			l.push_back(r * r / distinct);
+		}
+	}
+
+	CodeArena arena;
+	CodeCache cache(distinct / 2 * 1024, 16, &arena);
+	vector<size_t> errors(threads, 0);
+
+	auto start = chrono::steady_clock::now();
+	vector<thread> ts;
+	for (size_t t = 0; t < threads; ++t) {
+		ts.emplace_back([t, &pool, &lookups, &cache, &errors] {
+			Assembler assm;
+			for (auto i : lookups[t]) {
+				errors[t] += !cache.get(pool[i], assm)->good();
+			}
+		});
+	}
+	for (auto& t : ts) {
+		t.join();
+	}
+	const auto cached_secs = since(start);
+
+	Assembler assm;
+	Function f;
+	start = chrono::steady_clock::now();
+	for (auto i : lookups[0]) {
+		assm.assemble(f, pool[i]);
+	}
+	const auto plain_secs = since(start);
+
+	size_t errs = 0;
+	for (auto e : errors) {
+		errs += e;
+	}
+	for (const auto& c : pool) {
+		errs += *cache.get(c, assm) != assm.assemble(c);
+	}
+
+	cout << "threads:                 " << threads << endl;
+	cout << "cached lookups/sec:      " << (size_t)(threads * lookups[0].size() / cached_secs) << endl;
+	cout << "uncached assemblies/sec: " << (size_t)(lookups[0].size() / plain_secs) << " (1 thread)" << endl;
+	cout << "hit rate:                " << cache.hit_rate() << endl;
+	cout << "evictions:               " << cache.evictions() << endl;
+	cout << "bytes:                   " << cache.bytes() << " / " << cache.budget() << endl;
+	cout << "errors:                  " << errs << endl;
+
+	return errs == 0 ? 0 : 1;
+}
+
+/** Returns a random code of length n without label operands. */
+Code unlabeled_code(size_t n) {
+	Code c;
+	while (c.size() < n) {
+		const auto instr = instruction();
+		bool label = false;
+		for (size_t i = 0, ie = instr.arity(); i < ie; ++i) {
+			label |= instr.type(i) == Type::LABEL;
+		}
+		if (!label) {
+			c.push_back(instr);
+		}
+	}
+	return c;
+}
+
+/** Assembles stubs, writes them to an image, and compares loading the image
+	  against assembling the stubs again. One stub jumps to a label outside the
+	  image, and one jumps to a label defined by another stub. Checks that
+	  loaded stubs match assembled stubs, that both jumps land, and that
+	  stubs are only found for a cpu with the flags they require.
+*/
+int image(size_t n) {
+	const Label ext(".image_ext");
+	const Label fn(".image_fn");
+	vector<Code> codes {
+		{Instruction(JMP_LABEL, {ext})},
+		{Instruction(LABEL_DEFN, {fn}), Instruction(RET)},
+		{Instruction(JMP_LABEL, {fn})}
+	};
+	while (codes.size() < max((size_t)4, n / 10)) {
+		codes.push_back(unlabeled_code(10));
+	}
+
+	Assembler assm;
+	auto start = chrono::steady_clock::now();
+	vector<Function> fs;
+	for (const auto& c : codes) {
+		fs.push_back(assm.assemble(c));
+	}
+	const auto cold_secs = since(start);
+
+	char file[] = "/tmp/x64asm_image_XXXXXX";
+	const auto fd = mkstemp(file);
+	if (fd == -1) {
+		cerr << "Unable to create image file" << endl;
+		return 1;
+	}
+	close(fd);
+	ImageWriter writer;
+	for (size_t i = 0, ie = codes.size(); i < ie; ++i) {
+		writer.add(codes[i], assm, fs[i]);
+	}
+	const auto written = writer.write(file);
+
+	// A warm start maps the image, links it, and finds every stub
+	Function target = assm.assemble(Code{Instruction(RET)});
+	start = chrono::steady_clock::now();
+	ImageLoader loader;
+	auto loaded = written && loader.open(file);
+	loader.define(ext, target.data());
+	loaded = loaded && loader.link();
+	// Stubs are compared rather than run, so any cpu flags will do
+	vector<void*> entries;
+	for (const auto& c : codes) {
+		entries.push_back(loader.find(c, assm, FlagSet::universe()));
+	}
+	const auto warm_secs = since(start);
+	unlink(file);
+
+	if (!loaded) {
+		cerr << "Unable to write or load image" << endl;
+		return 1;
+	}
+
+	// Jumps are E9 rel32
+	const auto jump = [](const void* p) {
+		int32_t rel;
+		memcpy(&rel, (const uint8_t*)p + 1, 4);
+		return (const uint8_t*)p + 5 + rel;
+	};
+	size_t diffs = 0;
+	diffs += jump(entries[0]) != target.data();
+	diffs += jump(entries[2]) != entries[1] || loader.address(fn) != entries[1];
+	for (size_t i = 3, ie = codes.size(); i < ie; ++i) {
+		diffs += entries[i] == nullptr ||
+			memcmp(entries[i], fs[i].data(), fs[i].size()) != 0;
+		// A cpu without flags only runs stubs which require none
+		const auto bare = loader.find(codes[i], assm, FlagSet::empty());
+		diffs += (bare != nullptr) != (codes[i].required_flags() == FlagSet::empty());
+	}
+
+	cout << "stubs:               " << codes.size() << endl;
+	cout << "relocations:         " << loader.relocations() << endl;
+	cout << "assembled stubs/sec: " << (size_t)(codes.size() / cold_secs) << endl;
+	cout << "loaded stubs/sec:    " << (size_t)(codes.size() / warm_secs) << endl;
+	cout << "diffs:               " << diffs << endl;
+
+	return diffs == 0 ? 0 : 1;
+}
+
+/** Assembles functions, each under an exported label, writes them to an ELF
+	  object, and reads the object back. One function jumps to a label outside
+	  the object, and one jumps to a label defined by another function. Checks
+	  that symbols cover their functions, that code is unchanged, that the
+	  internal jump lands, and that the external jump is left for the linker.
+	  Then reads this benchmark's own executable a chunk at a time, each in a
+	  label scope of its own, and checks that nearly every function symbol is
+	  labeled and that no names are left behind.
+*/
+int elf(size_t n) {
+	const Label ext("x64asm_elf_ext");
+	vector<Label> labels;
+	vector<Code> codes;
+	for (size_t i = 0, ie = max((size_t)4, n / 10); i < ie; ++i) {
+		labels.push_back(Label("x64asm_elf_" + to_string(i)));
+		codes.push_back({Instruction(LABEL_DEFN, {labels.back()})});
+	}
+	codes[0].push_back(Instruction(JMP_LABEL, {ext}));
+	codes[1].push_back(Instruction(RET));
+	codes[2].push_back(Instruction(JMP_LABEL, {labels[1]}));
+	for (size_t i = 3, ie = codes.size(); i < ie; ++i) {
+		for (const auto& instr : unlabeled_code(10)) {
+			codes[i].push_back(instr);
+		}
+	}
+
+	Assembler assm;
+	vector<Function> fs;
+	for (const auto& c : codes) {
+		fs.push_back(assm.assemble(c));
+	}
+
+	char file[] = "/tmp/x64asm_elf_XXXXXX";
+	const auto fd = mkstemp(file);
+	if (fd == -1) {
+		cerr << "Unable to create object file" << endl;
+		return 1;
+	}
+	close(fd);
+	const auto start = chrono::steady_clock::now();
+	ElfWriter writer;
+	for (size_t i = 0, ie = codes.size(); i < ie; ++i) {
+		writer.add(fs[i]);
+		writer.global(labels[i]);
+	}
+	const auto written = writer.write(file);
+	const auto secs = since(start);
+
+	ElfReader reader;
+	const auto read = written && reader.open(file);
+	ifstream ifs(file, ios::binary);
+	const string contents((istreambuf_iterator<char>(ifs)),
+	                      istreambuf_iterator<char>());
+	unlink(file);
+
+	if (!read || reader.sections().size() != 1) {
+		cerr << "Unable to write or read object file" << endl;
+		return 1;
+	}
+
+	// Jumps are E9 rel32
+	const auto text = (const uint8_t*)contents.data() + reader.sections()[0].offset;
+	const auto disp = [text](uint64_t addr) {
+		int32_t rel;
+		memcpy(&rel, text + addr + 1, 4);
+		return rel;
+	};
+	size_t diffs = reader.symbols().size() != codes.size();
+	vector<uint64_t> addrs;
+	for (size_t i = 0, ie = codes.size(); i < ie; ++i) {
+		const auto sym = reader.find_symbol(labels[i].get_text());
+		if (sym == nullptr || sym->size != fs[i].size()) {
+			++diffs;
+			addrs.push_back(0);
+			continue;
+		}
+		addrs.push_back(sym->addr);
+		if (i >= 3) {
+			diffs += memcmp(text + sym->addr, fs[i].data(), fs[i].size()) != 0;
+		}
+	}
+	diffs += disp(addrs[0]) != 0;
+	diffs += addrs[2] + 5 + disp(addrs[2]) != addrs[1];
+
+	// This benchmark is itself compiled code, whose functions may start with
+	// bytes the decoder rejects, such as endbr64. Nearly every function must
+	// still be labeled in the stream.
+	ElfReader self;
+	if (!self.open("/proc/self/exe")) {
+		cerr << "Unable to read bin/bench" << endl;
+		return 1;
+	}
+	// Symbol names are interned in a scope per chunk, so none may outlive it
+	LabelScope outer;
+	unordered_map<string, size_t> labeled;
+	uint64_t decoded = 0;
+	for (Code chunk; ; ) {
+		LabelScope scope;
+		if (!self.next(chunk)) {
+			break;
+		}
+		decoded += self.chunk_size();
+		for (const auto& instr : chunk) {
+			if (instr.is_label_defn()) {
+				++labeled[instr.get_operand<Label>(0).get_text()];
+			}
+		}
+	}
+	diffs += outer.size() != 0;
+	size_t unlabeled = 0;
+	for (const auto& sym : self.symbols()) {
+		unlabeled += labeled.find(sym.name) == labeled.end();
+	}
+	diffs += labeled.find("main") == labeled.end();
+	diffs += 10 * unlabeled > self.symbols().size();
+
+	cout << "functions:     " << codes.size() << endl;
+	cout << "object bytes:  " << contents.size() << endl;
+	cout << "functions/sec: " << (size_t)(codes.size() / secs) << endl;
+	cout << "bench symbols: " << self.symbols().size() << endl;
+	cout << "unlabeled:     " << unlabeled << endl;
+	cout << "decoded bytes: " << decoded << endl;
+	cout << "skipped bytes: " << self.skipped() << endl;
+	cout << "diffs:         " << diffs << endl;
+
+	return diffs == 0 ? 0 : 1;
+}
+
+/** Links n small functions which jump to one another, in a batch with one
+	  thread, in a batch with one thread per core, and one function at a time.
+	  One reference is left undefined by the batch and resolved by adding one
+	  more function afterwards. Checks that every jump lands on its target,
+	  and that a function which redefines a label defines none of its labels.
+*/
+int linker(size_t n) {
+	n = max(n, (size_t)2);
+	vector<Label> labels;
+	for (size_t i = 0; i < n; ++i) {
+		labels.push_back(Label("x64asm_link_" + to_string(i)));
+	}
+	const Label late("x64asm_link_late");
+
+	// Function i jumps to function 7i+1, or to the late label if i is 0
+	CodeArena arena;
+	Assembler assm;
+	vector<Function> fs;
+	vector<size_t> targets;
+	for (size_t i = 0; i < n; ++i) {
+		targets.push_back(i == 0 ? n : (7 * i + 1) % n);
+		fs.emplace_back(arena, 64);
+		assm.assemble(fs.back(), {
+			Instruction(LABEL_DEFN, {labels[i]}),
+			Instruction(JMP_LABEL, {i == 0 ? late : labels[targets.back()]}),
+			Instruction(RET)
+		});
+	}
+	Function extra = assm.assemble(Code{Instruction(LABEL_DEFN, {late}),
+		Instruction(RET)});
+	// Redefines a label, so the new label it defines must stay undefined
+	const Label clash("x64asm_link_clash");
+	Function redef = assm.assemble(Code{Instruction(LABEL_DEFN, {clash}),
+		Instruction(LABEL_DEFN, {labels[0]}), Instruction(RET)});
+	Function probe = assm.assemble(Code{Instruction(JMP_LABEL, {clash})});
+
+	// Jumps are E9 rel32 after the label
+	const auto check = [&]() {
+		size_t diffs = 0;
+		for (size_t i = 0; i < n; ++i) {
+			const auto p = (const uint8_t*)fs[i].data();
+			int32_t rel;
+			memcpy(&rel, p + 1, 4);
+			const auto target = targets[i] == n ? &extra : &fs[targets[i]];
+			diffs += p + 5 + rel != target->data();
+		}
+		return diffs;
+	};
+
+	// Batches are linked by one thread and then by one per core
+	size_t diffs = 0;
+	cout << setw(12) << "linker" << setw(16) << "fxns/sec" << endl;
+	for (const string mode : {"serial", "parallel", "incremental"}) {
+		for (auto& f : fs) {
+			memset(f.get_buffer() + 1, 0, 4);
+		}
+		Linker lnkr;
+		lnkr.set_threads(mode == "serial" ? 1 : 0);
+		const auto start = chrono::steady_clock::now();
+		for (auto& f : fs) {
+			if (mode == "incremental") {
+				lnkr.add(f);
+			} else {
+				lnkr.link(f);
+			}
+		}
+		lnkr.finish();
+		const auto secs = since(start);
+
+		// Only the late label is missing until the extra function is added
+		diffs += lnkr.pending() != 1;
+		lnkr.add(extra);
+		diffs += !lnkr.good() + check();
+		lnkr.add(redef);
+		lnkr.add(probe);
+		diffs += !lnkr.multiple_def() + (lnkr.pending() != 1);
+
+		cout << setw(12) << mode << setw(16) << (size_t)(n / secs) << endl;
+	}
+	cout << "diffs: " << diffs << endl;
+
+	return diffs == 0 ? 0 : 1;
+}
+
+/** Writes functions to an ELF object, loads the object back, and links it
+	  with assembled functions. Every function in the object returns its index,
+	  except the first, which jumps to an assembled function; an assembled
+	  function jumps back into the object. Checks that every call returns the
+	  right value.
+*/
+int load(size_t n) {
+	const Label jit("x64asm_load_jit");
+	vector<Label> labels;
+	ElfWriter writer;
+	Assembler assm;
+	for (size_t i = 0, ie = max((size_t)2, n / 10); i < ie; ++i) {
+		labels.push_back(Label("x64asm_load_" + to_string(i)));
+		Code c {Instruction(LABEL_DEFN, {labels.back()})};
+		if (i == 0) {
+			c.push_back(Instruction(JMP_LABEL, {jit}));
+		} else {
+			c.push_back(Instruction(MOV_R64_IMM64, {rax, Imm64(i)}));
+			c.push_back(Instruction(RET));
+		}
+		writer.add(assm.assemble(c));
+		writer.global(labels.back());
+	}
+
+	char file[] = "/tmp/x64asm_load_XXXXXX";
+	const auto fd = mkstemp(file);
+	if (fd == -1) {
+		cerr << "Unable to create object file" << endl;
+		return 1;
+	}
+	close(fd);
+	const auto written = writer.write(file);
+
+	// The object is linked with a function it calls and one which calls it
+	const auto start = chrono::steady_clock::now();
+	CodeArena arena;
+	Function obj(arena);
+	ElfLoader loader;
+	const auto loaded = written && loader.load(file, obj);
+	unlink(file);
+	Function callee = assm.assemble(Code{
+		Instruction(LABEL_DEFN, {jit}),
+		Instruction(MOV_R64_IMM64, {rax, Imm64(0)}),
+		Instruction(RET)
+	});
+	Function caller = assm.assemble(Code{Instruction(JMP_LABEL, {labels[1]})});
+	Linker lnkr;
+	lnkr.start();
+	lnkr.link(obj);
+	lnkr.link(callee);
+	lnkr.link(caller);
+	lnkr.finish();
+	const auto secs = since(start);
+
+	if (!loaded || !lnkr.good()) {
+		cerr << "Unable to load or link object file: " << loader.error() << endl;
+		return 1;
+	}
+
+	size_t diffs = loader.symbols().size() != labels.size();
+	for (size_t i = 0, ie = labels.size(); i < ie; ++i) {
+		const auto sym = loader.find_symbol(labels[i].get_text());
+		if (sym == nullptr || !sym->global) {
+			++diffs;
+			continue;
+		}
+		const auto f = (uint64_t(*)())((char*)obj.data() + sym->offset);
+		diffs += f() != i;
+	}
+	diffs += caller.call<uint64_t>() != 1;
+
+	cout << "symbols:       " << loader.symbols().size() << endl;
+	cout << "object bytes:  " << obj.size() << endl;
+	cout << "symbols/sec:   " << (size_t)(labels.size() / secs) << endl;
+	cout << "diffs:         " << diffs << endl;
+
+	return diffs == 0 ? 0 : 1;
+}
+
+/** Links functions which jump to targets more than 2 GB away, and checks
+	  that the jumps are routed through one shared veneer per target and still
+	  reach their targets. Every other function is placed near the targets with
+	  an allocation hint, and must jump directly.
+*/
+int veneer(size_t n) {
+	const size_t k = 16;
+	n = max(n / 100, k);
+
+	// Targets go in an arena of their own; callers go 16 TB away, or near
+	// the targets
+	CodeArena targets_arena;
+	Assembler assm;
+	vector<Function> targets;
+	for (size_t i = 0; i < k; ++i) {
+		targets.emplace_back(targets_arena, 64);
+		assm.assemble(targets.back(), {
+			Instruction(LABEL_DEFN, {Label("x64asm_veneer_" + to_string(i))}),
+			Instruction(MOV_R64_IMM64, {rax, Imm64(i)}),
+			Instruction(RET)
+		});
+	}
+	CodeArena far_arena(1 << 20, false, (const void*)(16ull << 40));
+	CodeArena near_arena(1 << 20, false, targets[0].data());
+	vector<Function> callers;
+	for (size_t i = 0; i < n; ++i) {
+		callers.emplace_back(i % 2 ? near_arena : far_arena, 64);
+		assm.assemble(callers.back(), Code{Instruction(JMP_LABEL,
+			{Label("x64asm_veneer_" + to_string(i / 2 % k))})});
+	}
+
+	Linker lnkr;
+	const auto start = chrono::steady_clock::now();
+	for (auto& f : targets) {
+		lnkr.link(f);
+	}
+	for (auto& f : callers) {
+		lnkr.link(f);
+	}
+	lnkr.finish();
+	const auto secs = since(start);
+
+	// Jumps are E9 rel32
+	const auto far = [](const Function& from, const Function& to) {
+		const auto d = (int64_t)((uint64_t)to.data() - (uint64_t)from.data());
+		return d < INT32_MIN || d > INT32_MAX;
+	};
+	size_t far_calls = 0;
+	size_t diffs = !lnkr.good() || lnkr.veneers() != k;
+	for (size_t i = 0; i < n; ++i) {
+		const auto& target = targets[i / 2 % k];
+		far_calls += far(callers[i], target);
+		diffs += far(callers[i], target) != (i % 2 == 0);
+		diffs += callers[i].call<uint64_t>() != i / 2 % k;
+
+		const auto p = (const uint8_t*)callers[i].data();
+		int32_t rel;
+		memcpy(&rel, p + 1, 4);
+		const auto direct = p + 5 + rel == target.data();
+		diffs += direct == far(callers[i], target);
+	}
+
+	cout << "callers:    " << n << endl;
+	cout << "far calls:  " << far_calls << endl;
+	cout << "veneers:    " << lnkr.veneers() << endl;
+	cout << "links/sec:  " << (size_t)((n + k) / secs) << endl;
+	cout << "diffs:      " << diffs << endl;
+
+	return diffs == 0 ? 0 : 1;
+}
+
+/** Links n callers to callees which are only assembled once they are first
+	  called, and compares linking with assembling every callee up front.
+	  Checks that every call returns the right value, that bound calls are
+	  patched to reach their callees directly, and that stubs which haven't
+	  been bound survive a restart of the linker.
+*/
+int lazy(size_t n) {
+	n = max(n / 100, (size_t)16);
+
+	// Caller i calls callee i, which returns i
+	CodeArena arena;
+	Assembler assm;
+	const auto name = [](size_t i) {
+		return "x64asm_lazy_" + to_string(i);
+	};
+	const auto callee = [&assm, &name](Function& f, size_t i) {
+		assm.assemble(f, {
+			Instruction(LABEL_DEFN, {Label(name(i))}),
+			Instruction(MOV_R64_IMM64, {rax, Imm64(i)}),
+			Instruction(RET)
+		});
+	};
+	vector<Function> callers;
+	for (size_t i = 0; i < n; ++i) {
+		callers.emplace_back(arena, 64);
+		assm.assemble(callers.back(), Code{
+			Instruction(CALL_LABEL, {Label(name(i))}),
+			Instruction(RET)
+		});
+	}
+
+	// Eagerly, every callee is assembled and linked up front
+	auto start = chrono::steady_clock::now();
+	vector<Function> eager;
+	eager.reserve(n);
+	Linker eager_lnkr;
+	for (size_t i = 0; i < n; ++i) {
+		eager.emplace_back(arena, 64);
+		callee(eager.back(), i);
+		eager_lnkr.link(eager.back());
+		eager_lnkr.link(callers[i]);
+	}
+	eager_lnkr.finish();
+	const auto eager_secs = since(start);
+
+	// Lazily, callees are assembled when they are first called
+	unordered_map<uint64_t, size_t> index;
+	for (size_t i = 0; i < n; ++i) {
+		index[Label(name(i))] = i;
+	}
+	vector<Function> lazy;
+	lazy.reserve(n);
+	Linker lnkr;
+	lnkr.set_resolver([&](uint64_t id) {
+		const auto itr = index.find(id);
+		if (itr == index.end()) {
+			return false;
+		}
+		lazy.emplace_back(arena, 64);
+		callee(lazy.back(), itr->second);
+		lnkr.add(lazy.back());
+		return true;
+	});
+	start = chrono::steady_clock::now();
+	for (auto& f : callers) {
+		lnkr.link(f);
+	}
+	lnkr.finish();
+	const auto lazy_secs = since(start);
+
+	// Call every other caller twice. The first call binds the callee, and
+	// patches the call to reach it directly.
+	size_t diffs = !eager_lnkr.good() || !lnkr.good() || lnkr.stubs() != n;
+	size_t direct = 0;
+	for (size_t i = 0; i < n; i += 2) {
+		diffs += callers[i].call<uint64_t>() != i;
+		diffs += callers[i].call<uint64_t>() != i;
+
+		// Calls are E8 rel32
+		const auto p = (const uint8_t*)callers[i].data();
+		int32_t rel;
+		memcpy(&rel, p + 1, 4);
+		direct += p + 5 + rel == lazy[i / 2].data();
+	}
+	const auto bound = lazy.size();
+	diffs += bound != (n + 1) / 2 || direct != bound;
+	diffs += callers[1].call<uint64_t>() != 1 || lazy.size() != bound + 1;
+
+	// After a restart, an unbound stub is still bound by its first call, but
+	// the call to it is left alone. Stubs jump through the address 8 bytes in.
+	lnkr.start();
+	const auto p = (const uint8_t*)callers[3].data();
+	int32_t before, after;
+	memcpy(&before, p + 1, 4);
+	diffs += callers[3].call<uint64_t>() != 3 || lazy.size() != bound + 2;
+	diffs += callers[3].call<uint64_t>() != 3 || lazy.size() != bound + 2;
+	memcpy(&after, p + 1, 4);
+	uint64_t slot;
+	memcpy(&slot, p + 5 + before + 8, 8);
+	diffs += before != after || slot != (uint64_t)lazy.back().data();
+
+	cout << "callers:      " << n << endl;
+	cout << "stubs:        " << lnkr.stubs() << endl;
+	cout << "bound:        " << bound << endl;
+	cout << "direct calls: " << direct << endl;
+	cout << "eager (ms):   " << eager_secs * 1000 << endl;
+	cout << "lazy (ms):    " << lazy_secs * 1000 << endl;
+	cout << "diffs:        " << diffs << endl;
+
+	return diffs == 0 ? 0 : 1;
+}
+
+/** Prints usage. */
+int usage() {
+	cerr << "usage: bench (align|arena|boundary|cache|codecache|decode|elf|engine|grow|huge|image|jcc|labels|lazy|length|linker|load|mutate|relax|scale|scopes|stub|veneer) [instrs]" << endl;
+	return 1;
+}
+
+/** Assembler benchmarks. Exits with non-zero status if a benchmark detects
+	  an inconsistency.
+*/
+int main(int argc, char** argv) {
+	srand(0);
+
+	if (argc < 2) {
+		return usage();
+	}
+	const string mode = argv[1];
+	const size_t n = argc > 2 ? atoi(argv[2]) : 100000;
+
+	if (mode == "align") {
+		return align(n);
+	} else if (mode == "arena") {
+		return arena(n);
+	} else if (mode == "boundary") {
+		return boundary(n);
+	} else if (mode == "cache") {
+		return cache(n);
+	} else if (mode == "codecache") {
+		return codecache(n);
+	} else if (mode == "decode") {
+		return decode(n);
+	} else if (mode == "elf") {
+		return elf(n);
+	} else if (mode == "engine") {
+		return engine(n);
+	} else if (mode == "grow") {
+		return grow(n);
+	} else if (mode == "huge") {
+		return huge(n);
+	} else if (mode == "image") {
+		return image(n);
+	} else if (mode == "jcc") {
+		return jcc(n);
+	} else if (mode == "labels") {
+		return labels(n);
+	} else if (mode == "lazy") {
+		return lazy(n);
+	} else if (mode == "length") {
+		return length(n);
+	} else if (mode == "linker") {
+		return linker(n);
+	} else if (mode == "load") {
+		return load(n);
+	} else if (mode == "mutate") {
+		return mutate(n);
+	} else if (mode == "relax") {
+		return relax(n);
+	} else if (mode == "scale") {
+		return scale(n);
+	} else if (mode == "scopes") {
+		return scopes(n);
+	} else if (mode == "stub") {
+		return stub(n);
+	} else if (mode == "veneer") {
+		return veneer(n);
+	}
+	return usage();
+}
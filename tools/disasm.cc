@@ -0,0 +1,85 @@
+#include <iostream>
+#include <string>
+
+#include "include/x64asm.h"
+
+using namespace std;
+using namespace x64asm;
+
+/** Prints usage. */
+int usage() {
+	cerr << "Usage: disasm <elf file> [function]" << endl;
+	return 1;
+}
+
+/** Prints a read error. */
+int read_error() {
+	cerr << "Unable to read input file!" << endl;
+	return 1;
+}
+
+/** Disassembles a single function. */
+int one_function(ElfReader& elf, const string& name) {
+	const auto sym = elf.find_symbol(name);
+	if (sym == nullptr) {
+		cerr << "Unable to find function " << name << "!" << endl;
+		return 1;
+	}
+
+	Code c;
+	const auto ok = elf.function(*sym, c);
+	cout << c << endl;
+
+	if (!ok) {
+		cerr << "Unable to decode all of " << name << "!" << endl;
+		return 1;
+	}
+	return 0;
+}
+
+/** Streams every executable section to stdout in bounded chunks. */
+int all_sections(ElfReader& elf) {
+	Code chunk;
+	size_t sec = elf.sections().size();
+	uint64_t next = 0;
+	uint64_t instrs = 0;
+
+	while (true) {
+		// Symbol names are only needed until the chunk is printed
+		LabelScope scope;
+		if (!elf.next(chunk)) {
+			break;
+		}
+		if (elf.chunk_section() != sec) {
+			sec = elf.chunk_section();
+			cout << endl << "# " << elf.sections()[sec].name << endl;
+		} else if (elf.chunk_addr() != next) {
+			cout << "# ..." << endl;
+		}
+		cout << "# 0x" << hex << elf.chunk_addr() << dec << endl;
+		cout << chunk << endl;
+
+		next = elf.chunk_addr() + elf.chunk_size();
+		for (const auto& instr : chunk) {
+			instrs += instr.get_opcode() != LABEL_DEFN;
+		}
+	}
+
+	cerr << "Decoded " << instrs << " instructions and skipped "
+		<< elf.skipped() << " bytes" << endl;
+	return 0;
+}
+
+/** Disassembles the executable sections of an ELF file. */
+int main(int argc, char** argv) {
+	if (argc < 2 || argc > 3) {
+		return usage();
+	}
+
+	ElfReader elf;
+	if (!elf.open(argv[1])) {
+		return read_error();
+	}
+
+	return argc == 3 ? one_function(elf, argv[2]) : all_sections(elf);
+}
@@ -20,8 +20,13 @@ set<Opcode> bad_asm_ {};
 set<Opcode> bad_hex_ {};
 
 Opcode opcode() {
+	// Alignment directives don't have encodings of their own
 	const auto num_opcs = (size_t)XTEST + 1;
-	return (Opcode)(rand() % num_opcs);
+	auto opc = (Opcode)(rand() % num_opcs);
+	while (opc == P2ALIGN) {
+		opc = (Opcode)(rand() % num_opcs);
+	}
+	return opc;
 }
 
 Hint hint() {